@@ -27,7 +27,9 @@ typedef struct account account_t;
 /**
  * Create a new block linked to the specified parent block containing the
  * given list of transactions. By default, the block will be set with a
- * timestamp of the current system time. 
+ * timestamp of the current system time. The block takes ownership of the
+ * transaction list. If the block cannot be created, the transactions are
+ * destroyed and NULL is returned.
  * 
  * @param public_key the public key of the block creator.
  * @param private_key the private key of the block creator.
@@ -41,6 +43,73 @@ block_t* block_create(
     list_t *txns
 );
 
+/**
+ * The block_builder_t struct assembles the transaction list of a new block
+ * one transaction at a time. Each transaction is applied to a pending ledger
+ * state on top of the previous block, so transactions that would overdraw
+ * the sender's account are skipped instead of invalidating the whole block.
+ * The merkle root is updated incrementally as transactions are appended.
+ */
+typedef struct block_builder block_builder_t;
+
+/**
+ * Create a block builder for a block created by the given public key on top
+ * of the given previous block. The builder accepts transactions until their
+ * total tuple representation would exceed max_size bytes.
+ * 
+ * @param prev the previous block in the hashchain.
+ * @param public_key the public key of the block creator.
+ * @param max_size the maximum size of all transactions in bytes.
+ * @return the block builder
+ */
+block_builder_t* block_builder_create(block_t *prev, const uint8_t *public_key, size_t max_size);
+
+/**
+ * Apply the transaction to the pending ledger state and append it to the
+ * block. If the sender cannot afford the transaction or the block is full,
+ * return false and leave the transaction untouched. Otherwise, the builder
+ * takes ownership of the transaction and returns true.
+ * 
+ * @param builder the block builder
+ * @param txn the transaction
+ * @return true if the transaction was added to the block
+ */
+bool block_builder_add(block_builder_t *builder, transaction_t *txn);
+
+/**
+ * Return the number of transactions added to the block builder.
+ * 
+ * @param builder the block builder
+ * @return the number of transactions
+ */
+size_t block_builder_get_transaction_count(block_builder_t *builder);
+
+/**
+ * Write the merkle root of all transactions added so far to result.
+ * 
+ * @param builder the block builder
+ * @param result a buffer of crypto_generichash_BYTES bytes
+ */
+void block_builder_get_merkle_root(block_builder_t *builder, uint8_t *result);
+
+/**
+ * Create the block containing all added transactions and destroy the builder.
+ * If the block cannot be created, the transactions are destroyed and NULL is
+ * returned.
+ * 
+ * @param builder the block builder
+ * @param private_key the private key of the block creator.
+ * @return the block or NULL
+ */
+block_t* block_builder_finish(block_builder_t *builder, const uint8_t *private_key);
+
+/**
+ * Destroy the block builder and all transactions added to it.
+ * 
+ * @param builder the block builder
+ */
+void block_builder_destroy(block_builder_t *builder);
+
 /**
  * Create a block from its tuple representation using the given 'find' function
  * to create references between blocks. If the tuple is invalid, return NULL.
@@ -51,6 +120,24 @@ block_t* block_create(
  */
 block_t* block_create_from_tuple(tuple_t *tuple, block_t* (*find)(buffer_t));
 
+/**
+ * Return true if the tuple is a well-formed block header. This is a cheap
+ * structural check that does not verify the signature or sortition proof.
+ *
+ * @param tuple the tuple representation of the block header
+ * @return whether or not the tuple is a well-formed block header
+ */
+bool block_header_is_valid(tuple_t *tuple);
+
+/**
+ * Return true if the tuple is a well-formed block whose merkle root matches
+ * its transactions. This does not check the block against the blockchain.
+ *
+ * @param tuple the tuple representation of the block
+ * @return whether or not the tuple is a well-formed block
+ */
+bool block_is_valid(tuple_t *tuple);
+
 /**
  * Add a child block to a block's list of children. This allows all forks of
  * the blockchain tree to be traversed from the root node down. Currently,
@@ -214,6 +301,18 @@ uint64_t account_get_value(const account_t *account);
  */
 void block_write(block_t *block, dynamic_buffer_t *buf);
 
+/**
+ * Write the compact representation of the block to a dynamic buffer: the
+ * header, the signature and a binary of the 8-byte big-endian short ids of
+ * its transactions. The short ids are keyed with the first
+ * TRANSACTION_SHORT_ID_KEY_BYTES bytes of the block hash, so a receiver can
+ * derive the key from the header alone.
+ *
+ * @param block the block
+ * @param buf the buffer to write to
+ */
+void block_write_compact(block_t *block, dynamic_buffer_t *buf);
+
 /**
  * Write a tuple representation of the block header to a dynamic buffer.
  * 
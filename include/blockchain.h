@@ -78,6 +78,16 @@ transaction_t *blockchain_get_transaction(blockchain_t *bc, buffer_t hash);
  */
 block_t *blockchain_get_principal(blockchain_t *bc);
 
+/**
+ * Return a pointer to the block at the given height of the current principal
+ * block chain, or NULL if the principal block chain is not that high. The
+ * first block has height 1.
+ *
+ * @param bc the blockchain.
+ * @param height the height of the block.
+ */
+block_t *blockchain_get_principal_at(blockchain_t *bc, size_t height);
+
 /**
  * Destroy the blockchain data structure and free all blocks and transactions
  * stored in the blockchain.
@@ -0,0 +1,123 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <network.h>
+
+/**
+ * The download_t struct schedules the download of block bodies from several
+ * peers at once. Blocks are added by hash in height order once their headers
+ * have been checked. The scheduler splits the missing blocks into windows of
+ * consecutive blocks and requests each window from a different peer, keeping
+ * a bounded number of windows in flight per peer. Blocks that a peer does
+ * not deliver, or not deliver in time, are requested again from another
+ * peer, and blocks that no peer delivers are eventually given up. Received
+ * bodies are buffered and handed to the deliver callback strictly in the
+ * order the blocks were added, so every block is validated after its
+ * previous block.
+ */
+typedef struct download download_t;
+
+/**
+ * Create a new download scheduler.
+ *
+ * @param request a callback that requests the bodies of n blocks with the
+ * given concatenated hashes from the peer. The window identifies the request
+ * and is never 0; the response is passed to download_complete with it.
+ * @param deliver a callback that receives the next block body in order.
+ * @return the download scheduler
+ */
+download_t* download_create(
+    void (*request)(peer_t *peer, uint64_t window, const uint8_t *hashes, size_t n),
+    void (*deliver)(const uint8_t *body, size_t length)
+);
+
+/**
+ * Destroy the download scheduler and all buffered block bodies.
+ *
+ * @param self the download scheduler
+ */
+void download_destroy(download_t *self);
+
+/**
+ * Add a block to download after all blocks added before it. Blocks that are
+ * already being downloaded are ignored.
+ *
+ * @param self the download scheduler
+ * @param hash the hash of the block
+ * @return true if the block was added and false otherwise
+ */
+bool download_add(download_t *self, const uint8_t *hash);
+
+/**
+ * Make a peer available for downloading block bodies.
+ *
+ * @param self the download scheduler
+ * @param peer the peer
+ */
+void download_add_peer(download_t *self, peer_t *peer);
+
+/**
+ * Remove a peer, for instance because it has disconnected. The blocks that
+ * were requested from the peer are requested from other peers instead.
+ *
+ * @param self the download scheduler
+ * @param peer the peer
+ */
+void download_remove_peer(download_t *self, peer_t *peer);
+
+/**
+ * Store the body of a block that is being downloaded and deliver all bodies
+ * that are now next in order. The body is copied.
+ *
+ * @param self the download scheduler
+ * @param hash the hash of the block
+ * @param body the body of the block
+ * @param length the length of the body
+ * @return true if the block was being downloaded and false otherwise
+ */
+bool download_receive(download_t *self, const uint8_t *hash, const uint8_t *body, size_t length);
+
+/**
+ * Record that the peer has answered the request of the given window. The
+ * blocks of the request that did not arrive are requested from other peers
+ * instead. Answers to windows that have already been taken back from the
+ * peer, or that were never requested from it, are ignored.
+ *
+ * @param self the download scheduler
+ * @param peer the peer
+ * @param window the window passed to the request callback
+ */
+void download_complete(download_t *self, peer_t *peer, uint64_t window);
+
+/**
+ * Request the blocks of peers that have timed out from other peers and
+ * assign windows of blocks that have not been requested to peers with room
+ * for more windows.
+ *
+ * @param self the download scheduler
+ * @param now the current time in milliseconds
+ */
+void download_schedule(download_t *self, uint64_t now);
+
+/**
+ * Return whether a block has been added and has not been delivered yet.
+ *
+ * @param self the download scheduler
+ * @param hash the hash of the block
+ * @return true if the block is being downloaded and false otherwise
+ */
+bool download_has(download_t *self, const uint8_t *hash);
+
+/**
+ * Return the number of blocks that have not been delivered yet.
+ *
+ * @param self the download scheduler
+ * @return the number of blocks
+ */
+size_t download_size(download_t *self);
+
+#endif /* DOWNLOAD_H */
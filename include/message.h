@@ -7,6 +7,14 @@
 #define MESSAGE_MAGIC_NUMBER 0x54524a54
 #define MESSAGE_HEADER_SIZE (2 * sizeof(uint32_t) + sizeof(guid_t) + sizeof(uint16_t))
 
+/*
+ * Flag set in the type of a message whose payload is compressed: the
+ * big-endian u32 length of the original payload followed by the payload
+ * compressed with zlib. The guid of a compressed message is the guid of the
+ * original message.
+ */
+#define MESSAGE_COMPRESSED 0x8000
+
 guid_t message_get_guid(uint8_t *message);
 uint32_t message_get_length(uint8_t *message);
 uint32_t message_get_magic(uint8_t *message);
@@ -17,4 +25,12 @@ void message_set_length(uint8_t *message, uint32_t length);
 void message_set_magic(uint8_t *message, uint32_t magic);
 void message_set_type(uint8_t *message, uint16_t type);
 
+/*
+ * Return the guid of a broadcast message with the given type and payload: the
+ * 128-bit BLAKE2b hash of the big-endian type followed by the payload. Copies
+ * of the same block or transaction broadcast by different nodes get the same
+ * guid, so they are deduplicated at the first hop. The result is never null.
+ */
+guid_t message_content_guid(uint16_t type, const uint8_t *payload, uint32_t length);
+
 #endif /* MESSAGE_H */
\ No newline at end of file
@@ -17,9 +17,38 @@ enum {
     EVENT_POOL_RESPONSE,
     EVENT_BLOCK,
     EVENT_TRANSACTION,
+    EVENT_POOL_FETCH,
+    EVENT_POOL_INVENTORY,
+    EVENT_INV,
+    EVENT_GETDATA,
+    EVENT_COMPACT_BLOCK,
+    EVENT_BLOCK_TXNS_REQUEST,
+    EVENT_BLOCK_TXNS_RESPONSE,
+    EVENT_HEADERS_REQUEST,
+    EVENT_HEADERS_RESPONSE,
+    EVENT_NOTFOUND,
     EVENT_COUNT,
 };
 
+/*
+ * Optional protocol features. Nodes announce the features they support in
+ * their handshake, and a feature is only used on a connection once both
+ * sides have announced it, so nodes with different feature sets interoperate.
+ * Without a feature, peers fall back to the plain protocol:
+ *
+ * NETWORK_FEATURE_COMPRESSION: large payloads are sent uncompressed.
+ * NETWORK_FEATURE_INV_RELAY: broadcasts are pushed in full, not announced.
+ * NETWORK_FEATURE_COMPACT_BLOCKS: new blocks are relayed in full.
+ * NETWORK_FEATURE_RECONCILIATION: pools are synchronized by listing all
+ * short transaction ids instead of exchanging a sketch.
+ */
+#define NETWORK_FEATURE_COMPRESSION (1 << 0)
+#define NETWORK_FEATURE_INV_RELAY (1 << 1)
+#define NETWORK_FEATURE_COMPACT_BLOCKS (1 << 2)
+#define NETWORK_FEATURE_RECONCILIATION (1 << 3)
+#define NETWORK_FEATURES (NETWORK_FEATURE_COMPRESSION | NETWORK_FEATURE_INV_RELAY \
+    | NETWORK_FEATURE_COMPACT_BLOCKS | NETWORK_FEATURE_RECONCILIATION)
+
 typedef struct peer peer_t;
 char* peer_get_addr(peer_t *peer);
 int peer_get_port(peer_t *peer);
@@ -54,6 +83,38 @@ char* peer_get_addr(peer_t *peer);
  */
 int peer_get_port(peer_t *peer);
 
+/**
+ * Return the features enabled on the connection with the peer, which are
+ * none until they are set after the handshake.
+ * @param peer the peer
+ * @return the NETWORK_FEATURE_* bits enabled for the peer
+ */
+uint32_t peer_get_features(peer_t *peer);
+
+/**
+ * Enable the given features on the connection with the peer. Only features
+ * supported by both nodes should be enabled.
+ * @param peer the peer
+ * @param features the NETWORK_FEATURE_* bits to enable
+ */
+void peer_set_features(peer_t *peer, uint32_t features);
+
+/**
+ * Return the maximum payload size of the messages the peer accepts, which
+ * is the maximum size we accept until it is set after the handshake.
+ * Larger messages are not sent to the peer.
+ * @param peer the peer
+ * @return the maximum payload size in bytes
+ */
+uint32_t peer_get_max_message_size(peer_t *peer);
+
+/**
+ * Set the maximum payload size of the messages the peer accepts.
+ * @param peer the peer
+ * @param size the maximum payload size in bytes
+ */
+void peer_set_max_message_size(peer_t *peer, uint32_t size);
+
 /**
  * Return the extra data field associated with the field.
  * This is an application specific value.
@@ -116,7 +177,10 @@ void network_disconnect(network_t *self, peer_t *peer);
 int network_listen(network_t *self, int port, int backlog);
 
 /**
- * Send a message to a specific peer node.
+ * Send a message to a specific peer node. The network takes ownership of the
+ * heap allocated data of the buffer and frees it once the message has been
+ * written, so the payload is never copied. The buffer is left empty, with
+ * its data set to NULL.
  * @param self the network
  * @param event the message type (application defined) 
  * @param buffer a buffer containing a valid binary tuple
@@ -125,7 +189,14 @@ int network_listen(network_t *self, int port, int backlog);
 void network_send(network_t *self, uint32_t event, buffer_t *buffer, peer_t *peer);
 
 /**
- * Send a message to all nodes in the network.
+ * Send a message to all nodes in the network. The message is identified by
+ * the hash of its type and payload, so a block or transaction that is
+ * broadcast by several nodes is only relayed once by each node. Nodes only
+ * announce the identifier of the message to their peers, and each peer
+ * fetches the message itself from one of the nodes that announced it.
+ * Received blocks are not relayed until the application broadcasts them
+ * again once it has accepted them. Like network_send, this takes ownership
+ * of the data of the buffer.
  * @param self the network
  * @param event the message type (application defined) 
  * @param buffer a buffer containing a valid binary tuple
@@ -7,14 +7,22 @@
  * The pool structure represents a pool of unconfirmed transactions.
  * When constructing a block, nodes should pull pending transactions from
  * the memory pool.
+ *
+ * Transactions are grouped by sender. The pool tracks the total value of
+ * each sender's pending transactions and only admits a transaction if the
+ * sender can afford it on the principal blockchain. Transactions that the
+ * sender cannot yet afford are parked until the sender's balance changes.
  */
 typedef struct pool pool_t;
 
 /**
- * Construct a new empty transaction pool
+ * Construct a new empty transaction pool that uses the given callback to
+ * query the balance of an account on the principal blockchain.
+ *
+ * @param balance a callback returning the balance of a public key.
  * @return an empty transaction pool.
  */
-pool_t* pool_create();
+pool_t* pool_create(uint64_t (*balance)(const uint8_t *public_key));
 
 /**
  * Destroy the given memory pool and free all associated memory.
@@ -23,22 +31,93 @@ pool_t* pool_create();
 void pool_destroy(pool_t *pool);
 
 /**
- * Return the number of transactions remaining in the pool
+ * Return the number of admitted transactions remaining in the pool. Parked
+ * transactions are not included.
+ *
  * @param pool the transaction pool
  * @return the number of transactions in the pool
  */
 size_t pool_size(pool_t *pool);
 
 /**
- * Add a transaction to the pool if it does not already exist. 
+ * Return true if a transaction with the given hash is in the pool, either
+ * admitted or parked.
+ *
+ * @param pool the transaction pool.
+ * @param hash the transaction hash.
+ * @return whether the transaction is in the pool.
+ */
+bool pool_has(pool_t *pool, const uint8_t *hash);
+
+/**
+ * Add a transaction to the pool if it does not already exist.
  * Otherwise, destroy the transaction. Transactions are compared for equality
  * by comparing their hashes.
- * 
+ *
+ * If the sender cannot afford the transaction in addition to their other
+ * pending transactions, the transaction is parked. If the sender already
+ * has too many parked transactions, the transaction is destroyed.
+ *
  * @param pool the transaction pool.
  * @param txn the transacton.
  */
 void pool_add(pool_t *pool, transaction_t *txn);
 
+/**
+ * Add a transaction restored from disk to the pool. This is the same as
+ * pool_add except that the transaction is always kept: if the sender cannot
+ * afford it, it is parked even if the sender already has too many parked
+ * transactions. This lets a node restore its pool before it has synchronized
+ * the balances of the senders.
+ *
+ * @param pool the transaction pool.
+ * @param txn the transaction.
+ */
+void pool_restore(pool_t *pool, transaction_t *txn);
+
+/**
+ * Write all transactions in the pool, both admitted and parked, to the
+ * buffer as a tuple of transactions.
+ *
+ * @param pool the transaction pool.
+ * @param buf the output buffer.
+ */
+void pool_write(pool_t *pool, dynamic_buffer_t *buf);
+
+/**
+ * Remove and destroy the transaction with the given hash if it is in the
+ * pool. This should be called for every transaction confirmed by a block
+ * that joins the principal blockchain.
+ *
+ * @param pool the transaction pool.
+ * @param hash the transaction hash.
+ */
+void pool_evict(pool_t *pool, const uint8_t *hash);
+
+/**
+ * Re-check the transactions sent by the given public key against its current
+ * balance. This should be called for every account whose balance changes
+ * when the principal blockchain changes. Admitted transactions that the
+ * sender can no longer afford are parked, and parked transactions that the
+ * sender can now afford are admitted.
+ *
+ * @param pool the transaction pool.
+ * @param public_key the public key of the sender.
+ */
+void pool_update(pool_t *pool, const uint8_t *public_key);
+
+/**
+ * Offer every admitted transaction to the accept callback in a single pass
+ * over the pool and remove the transactions it accepts. Ownership of each
+ * accepted transaction passes to the callback. Rejected transactions remain
+ * in the pool.
+ *
+ * @param pool the transaction pool.
+ * @param accept a callback returning true if it takes the transaction.
+ * @param ctx the context passed to the callback.
+ */
+void pool_take(pool_t *pool, bool (*accept)(void *ctx, transaction_t *txn), void *ctx);
+
 /**
  * Get the transaction at the specified index.
  * @param pool the transaction pool.
@@ -48,11 +127,12 @@ void pool_add(pool_t *pool, transaction_t *txn);
 transaction_t* pool_get(pool_t *pool, size_t index);
 
 /**
- * Remove and return the transaction with the specified index.
+ * Remove and return the transaction with the specified index. The order of
+ * the remaining transactions is not preserved.
  * @param pool the transaction pool.
  * @param index the transaction index.
  * @return a pointer to the transaction.
  */
 transaction_t* pool_remove(pool_t *pool, size_t index);
 
-#endif /* POOL_H */
\ No newline at end of file
+#endif /* POOL_H */
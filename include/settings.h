@@ -4,12 +4,28 @@
 #define DEFAULT_PORT 1960
 #define DEFAULT_SHOULD_LISTEN 1
 #define DEFAULT_BACKLOG 128
+#define DEFAULT_MAX_BLOCK_SIZE (1 << 20)
+#define DEFAULT_POOL_SAVE_INTERVAL 60
+#define DEFAULT_SEEN_FILTER_CAPACITY (1 << 20)
+#define DEFAULT_SEEN_FILTER_FP_RATE 0.0001
+#define DEFAULT_FEATURES (~0u)
+#define DEFAULT_MAX_MESSAGE_SIZE (32 << 20)
+#define DEFAULT_NETWORK_THREADS 2
 #define MAX_INITIAL_CONNECTIONS 64
+#define MAX_PATH_LENGTH 256
 
 struct settings_t {
     int port;
     int backlog;
     int should_listen;
+    int max_block_size;
+    char pool_file[MAX_PATH_LENGTH];
+    int pool_save_interval;
+    int seen_filter_capacity;
+    double seen_filter_fp_rate;
+    unsigned int features;
+    int max_message_size;
+    int network_threads;
     char peer_addresses[MAX_INITIAL_CONNECTIONS][16];
     int peer_ports[MAX_INITIAL_CONNECTIONS];
     int n_peer_connections;
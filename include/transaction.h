@@ -4,6 +4,8 @@
 #include <util/buffer.h>
 #include <tuple.h>
 
+#define TRANSACTION_SHORT_ID_KEY_BYTES 16
+
 /*
  * A transaction represents a transfer of value from one entity to another.
  * A transaction contains the public keys identifying the sender and the
@@ -35,6 +37,14 @@ transaction_t* transaction_create(
     uint32_t nonce
 );
 
+/**
+ * Create a copy of the given transaction.
+ * 
+ * @param txn the transaction
+ * @return the copy
+ */
+transaction_t* transaction_copy(const transaction_t *txn);
+
 /**
  * Create a transaction from its tuple representation. Return NULL if the
  * transaction is invalid. A tuple can be checked for validity without creating
@@ -100,6 +110,26 @@ uint32_t transaction_get_nonce(const transaction_t *txn);
  */
 const uint8_t* transaction_get_hash(const transaction_t *txn);
 
+/**
+ * Return the length in bytes of the tuple representation of the transaction.
+ * Since all fields have a fixed size, this is the same for every transaction.
+ * 
+ * @param txn the transaction
+ * @return the size of the transaction in bytes.
+ */
+size_t transaction_get_size(const transaction_t *txn);
+
+/**
+ * Return a 64-bit short id of the transaction: a keyed hash of the transaction
+ * hash. Peers agree on a random key for each exchange so that an attacker cannot
+ * craft transactions with colliding short ids.
+ * 
+ * @param txn the transaction
+ * @param key a key of TRANSACTION_SHORT_ID_KEY_BYTES bytes
+ * @return the short id of the transaction.
+ */
+uint64_t transaction_get_short_id(const transaction_t *txn, const uint8_t *key);
+
 /**
  * Destroy the transaction and free all associated memory.
  * 
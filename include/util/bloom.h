@@ -0,0 +1,67 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The bloom_t type is a rotating Bloom filter that remembers at least the
+ * most recent capacity keys added to it. It keeps two generations of Bloom
+ * filters: keys are added to the current generation, and once it holds
+ * capacity keys it replaces the previous generation and a new empty
+ * generation is started. A key is reported as present if either generation
+ * contains it.
+ *
+ * Keys that were never added are reported as present with a probability of
+ * at most the false positive rate. Bit positions are derived from a keyed
+ * hash with a random key per filter, so peers cannot choose keys that
+ * collide in our filter.
+ */
+typedef struct bloom bloom_t;
+
+/**
+ * Construct an empty filter that remembers at least the last capacity keys
+ * with the given false positive rate.
+ *
+ * @param capacity the number of keys per generation
+ * @param fp_rate the false positive rate, between 0 and 1
+ * @return the filter
+ */
+bloom_t* bloom_create(size_t capacity, double fp_rate);
+
+/**
+ * Destroy the filter and free all associated memory.
+ * @param self the filter
+ */
+void bloom_destroy(bloom_t *self);
+
+/**
+ * Return the memory used by the bit arrays of the filter in bytes.
+ * @param self the filter
+ * @return the size of the filter in bytes
+ */
+size_t bloom_get_size(const bloom_t *self);
+
+/**
+ * Return true if the key may have been added to the filter and false if it
+ * was definitely not added since it was last rotated out.
+ *
+ * @param self the filter
+ * @param key the key
+ * @param length the length of the key in bytes
+ * @return whether the key may be in the filter
+ */
+bool bloom_has(const bloom_t *self, const uint8_t *key, size_t length);
+
+/**
+ * Add the key to the filter, rotating generations if the current one is
+ * full.
+ *
+ * @param self the filter
+ * @param key the key
+ * @param length the length of the key in bytes
+ */
+void bloom_add(bloom_t *self, const uint8_t *key, size_t length);
+
+#endif /* BLOOM_H */
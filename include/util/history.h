@@ -0,0 +1,57 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "util/guid.h"
+
+/**
+ * The history_t type remembers the most recent guids added to it, up to a
+ * fixed capacity. Once full, adding a guid forgets the oldest one. The guids
+ * are kept in a ring buffer in arrival order and indexed by an open-addressed
+ * hash set sized so that it never grows, so lookups and evictions take
+ * constant time and never allocate.
+ */
+typedef struct history history_t;
+
+/**
+ * Construct an empty history that remembers up to capacity guids.
+ * 
+ * @param capacity the maximum number of guids
+ * @return the history
+ */
+history_t* history_create(size_t capacity);
+
+/**
+ * Destroy the history and free all associated memory.
+ * @param self the history
+ */
+void history_destroy(history_t *self);
+
+/**
+ * Return the number of guids in the history.
+ * @param self the history
+ * @return the number of guids
+ */
+size_t history_size(const history_t *self);
+
+/**
+ * Return true if the guid is in the history.
+ * 
+ * @param self the history
+ * @param guid the guid
+ * @return whether the guid is in the history
+ */
+bool history_has(const history_t *self, guid_t guid);
+
+/**
+ * Add the guid to the history if it is not already in it, forgetting the
+ * oldest guid if the history is full.
+ * 
+ * @param self the history
+ * @param guid the guid
+ * @return false if the guid was already in the history
+ */
+bool history_add(history_t *self, guid_t guid);
+
+#endif /* HISTORY_H */
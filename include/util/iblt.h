@@ -0,0 +1,102 @@
+#ifndef IBLT_H
+#define IBLT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <util/buffer.h>
+
+/**
+ * The iblt_t type is an invertible Bloom lookup table of 64-bit keys. Two
+ * peers can reconcile their sets by exchanging tables: subtracting one table
+ * from the other leaves only the keys held by exactly one of the peers, and
+ * those keys can be listed as long as there are not too many of them. A table
+ * with n cells decodes a difference of up to roughly 2n/3 keys.
+ */
+typedef struct iblt iblt_t;
+
+/**
+ * The size in bytes of a single serialized cell.
+ */
+#define IBLT_CELL_SIZE 16
+
+/**
+ * Construct an empty table with the given number of cells. The number of
+ * cells is rounded up to a multiple of the number of hash functions.
+ *
+ * @param n_cells the minimum number of cells.
+ * @return the table.
+ */
+iblt_t* iblt_create(size_t n_cells);
+
+/**
+ * Construct a table from a buffer written by iblt_write. Return NULL if the
+ * buffer is not a valid table.
+ *
+ * @param buffer the serialized table.
+ * @return the table or NULL.
+ */
+iblt_t* iblt_create_from_buffer(buffer_t buffer);
+
+/**
+ * Destroy the table and free all associated memory.
+ * @param self the table.
+ */
+void iblt_destroy(iblt_t *self);
+
+/**
+ * Return the number of cells in the table.
+ * @param self the table.
+ * @return the number of cells.
+ */
+size_t iblt_size(const iblt_t *self);
+
+/**
+ * Insert a key into the table.
+ * @param self the table.
+ * @param key the key.
+ */
+void iblt_insert(iblt_t *self, uint64_t key);
+
+/**
+ * Remove a key from the table. The key does not need to have been inserted,
+ * in which case decoding lists it as a removed key.
+ *
+ * @param self the table.
+ * @param key the key.
+ */
+void iblt_remove(iblt_t *self, uint64_t key);
+
+/**
+ * Subtract the other table from this table. After subtraction, this table
+ * holds the keys only inserted into this table as inserted keys and the keys
+ * only inserted into the other table as removed keys. Return false and leave
+ * the table unchanged if the tables have different sizes.
+ *
+ * @param self the table.
+ * @param other the table to subtract.
+ * @return whether the tables could be subtracted.
+ */
+bool iblt_subtract(iblt_t *self, const iblt_t *other);
+
+/**
+ * List the keys in the table by calling found once for each key with whether
+ * the key was inserted or removed. Decoding empties the table. Return false if
+ * the table holds too many keys to be listed completely, in which case found
+ * may have been called for some but not all of the keys.
+ *
+ * @param self the table.
+ * @param found the callback for each key.
+ * @param ctx the context passed to the callback.
+ * @return whether every key was listed.
+ */
+bool iblt_decode(iblt_t *self, void (*found)(void *ctx, uint64_t key, bool inserted), void *ctx);
+
+/**
+ * Write the serialized cells of the table to the buffer.
+ * @param self the table.
+ * @param buffer the output buffer.
+ */
+void iblt_write(const iblt_t *self, dynamic_buffer_t *buffer);
+
+#endif /* IBLT_H */
@@ -60,6 +60,15 @@ void* list_get(list_t *list, size_t i);
  */
 void* list_remove(list_t *list, size_t i);
 
+/**
+ * Remove the ith element from the list by replacing it with the last element
+ * and return the removed element. This runs in constant time but does not
+ * preserve the order of the list. Assert that the index is valid.
+ * 
+ * @return the ith element.
+ */
+void* list_swap_remove(list_t *list, size_t i);
+
 /**
  * Return the index of the element e in the list by performing a linear search
  * with the given compare function. If the element is not found, this function
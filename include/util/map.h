@@ -2,6 +2,7 @@
 #define HASH_MAP_H
 
 #include "buffer.h"
+#include <stdbool.h>
 
 /**
  * The map_t data structure is a simple generic hash map implementation
@@ -63,6 +64,35 @@ void* map_get(const map_t *map, const void *key);
  */
 void* map_set(map_t *map, void *key, void *value);
 
+/**
+ * Return a pointer to the value of the given key, inserting the key with a
+ * NULL value if it is not in the map. This hashes and probes for the key only
+ * once, so it should be used instead of map_get followed by map_set. If the
+ * key is inserted, the map takes ownership of the key and the caller should
+ * store a value through the returned pointer. The pointer is only valid until
+ * the map is modified.
+ * 
+ * @param map the map
+ * @param key the key
+ * @param inserted set to whether the key was inserted, unused if NULL
+ * @return a pointer to the value of the key.
+ */
+void** map_get_or_insert(map_t *map, void *key, bool *inserted);
+
+/**
+ * Advance the cursor to the next entry of the map and return the key and
+ * value of the entry. The cursor should be initialized to zero. Entries are
+ * visited in no particular order, and the map must not be modified during
+ * iteration.
+ * 
+ * @param map the map
+ * @param cursor the iteration cursor
+ * @param key set to the key of the entry, unused if NULL
+ * @param val set to the value of the entry, unused if NULL
+ * @return false if there are no more entries.
+ */
+bool map_next(const map_t *map, size_t *cursor, void **key, void **val);
+
 /**
  * Remove and return the element with the given key. If no element with the
  * given key exists, return NULL.
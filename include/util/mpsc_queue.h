@@ -0,0 +1,53 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <stddef.h>
+
+/**
+ * The mpsc_queue_t type is an unbounded first-in first-out queue of pointers
+ * that any number of threads may push to while a single thread pops from it.
+ * It is lock-free: a push is one atomic exchange and never waits for other
+ * threads, and a pop never waits either. Items pushed by one thread are
+ * popped in the order they were pushed.
+ *
+ * A pop that overlaps with a push may not see the pushed item yet, so a
+ * consumer that is woken up after each push, for instance by a uv_async_t,
+ * should pop until the queue appears empty.
+ */
+typedef struct mpsc_queue mpsc_queue_t;
+
+/**
+ * Construct an empty queue.
+ *
+ * @return the queue
+ */
+mpsc_queue_t* mpsc_queue_create();
+
+/**
+ * Destroy the queue and free all associated memory. No other thread may use
+ * the queue anymore.
+ *
+ * @param self the queue
+ * @param destroy the destructor called on each item left in the queue, or
+ * NULL to leave the items alone
+ */
+void mpsc_queue_destroy(mpsc_queue_t *self, void (*destroy)(void*));
+
+/**
+ * Add an item at the back of the queue. Any thread may call this function.
+ *
+ * @param self the queue
+ * @param item the item, which may not be NULL
+ */
+void mpsc_queue_push(mpsc_queue_t *self, void *item);
+
+/**
+ * Remove the item at the front of the queue. Only the consumer thread may
+ * call this function.
+ *
+ * @param self the queue
+ * @return the item, or NULL if the queue is empty
+ */
+void* mpsc_queue_pop(mpsc_queue_t *self);
+
+#endif /* MPSC_QUEUE_H */
@@ -0,0 +1,96 @@
+#ifndef TYPED_HEAP_H
+#define TYPED_HEAP_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+ * TYPED_HEAP(name, elem_type, less_fn) generates name_t, a binary min-heap
+ * of elem_type values stored inline, ordered by the inlinable comparison
+ * bool less_fn(const elem_type*, const elem_type*). The generated functions
+ * are static inline:
+ *
+ *   name_t* name_create(size_t capacity);
+ *   void name_destroy(name_t *heap);
+ *   size_t name_size(const name_t *heap);
+ *   void name_add(name_t *heap, elem_type elem);
+ *   elem_type name_top(const name_t *heap);
+ *   elem_type name_pop(name_t *heap);
+ *
+ * name_top and name_pop require a non-empty heap.
+ */
+
+#define TYPED_HEAP_MIN_CAPACITY 4
+
+#define TYPED_HEAP(name, elem_type, less_fn) \
+    typedef struct name { \
+        elem_type *data; \
+        size_t capacity; \
+        size_t size; \
+    } name##_t; \
+    \
+    static inline name##_t* name##_create(size_t capacity) { \
+        name##_t *heap = malloc(sizeof(name##_t)); \
+        assert(heap != NULL); \
+        heap->capacity = capacity > TYPED_HEAP_MIN_CAPACITY ? capacity : TYPED_HEAP_MIN_CAPACITY; \
+        heap->size = 0; \
+        heap->data = malloc(heap->capacity * sizeof(elem_type)); \
+        assert(heap->data != NULL); \
+        return heap; \
+    } \
+    \
+    static inline void name##_destroy(name##_t *heap) { \
+        if (heap == NULL) return; \
+        free(heap->data); \
+        free(heap); \
+    } \
+    \
+    static inline size_t name##_size(const name##_t *heap) { \
+        return heap->size; \
+    } \
+    \
+    static inline void name##_add(name##_t *heap, elem_type elem) { \
+        if (heap->size == heap->capacity) { \
+            heap->capacity *= 2; \
+            heap->data = realloc(heap->data, heap->capacity * sizeof(elem_type)); \
+            assert(heap->data != NULL); \
+        } \
+        /* move parents down until the element's slot is found */ \
+        size_t i = heap->size; \
+        while (i > 0 && less_fn(&elem, &heap->data[(i - 1) / 2])) { \
+            heap->data[i] = heap->data[(i - 1) / 2]; \
+            i = (i - 1) / 2; \
+        } \
+        heap->data[i] = elem; \
+        heap->size += 1; \
+    } \
+    \
+    static inline elem_type name##_top(const name##_t *heap) { \
+        assert(heap->size > 0); \
+        return heap->data[0]; \
+    } \
+    \
+    static inline elem_type name##_pop(name##_t *heap) { \
+        assert(heap->size > 0); \
+        elem_type result = heap->data[0]; \
+        heap->size -= 1; \
+        elem_type last = heap->data[heap->size]; \
+        /* move smaller children up until the last element's slot is found */ \
+        size_t i = 0; \
+        for (;;) { \
+            size_t child = 2 * i + 1; \
+            if (child >= heap->size) break; \
+            if (child + 1 < heap->size && less_fn(&heap->data[child + 1], &heap->data[child])) { \
+                child += 1; \
+            } \
+            if (!less_fn(&heap->data[child], &last)) break; \
+            heap->data[i] = heap->data[child]; \
+            i = child; \
+        } \
+        heap->data[i] = last; \
+        return result; \
+    }
+
+#endif /* TYPED_HEAP_H */
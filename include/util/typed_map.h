@@ -0,0 +1,313 @@
+#ifndef TYPED_MAP_H
+#define TYPED_MAP_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/guid.h"
+
+/*
+ * Macros that generate hash maps and hash sets specialized for a single key
+ * type. The generated containers are Robin Hood open-addressing tables like
+ * map_t, but they store keys inline in the table and call the key hash and
+ * equality functions directly, so the compiler can inline them. All generated
+ * functions are static inline, so each module generates the containers it
+ * needs in its own source file.
+ *
+ * TYPED_MAP(name, key_type, val_type, hash_fn, equal_fn) generates name_t,
+ * a map from key_type to the pointer type val_type, with functions:
+ *
+ *   name_t* name_create(size_t capacity, void (*destroy_val)(val_type));
+ *   void name_destroy(name_t *map);
+ *   size_t name_size(const name_t *map);
+ *   val_type name_get(const name_t *map, const key_type *key);
+ *   val_type name_set(name_t *map, const key_type *key, val_type val);
+ *   val_type name_remove(name_t *map, const key_type *key);
+ *   val_type* name_get_or_insert(name_t *map, const key_type *key, bool *inserted);
+ *   bool name_next(const name_t *map, size_t *cursor, const key_type **key, val_type *val);
+ *
+ * A NULL value means the key is absent, so NULL values may not be stored.
+ * name_set returns the previous value of the key without destroying it.
+ * name_get_or_insert and name_next behave like map_get_or_insert and
+ * map_next: after inserting a key the caller must store a value through the
+ * returned pointer before the map is modified again.
+ *
+ * TYPED_SET(name, key_type, hash_fn, equal_fn) generates name_t, a set of
+ * key_type, with functions:
+ *
+ *   name_t* name_create(size_t capacity);
+ *   void name_destroy(name_t *set);
+ *   size_t name_size(const name_t *set);
+ *   bool name_has(const name_t *set, const key_type *key);
+ *   bool name_add(name_t *set, const key_type *key);
+ *   bool name_remove(name_t *set, const key_type *key);
+ *   bool name_next(const name_t *set, size_t *cursor, const key_type **key);
+ *
+ * The hash function has the signature size_t (*)(const key_type*) and the
+ * equality function has the signature bool (*)(const key_type*, const key_type*).
+ */
+
+#define DIGEST_BYTES 32
+
+/**
+ * The digest_t type is a 32-byte key such as a BLAKE2b hash or a public key.
+ * A uint8_t pointer to 32 bytes can be used as a digest_t pointer through the
+ * DIGEST macro.
+ */
+typedef struct digest {
+    uint8_t bytes[DIGEST_BYTES];
+} digest_t;
+
+#define DIGEST(p) ((const digest_t *) (p))
+
+/**
+ * Return the last word of the digest. Digests are uniformly distributed, so
+ * any of their words is a good hash.
+ */
+static inline size_t digest_hash(const digest_t *digest) {
+    size_t hash;
+    memcpy(&hash, digest->bytes + DIGEST_BYTES - sizeof(size_t), sizeof(size_t));
+    return hash;
+}
+
+static inline bool digest_equal(const digest_t *a, const digest_t *b) {
+    return memcmp(a->bytes, b->bytes, DIGEST_BYTES) == 0;
+}
+
+static inline size_t guid_hash(const guid_t *guid) {
+    uint64_t hash;
+    memcpy(&hash, guid->i, sizeof(uint64_t));
+    return (size_t) (hash ^ ((uint64_t) guid->i[2] << 32 | guid->i[3]));
+}
+
+static inline bool guid_equal(const guid_t *a, const guid_t *b) {
+    return memcmp(a->i, b->i, sizeof(a->i)) == 0;
+}
+
+#define TYPED_TABLE_MIN_CAPACITY 8
+#define TYPED_TABLE_MAX_LOAD_NUMERATOR 7
+#define TYPED_TABLE_MAX_LOAD_DENOMINATOR 8
+
+/**
+ * Return the home slot of a hash in a table of 2^(64 - shift) slots by
+ * Fibonacci hashing.
+ */
+static inline size_t typed_table_home(size_t hash, size_t shift) {
+    return (size_t) (((uint64_t) hash * 0x9e3779b97f4a7c15ULL) >> shift);
+}
+
+/*
+ * Generate the table shared by maps and sets: a Robin Hood table of slots
+ * holding a key, a value, and one more than the distance of the slot from
+ * the home slot of its key (zero if the slot is empty).
+ */
+#define TYPED_TABLE_(name, key_type, val_type, hash_fn, equal_fn) \
+    typedef struct name##_slot { \
+        key_type key; \
+        val_type val; \
+        uint32_t dist; \
+    } name##_slot_t; \
+    \
+    typedef struct name { \
+        name##_slot_t *slots; \
+        size_t capacity; \
+        size_t shift; \
+        size_t size; \
+        void (*destroy_val)(val_type); \
+    } name##_t; \
+    \
+    static inline void name##_alloc_(name##_t *table, size_t capacity) { \
+        size_t log2 = 0; \
+        while (((size_t) 1 << log2) < capacity) log2 += 1; \
+        table->capacity = (size_t) 1 << log2; \
+        table->shift = 64 - log2; \
+        table->slots = calloc(table->capacity, sizeof(name##_slot_t)); \
+        assert(table->slots != NULL); \
+    } \
+    \
+    static inline name##_t* name##_create_(size_t capacity, void (*destroy_val)(val_type)) { \
+        name##_t *table = malloc(sizeof(name##_t)); \
+        assert(table != NULL); \
+        name##_alloc_(table, capacity > TYPED_TABLE_MIN_CAPACITY ? capacity : TYPED_TABLE_MIN_CAPACITY); \
+        table->size = 0; \
+        table->destroy_val = destroy_val; \
+        return table; \
+    } \
+    \
+    static inline void name##_destroy(name##_t *table) { \
+        if (table == NULL) return; \
+        if (table->destroy_val != NULL) { \
+            for (size_t i = 0; i < table->capacity; i++) { \
+                if (table->slots[i].dist != 0) table->destroy_val(table->slots[i].val); \
+            } \
+        } \
+        free(table->slots); \
+        free(table); \
+    } \
+    \
+    static inline size_t name##_size(const name##_t *table) { \
+        return table->size; \
+    } \
+    \
+    static inline size_t name##_find_(const name##_t *table, const key_type *key) { \
+        size_t mask = table->capacity - 1; \
+        size_t i = typed_table_home(hash_fn(key), table->shift); \
+        for (uint32_t dist = 1; dist <= table->slots[i].dist; dist++) { \
+            if (equal_fn(&table->slots[i].key, key)) return i; \
+            i = (i + 1) & mask; \
+        } \
+        return table->capacity; \
+    } \
+    \
+    static inline size_t name##_insert_(name##_t *table, name##_slot_t slot) { \
+        size_t mask = table->capacity - 1; \
+        size_t i = typed_table_home(hash_fn(&slot.key), table->shift); \
+        size_t result = table->capacity; \
+        slot.dist = 1; \
+        while (table->slots[i].dist != 0) { \
+            if (table->slots[i].dist < slot.dist) { \
+                name##_slot_t tmp = table->slots[i]; \
+                table->slots[i] = slot; \
+                slot = tmp; \
+                if (result == table->capacity) result = i; \
+            } \
+            i = (i + 1) & mask; \
+            slot.dist += 1; \
+        } \
+        table->slots[i] = slot; \
+        table->size += 1; \
+        return result == table->capacity ? i : result; \
+    } \
+    \
+    static inline const name##_slot_t* name##_next_(const name##_t *table, size_t *cursor) { \
+        while (*cursor < table->capacity) { \
+            const name##_slot_t *slot = &table->slots[*cursor]; \
+            *cursor += 1; \
+            if (slot->dist != 0) return slot; \
+        } \
+        return NULL; \
+    } \
+    \
+    static inline void name##_reserve_(name##_t *table) { \
+        if ((table->size + 1) * TYPED_TABLE_MAX_LOAD_DENOMINATOR \
+                <= table->capacity * TYPED_TABLE_MAX_LOAD_NUMERATOR) return; \
+        name##_slot_t *old_slots = table->slots; \
+        size_t old_capacity = table->capacity; \
+        name##_alloc_(table, old_capacity * 2); \
+        table->size = 0; \
+        for (size_t i = 0; i < old_capacity; i++) { \
+            if (old_slots[i].dist != 0) name##_insert_(table, old_slots[i]); \
+        } \
+        free(old_slots); \
+    } \
+    \
+    static inline void name##_erase_(name##_t *table, size_t i) { \
+        size_t mask = table->capacity - 1; \
+        size_t next = (i + 1) & mask; \
+        while (table->slots[next].dist > 1) { \
+            table->slots[i] = table->slots[next]; \
+            table->slots[i].dist -= 1; \
+            i = next; \
+            next = (next + 1) & mask; \
+        } \
+        table->slots[i].dist = 0; \
+        table->size -= 1; \
+    }
+
+#define TYPED_MAP(name, key_type, val_type, hash_fn, equal_fn) \
+    TYPED_TABLE_(name, key_type, val_type, hash_fn, equal_fn) \
+    \
+    static inline name##_t* name##_create(size_t capacity, void (*destroy_val)(val_type)) { \
+        return name##_create_(capacity, destroy_val); \
+    } \
+    \
+    static inline val_type name##_get(const name##_t *map, const key_type *key) { \
+        size_t i = name##_find_(map, key); \
+        return i == map->capacity ? NULL : map->slots[i].val; \
+    } \
+    \
+    static inline val_type name##_set(name##_t *map, const key_type *key, val_type val) { \
+        assert(val != NULL); \
+        size_t i = name##_find_(map, key); \
+        if (i != map->capacity) { \
+            val_type old = map->slots[i].val; \
+            map->slots[i].val = val; \
+            return old; \
+        } \
+        name##_reserve_(map); \
+        name##_slot_t slot; \
+        slot.key = *key; \
+        slot.val = val; \
+        name##_insert_(map, slot); \
+        return NULL; \
+    } \
+    \
+    static inline val_type name##_remove(name##_t *map, const key_type *key) { \
+        size_t i = name##_find_(map, key); \
+        if (i == map->capacity) return NULL; \
+        val_type val = map->slots[i].val; \
+        name##_erase_(map, i); \
+        return val; \
+    } \
+    \
+    static inline val_type* name##_get_or_insert(name##_t *map, const key_type *key, bool *inserted) { \
+        size_t i = name##_find_(map, key); \
+        if (inserted != NULL) *inserted = i == map->capacity; \
+        if (i == map->capacity) { \
+            name##_reserve_(map); \
+            name##_slot_t slot; \
+            slot.key = *key; \
+            slot.val = NULL; \
+            i = name##_insert_(map, slot); \
+        } \
+        return &map->slots[i].val; \
+    } \
+    \
+    static inline bool name##_next(const name##_t *map, size_t *cursor, const key_type **key, val_type *val) { \
+        const name##_slot_t *slot = name##_next_(map, cursor); \
+        if (slot == NULL) return false; \
+        if (key != NULL) *key = &slot->key; \
+        if (val != NULL) *val = slot->val; \
+        return true; \
+    }
+
+#define TYPED_SET(name, key_type, hash_fn, equal_fn) \
+    TYPED_TABLE_(name, key_type, uint8_t, hash_fn, equal_fn) \
+    \
+    static inline name##_t* name##_create(size_t capacity) { \
+        return name##_create_(capacity, NULL); \
+    } \
+    \
+    static inline bool name##_has(const name##_t *set, const key_type *key) { \
+        return name##_find_(set, key) != set->capacity; \
+    } \
+    \
+    static inline bool name##_add(name##_t *set, const key_type *key) { \
+        if (name##_find_(set, key) != set->capacity) return false; \
+        name##_reserve_(set); \
+        name##_slot_t slot; \
+        slot.key = *key; \
+        slot.val = 0; \
+        name##_insert_(set, slot); \
+        return true; \
+    } \
+    \
+    static inline bool name##_remove(name##_t *set, const key_type *key) { \
+        size_t i = name##_find_(set, key); \
+        if (i == set->capacity) return false; \
+        name##_erase_(set, i); \
+        return true; \
+    } \
+    \
+    static inline bool name##_next(const name##_t *set, size_t *cursor, const key_type **key) { \
+        const name##_slot_t *slot = name##_next_(set, cursor); \
+        if (slot == NULL) return false; \
+        if (key != NULL) *key = &slot->key; \
+        return true; \
+    }
+
+#endif /* TYPED_MAP_H */
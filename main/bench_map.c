@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <uv.h>
+#include <sodium.h>
+
+#include "util/map.h"
+#include "util/list.h"
+
+/*
+ * Micro-benchmark of map_t against the separate chaining hash map it
+ * replaced. Keys are random 32-byte hashes hashed the same way as block and
+ * transaction hashes, and both maps start with the 4096 buckets used by the
+ * blockchain.
+ *
+ * usage: bench_map [n_keys]
+ */
+
+#define KEY_SIZE 32
+#define N_BUCKETS (1 << 12)
+#define DEFAULT_N_KEYS (1 << 20)
+
+typedef struct legacy_entry {
+    void *key;
+    void *val;
+} legacy_entry_t;
+
+/*
+ * A copy of the original map: a fixed array of buckets, each a list of
+ * heap allocated entries.
+ */
+typedef struct legacy_map {
+    size_t n_buckets;
+    list_t **buckets;
+    hash_t hash;
+    comparator_t compare;
+} legacy_map_t;
+
+static legacy_map_t* legacy_map_create(size_t n_buckets, hash_t hash, comparator_t compare) {
+    legacy_map_t *map = malloc(sizeof(legacy_map_t));
+    assert(map != NULL);
+    map->buckets = calloc(n_buckets, sizeof(list_t*));
+    assert(map->buckets != NULL);
+    map->n_buckets = n_buckets;
+    map->hash = hash;
+    map->compare = compare;
+    return map;
+}
+
+static legacy_entry_t* legacy_map_get_entry(legacy_map_t *map, void *key, size_t *index) {
+    list_t *bucket = map->buckets[map->hash(key) % map->n_buckets];
+    if (bucket == NULL) return NULL;
+    for (size_t i = 0; i < list_size(bucket); i++) {
+        legacy_entry_t *entry = list_get(bucket, i);
+        if (map->compare(entry->key, key) == 0) {
+            if (index != NULL) *index = i;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void* legacy_map_get(legacy_map_t *map, void *key) {
+    legacy_entry_t *entry = legacy_map_get_entry(map, key, NULL);
+    return entry != NULL ? entry->val : NULL;
+}
+
+static void legacy_map_set(legacy_map_t *map, void *key, void *val) {
+    legacy_entry_t *entry = legacy_map_get_entry(map, key, NULL);
+    if (entry != NULL) {
+        entry->key = key;
+        entry->val = val;
+        return;
+    }
+    size_t i = map->hash(key) % map->n_buckets;
+    if (map->buckets[i] == NULL) map->buckets[i] = list_create(1);
+    entry = malloc(sizeof(legacy_entry_t));
+    assert(entry != NULL);
+    entry->key = key;
+    entry->val = val;
+    list_add(map->buckets[i], entry);
+}
+
+static void* legacy_map_remove(legacy_map_t *map, void *key) {
+    size_t index;
+    legacy_entry_t *entry = legacy_map_get_entry(map, key, &index);
+    if (entry == NULL) return NULL;
+    list_remove(map->buckets[map->hash(key) % map->n_buckets], index);
+    void *val = entry->val;
+    free(entry);
+    return val;
+}
+
+static void legacy_map_destroy(legacy_map_t *map) {
+    for (size_t i = 0; i < map->n_buckets; i++) {
+        if (map->buckets[i] == NULL) continue;
+        list_destroy(map->buckets[i], free);
+    }
+    free(map->buckets);
+    free(map);
+}
+
+static size_t hash(void *key) {
+    return *(size_t*)((char *) key + KEY_SIZE - sizeof(size_t));
+}
+
+static int compare(void *k1, void *k2) {
+    return memcmp(k1, k2, KEY_SIZE);
+}
+
+static void report(const char *name, const char *op, uint64_t start, size_t n) {
+    double elapsed = (uv_hrtime() - start) / 1e9;
+    printf("%-8s %-12s %10.3f s %10.1f ns/op\n", name, op, elapsed, elapsed * 1e9 / n);
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_N_KEYS;
+    uint8_t *keys = malloc(n * KEY_SIZE);
+    uint8_t *missing = malloc(n * KEY_SIZE);
+    assert(keys != NULL && missing != NULL);
+    randombytes_buf(keys, n * KEY_SIZE);
+    randombytes_buf(missing, n * KEY_SIZE);
+    printf("%zu keys\n", n);
+
+    uint64_t start = uv_hrtime();
+    map_t *map = map_create(N_BUCKETS, hash, NULL, NULL, compare);
+    for (size_t i = 0; i < n; i++) map_set(map, keys + i * KEY_SIZE, keys);
+    report("map", "insert", start, n);
+    start = uv_hrtime();
+    for (size_t i = 0; i < n; i++) assert(map_get(map, keys + i * KEY_SIZE) == keys);
+    report("map", "lookup hit", start, n);
+    start = uv_hrtime();
+    for (size_t i = 0; i < n; i++) assert(map_get(map, missing + i * KEY_SIZE) == NULL);
+    report("map", "lookup miss", start, n);
+    start = uv_hrtime();
+    for (size_t i = 0; i < n; i++) assert(map_remove(map, keys + i * KEY_SIZE) == keys);
+    report("map", "remove", start, n);
+    map_destroy(map);
+
+    start = uv_hrtime();
+    legacy_map_t *legacy = legacy_map_create(N_BUCKETS, hash, compare);
+    for (size_t i = 0; i < n; i++) legacy_map_set(legacy, keys + i * KEY_SIZE, keys);
+    report("legacy", "insert", start, n);
+    start = uv_hrtime();
+    for (size_t i = 0; i < n; i++) assert(legacy_map_get(legacy, keys + i * KEY_SIZE) == keys);
+    report("legacy", "lookup hit", start, n);
+    start = uv_hrtime();
+    for (size_t i = 0; i < n; i++) assert(legacy_map_get(legacy, missing + i * KEY_SIZE) == NULL);
+    report("legacy", "lookup miss", start, n);
+    start = uv_hrtime();
+    for (size_t i = 0; i < n; i++) assert(legacy_map_remove(legacy, keys + i * KEY_SIZE) == keys);
+    report("legacy", "remove", start, n);
+    legacy_map_destroy(legacy);
+
+    free(keys);
+    free(missing);
+}
@@ -15,28 +15,82 @@
 #include <tuple.h>
 #include <blockchain.h>
 #include <pool.h>
+#include <download.h>
 #include <cli.h>
 
 #include "util/http.h"
 #include "util/json.h"
+#include "util/iblt.h"
 
 #define VERSION_STRING "1.0.0-alpha"
 #define BLOCK_TIME 3
 #define EPOCH_LENGTH 16
+#define POOL_SKETCH_CELLS 384
+#define POOL_MAX_SKETCH_CELLS (1 << 16)
+#define SHORT_ID_SIZE 8
+#define POOL_LOAD_CHUNKS 4
+#define MAX_PARTIAL_BLOCKS 16
+#define MAX_HEADERS_PER_PAGE 512
+#define MAX_BLOCKS_PER_REQUEST 16
+#define MAX_LOCATOR_SIZE 64
+#define DOWNLOAD_INTERVAL 1000
+#define POOL_SYNC_INTERVAL 10000
+#define PARTIAL_BLOCK_TIMEOUT 5000
+#define PARTIAL_BLOCK_MAX_FETCHES 3
 
 
 uv_timer_t timer_req;
+uv_timer_t pool_timer_req;
+uv_timer_t download_timer_req;
+uv_timer_t pool_sync_timer_req;
 
 blockchain_t *blockchain;
 network_t *network;
 pool_t* pool;
+download_t *download;
 http_t *http;
 cli_t *cli;
 
 uint8_t pk[crypto_vrf_PUBLICKEYBYTES];
 uint8_t sk[crypto_vrf_SECRETKEYBYTES];
 
+char pool_path[MAX_PATH_LENGTH];
+size_t pool_loads_pending = 0;
+size_t next_pool_sync = 0;
+
+/**
+ * Write all transactions in the pool, both admitted and parked, to the pool
+ * file, so that pool_restore can rebuild both on startup. The pool is
+ * first written to a temporary file which then replaces the pool file, so that
+ * a crash while saving never leaves a truncated pool file behind. Nothing is
+ * saved while the pool file is still being loaded.
+ */
+void save_pool() {
+    if (pool_loads_pending > 0) return;
+    char tmp_path[MAX_PATH_LENGTH + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", pool_path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        printf("error: unable to save pool to %s\n", tmp_path);
+        return;
+    }
+    dynamic_buffer_t buf = dynamic_buffer_create(64);
+    pool_write(pool, &buf);
+    size_t n_written = fwrite(buf.data, buf.length, 1, file);
+    dynamic_buffer_destroy(buf);
+    if (fclose(file) != 0 || n_written != 1 || rename(tmp_path, pool_path) != 0) {
+        printf("error: unable to save pool to %s\n", pool_path);
+        remove(tmp_path);
+    }
+}
+
+void on_pool_timer(uv_timer_t *handle) {
+    save_pool();
+}
+
 void on_sigint(uv_signal_t *handle, int signum) {
+    save_pool();
     uv_stop(uv_default_loop());
     uv_signal_stop(handle);
     printf("\rinfo: shutting down\n");
@@ -59,15 +113,61 @@ uint8_t* get_secret_key() {
 }
 
 /**
- * Send the block to all neighbors in the network.
+ * Return true if some peer does not support the given feature.
+ * @param feature the feature
+ */
+bool some_peer_lacks(uint32_t feature) {
+    for (size_t i = 0; i < network_peer_count(network); i++) {
+        if (!(peer_get_features(network_get_peer(network, i)) & feature)) return true;
+    }
+    return false;
+}
+
+/**
+ * Send the block to all neighbors in the network. Neighbors almost always
+ * hold the transactions of the block in their pools already, so the block is
+ * sent in its compact form with short transaction ids. Neighbors that do not
+ * support compact blocks get the full block instead. Broadcasting a block
+ * again does not send it again to neighbors that already have it.
  * @param block the block
  */
 void broadcast_block(block_t *block) {
     assert(block != NULL);
     dynamic_buffer_t buf = dynamic_buffer_create(64);
-    block_write(block, &buf);
-    network_broadcast(network, EVENT_BLOCK, (buffer_t *) &buf);
-    dynamic_buffer_destroy(buf);
+    block_write_compact(block, &buf);
+    network_broadcast(network, EVENT_COMPACT_BLOCK, (buffer_t *) &buf);
+
+    if (some_peer_lacks(NETWORK_FEATURE_COMPACT_BLOCKS)) {
+        dynamic_buffer_t full = dynamic_buffer_create(64);
+        block_write(block, &full);
+        network_broadcast(network, EVENT_BLOCK, (buffer_t *) &full);
+    }
+}
+
+/**
+ * Send the transaction to all neighbors in the network.
+ * @param txn the transaction
+ */
+void broadcast_transaction(transaction_t *txn) {
+    assert(txn != NULL);
+    dynamic_buffer_t buf = dynamic_buffer_create(64);
+    transaction_write(txn, &buf);
+    network_broadcast(network, EVENT_TRANSACTION, (buffer_t *) &buf);
+}
+
+/**
+ * Create a new block on top of the given block filled with transactions from
+ * the pool. Transactions that overdraw the sender's account or do not fit in
+ * the block are skipped and remain in the pool.
+ * 
+ * @param prev the block to build on top of
+ * @return the block or NULL if we are not allowed to stake on prev
+ */
+block_t* create_block(block_t *prev) {
+    if (!is_staking_allowed(prev, get_public_key())) return NULL;
+    block_builder_t *builder = block_builder_create(prev, get_public_key(), settings.max_block_size);
+    pool_take(pool, (bool (*)(void*, transaction_t*)) block_builder_add, builder);
+    return block_builder_finish(builder, get_secret_key());
 }
 
 /**
@@ -88,22 +188,100 @@ transaction_t* lookup_transaction(buffer_t hash) {
     return blockchain_get_transaction(blockchain, hash);
 }
 
+/**
+ * Retrieves the balance of an account on the principal blockchain.
+ * @param public_key the public key of the account
+ * @return the account balance
+ */
+uint64_t lookup_balance(const uint8_t *public_key) {
+    block_t *principal = blockchain_get_principal(blockchain);
+    const account_t *account = block_get_account(principal, public_key);
+    return account != NULL ? account_get_value(account) : 0;
+}
+
+/**
+ * Return the ancestor of the block at the given height. Blocks on the
+ * principal block chain are found through its height index; other blocks
+ * walk back through their previous blocks.
+ */
+block_t* get_ancestor(block_t *block, size_t height) {
+    if (blockchain_get_principal_at(blockchain, block_get_height(block)) == block) {
+        return blockchain_get_principal_at(blockchain, height);
+    }
+    while (block != NULL && block_get_height(block) > height) {
+        block = block_get_prev(block);
+    }
+    return block;
+}
+
+/**
+ * Append the block locator of the block to the buffer: the hashes of the
+ * block and of its ancestors 1, 2, 4, 8 and so on blocks below it, ending
+ * with the first block. A peer finds the last block we have in common in
+ * O(log n) lookups by taking the first hash of the locator it knows.
+ *
+ * @param block the block
+ * @param locator the buffer of concatenated hashes
+ */
+void write_locator(block_t *block, dynamic_buffer_t *locator) {
+    size_t tip = block_get_height(block);
+    if (tip == 0) return;
+    for (size_t offset = 0; ; offset = offset == 0 ? 1 : 2 * offset) {
+        size_t height = offset < tip ? tip - offset : 1;
+        block = get_ancestor(block, height);
+        dynamic_buffer_write(block_get_hash(block), crypto_generichash_BYTES, locator);
+        if (height == 1) break;
+    }
+}
+
+/**
+ * Request the page of headers that follows the last block of the locator
+ * that the peer has on its principal block chain.
+ *
+ * @param peer the peer to request headers from
+ * @param locator the buffer of concatenated hashes
+ */
+void request_headers(peer_t *peer, dynamic_buffer_t *locator) {
+    dynamic_buffer_t buf = dynamic_buffer_create(locator->length + 16);
+    tuple_write_start(&buf);
+    tuple_write_binary(&buf, locator->length, locator->data);
+    tuple_write_end(&buf);
+    network_send(network, EVENT_HEADERS_REQUEST, (buffer_t *) &buf, peer);
+}
+
 /**
  * Synchronize the blockchain database with the given peer starting from
- * the specified block. This will send a request to download all blocks starting from
- * the specified block.
+ * the specified block. This requests the first page of headers after the
+ * last block the peer has in common with the locator of the block; block
+ * bodies are requested once their headers have been checked.
  * 
- * @param peer the peer to request blocks from
+ * @param peer the peer to request headers from
  * @param block the base of the branch to download 
  */
 void synchronize_blockchain(peer_t *peer, block_t *block) {
-    uint8_t *hash = block_get_hash(block);
-    dynamic_buffer_t buf = dynamic_buffer_create(64);
+    dynamic_buffer_t locator = dynamic_buffer_create(MAX_LOCATOR_SIZE * crypto_generichash_BYTES);
+    write_locator(block, &locator);
+    request_headers(peer, &locator);
+    dynamic_buffer_destroy(locator);
+}
+
+/**
+ * Request the bodies of the blocks with the given hashes from the peer. This
+ * is called by the download scheduler, whose windows hold at most
+ * MAX_BLOCKS_PER_REQUEST blocks. The peer echoes the window in its response.
+ *
+ * @param peer the peer to request blocks from
+ * @param window the download window of the request
+ * @param hashes the concatenated block hashes
+ * @param n the number of hashes
+ */
+void request_blocks(peer_t *peer, uint64_t window, const uint8_t *hashes, size_t n) {
+    dynamic_buffer_t buf = dynamic_buffer_create(n * crypto_generichash_BYTES + 32);
     tuple_write_start(&buf);
-    tuple_write_binary(&buf, crypto_generichash_BYTES, hash);
+    tuple_write_binary(&buf, n * crypto_generichash_BYTES, hashes);
+    tuple_write_u64(&buf, window);
     tuple_write_end(&buf);
     network_send(network, EVENT_BLOCKS_REQUEST, (buffer_t *) &buf, peer);
-    dynamic_buffer_destroy(buf);
 }
 
 /**
@@ -115,19 +293,124 @@ void synchronize_peers(peer_t *peer) {
     tuple_write_start(&buf);
     tuple_write_end(&buf);
     network_send(network, EVENT_PEERS_REQUEST, (buffer_t*) &buf, peer);
-    dynamic_buffer_destroy(buf);
+}
+
+/*
+ * The short_id_t struct pairs a pooled transaction with its short id under
+ * the key of a single pool synchronization exchange.
+ */
+typedef struct short_id {
+    uint64_t id;
+    transaction_t *txn;
+} short_id_t;
+
+static int compare_short_id(const void *a, const void *b) {
+    uint64_t x = ((const short_id_t *) a)->id;
+    uint64_t y = ((const short_id_t *) b)->id;
+    return (x > y) - (x < y);
 }
 
 /**
- * Send an memory pool synchronization request to the specified peer.
- * @param peer - the peer to synchronize with
+ * Return the short ids of all admitted transactions in the pool under the
+ * given key, sorted by id. The caller must free the result.
+ *
+ * @param key the short id key
+ * @param n the number of short ids
+ * @return the sorted short ids
  */
-void synchronize_pool(peer_t *peer) {
-    dynamic_buffer_t buf = dynamic_buffer_create(32);
+short_id_t* pool_short_ids(const uint8_t *key, size_t *n) {
+    *n = pool_size(pool);
+    short_id_t *ids = malloc((*n + 1) * sizeof(short_id_t));
+    assert(ids != NULL);
+    for (size_t i = 0; i < *n; i++) {
+        ids[i].txn = pool_get(pool, i);
+        ids[i].id = transaction_get_short_id(ids[i].txn, key);
+    }
+    qsort(ids, *n, sizeof(short_id_t), compare_short_id);
+    return ids;
+}
+
+/**
+ * Return the pooled transaction with the given short id or NULL.
+ */
+transaction_t* find_short_id(short_id_t *ids, size_t n, uint64_t id) {
+    short_id_t target = {id, NULL};
+    short_id_t *result = bsearch(&target, ids, n, sizeof(short_id_t), compare_short_id);
+    return result != NULL ? result->txn : NULL;
+}
+
+void write_short_id(dynamic_buffer_t *buf, uint64_t id) {
+    for (size_t i = SHORT_ID_SIZE; i > 0; i--) {
+        dynamic_buffer_putc((uint8_t)(id >> (8 * (i - 1))), buf);
+    }
+}
+
+uint64_t read_short_id(const uint8_t *data) {
+    uint64_t id = 0;
+    for (size_t i = 0; i < SHORT_ID_SIZE; i++) {
+        id = (id << 8) | data[i];
+    }
+    return id;
+}
+
+/**
+ * Return true if msg has the form (key: binary, data: binary) used by all
+ * pool synchronization messages except responses.
+ */
+bool is_pool_message_valid(tuple_t *msg) {
+    return msg != NULL && tuple_size(msg) == 2
+        && tuple_get_type(msg, 0) == TUPLE_BINARY
+        && tuple_get_type(msg, 1) == TUPLE_BINARY
+        && tuple_get_binary(msg, 0).length == TRANSACTION_SHORT_ID_KEY_BYTES;
+}
+
+/**
+ * Send a pool message of the form (key: binary, data: binary) to the peer.
+ */
+void send_pool_message(peer_t *peer, uint32_t event, const uint8_t *key, dynamic_buffer_t *data) {
+    dynamic_buffer_t buf = dynamic_buffer_create(data->length + 64);
     tuple_write_start(&buf);
+    tuple_write_binary(&buf, TRANSACTION_SHORT_ID_KEY_BYTES, key);
+    tuple_write_binary(&buf, data->length, data->data);
     tuple_write_end(&buf);
-    network_send(network, EVENT_POOL_REQUEST, (buffer_t*) &buf, peer);
-    dynamic_buffer_destroy(buf);
+    network_send(network, event, (buffer_t *) &buf, peer);
+}
+
+/**
+ * Send an memory pool synchronization request to the specified peer. Rather
+ * than asking for the peer's entire pool, we send a sketch of the short ids
+ * in our own pool so that the peer only sends the transactions we lack.
+ * Peers that do not support reconciliation get all of our short ids.
+ *
+ * @param peer - the peer to synchronize with
+ */
+void synchronize_pool(peer_t *peer) {
+    uint8_t key[TRANSACTION_SHORT_ID_KEY_BYTES];
+    randombytes_buf(key, sizeof(key));
+
+    if (!(peer_get_features(peer) & NETWORK_FEATURE_RECONCILIATION)) {
+        size_t n_ids;
+        short_id_t *ids = pool_short_ids(key, &n_ids);
+        dynamic_buffer_t inventory = dynamic_buffer_create(n_ids * SHORT_ID_SIZE + 1);
+        for (size_t i = 0; i < n_ids; i++) {
+            write_short_id(&inventory, ids[i].id);
+        }
+        send_pool_message(peer, EVENT_POOL_INVENTORY, key, &inventory);
+        dynamic_buffer_destroy(inventory);
+        free(ids);
+        return;
+    }
+
+    iblt_t *sketch = iblt_create(POOL_SKETCH_CELLS);
+    for (size_t i = 0; i < pool_size(pool); i++) {
+        iblt_insert(sketch, transaction_get_short_id(pool_get(pool, i), key));
+    }
+    dynamic_buffer_t data = dynamic_buffer_create(iblt_size(sketch) * IBLT_CELL_SIZE + 1);
+    iblt_write(sketch, &data);
+    iblt_destroy(sketch);
+
+    send_pool_message(peer, EVENT_POOL_REQUEST, key, &data);
+    dynamic_buffer_destroy(data);
 }
 
 // msg: NULL
@@ -136,16 +419,24 @@ void on_connect(peer_t *peer, tuple_t *msg) {
     tuple_write_start(&buf);
     tuple_write_i32(&buf, settings.port);
     tuple_write_string(&buf, VERSION_STRING);
+    tuple_write_u32(&buf, settings.features & NETWORK_FEATURES);
+    tuple_write_u32(&buf, settings.max_message_size);
     tuple_write_end(&buf);
     network_send(network, EVENT_HANDSHAKE, (buffer_t*) &buf, peer);
-    dynamic_buffer_destroy(buf);
 
     synchronize_peers(peer);
     synchronize_blockchain(peer, blockchain_get_principal(blockchain));
+    download_add_peer(download, peer);
 }
 
-// msg: (port: i32, version: string)
+// msg: (port: i32, version: string, features: u32, max_message_size: u32)
 void on_handshake(peer_t *peer, tuple_t *msg) {
+    if (msg == NULL || tuple_size(msg) < 2
+            || tuple_get_type(msg, 0) != TUPLE_I32
+            || tuple_get_type(msg, 1) != TUPLE_STRING) {
+        network_disconnect(network, peer);
+        return;
+    }
 
     // If we are already connected to this peer node, we should disconnect
     // from the node immediately without printing out any messages.
@@ -156,25 +447,129 @@ void on_handshake(peer_t *peer, tuple_t *msg) {
         return;
     }
 
-    // If the peer node has a version string that doesn't match ours, we
-    // should disconnect, but still print out a connection message.
-    char *version = tuple_get_string(msg, 1);
-    if (strcmp(VERSION_STRING, version) != 0) {
-        network_disconnect(network, peer);
-    }
-    
     // Set the port of the peer to the one specified in their handshake.
     // This is the port on which the peer accepts incoming connections.
     peer_set_port(peer, port);
+
+    // The version string is informational. Nodes of different versions use
+    // the features that both of them support. Older nodes that do not send
+    // their features and message size limit support none of the features
+    // and accept messages as large as we do.
+    uint32_t features = 0;
+    if (tuple_size(msg) > 2 && tuple_get_type(msg, 2) == TUPLE_U32) features = tuple_get_u32(msg, 2);
+    peer_set_features(peer, features & settings.features & NETWORK_FEATURES);
+    if (tuple_size(msg) > 3 && tuple_get_type(msg, 3) == TUPLE_U32) {
+        peer_set_max_message_size(peer, tuple_get_u32(msg, 3));
+    }
+
+    // Synchronize pools once we know whether the peer supports reconciliation.
+    synchronize_pool(peer);
     // printf("[+] %s:%d\n", peer_get_addr(peer), peer_get_port(peer));
 }
 
+/*
+ * The partial_block_t struct holds a compact block while we wait for the
+ * transactions that were missing from our pool. The prefix holds the raw
+ * header and signature of the block and missing transactions are NULL. The
+ * peer is the peer that sent the compact block, or NULL once it has
+ * disconnected. The transactions are requested from at most one peer at a
+ * time, which is the only peer whose response is accepted, and NULL while
+ * no request is outstanding. If the block is still incomplete at the
+ * deadline, the whole
+ * block is fetched by hash, first from that peer and then from other peers,
+ * at most PARTIAL_BLOCK_MAX_FETCHES times. These requests have window 0,
+ * which is never a download window.
+ */
+typedef struct partial_block {
+    uint8_t hash[crypto_generichash_BYTES];
+    dynamic_buffer_t prefix;
+    transaction_t **txns;
+    size_t n_txns;
+    bool requested_all;
+    peer_t *peer;
+    peer_t *txns_peer;
+    uint64_t deadline;
+    size_t n_fetches;
+} partial_block_t;
+
+partial_block_t *partial_blocks[MAX_PARTIAL_BLOCKS];
+size_t next_partial_block = 0;
+
+void partial_block_destroy(partial_block_t *pb) {
+    if (pb == NULL) return;
+    for (size_t i = 0; i < pb->n_txns; i++) {
+        if (pb->txns[i] != NULL) transaction_destroy(pb->txns[i]);
+    }
+    free(pb->txns);
+    dynamic_buffer_destroy(pb->prefix);
+    free(pb);
+}
+
+/**
+ * Return the index of the partial block with the given hash or
+ * MAX_PARTIAL_BLOCKS if there is none.
+ */
+size_t find_partial_block(const uint8_t *hash) {
+    for (size_t i = 0; i < MAX_PARTIAL_BLOCKS; i++) {
+        partial_block_t *pb = partial_blocks[i];
+        if (pb != NULL && memcmp(pb->hash, hash, crypto_generichash_BYTES) == 0) return i;
+    }
+    return MAX_PARTIAL_BLOCKS;
+}
+
+/**
+ * Store a partial block, replacing the oldest one if all slots are taken.
+ */
+void add_partial_block(partial_block_t *pb) {
+    partial_block_destroy(partial_blocks[next_partial_block]);
+    partial_blocks[next_partial_block] = pb;
+    next_partial_block = (next_partial_block + 1) % MAX_PARTIAL_BLOCKS;
+}
+
+void remove_partial_block(size_t i) {
+    partial_block_destroy(partial_blocks[i]);
+    partial_blocks[i] = NULL;
+}
+
+/**
+ * Fetch the partial blocks that have not been completed in time as whole
+ * blocks, and give up on those that have been fetched too often. A relaying
+ * node may not be able to send the missing transactions of a block, for
+ * instance when it has not accepted the block itself, and other copies of
+ * the compact block are dropped as duplicates.
+ */
+void expire_partial_blocks(uint64_t now) {
+    for (size_t i = 0; i < MAX_PARTIAL_BLOCKS; i++) {
+        partial_block_t *pb = partial_blocks[i];
+        if (pb == NULL || pb->deadline > now) continue;
+        size_t n_peers = network_peer_count(network);
+        if (pb->n_fetches == PARTIAL_BLOCK_MAX_FETCHES || n_peers == 0) {
+            remove_partial_block(i);
+            continue;
+        }
+        peer_t *peer = pb->peer;
+        if (peer == NULL || pb->n_fetches > 0) {
+            peer = network_get_peer(network, randombytes_uniform(n_peers));
+        }
+        request_blocks(peer, 0, pb->hash, 1);
+        pb->n_fetches += 1;
+        pb->deadline = now + PARTIAL_BLOCK_TIMEOUT;
+    }
+}
+
 /**
  * When we disconnect from a socket, we print out a message indicating that
  * the node has been disconnected. If the peer has a port number less than
  * or equal to zero, we do nothing since these nodes failed their handshake
  */
 void on_disconnect(peer_t *peer, tuple_t *msg) {
+    download_remove_peer(download, peer);
+    for (size_t i = 0; i < MAX_PARTIAL_BLOCKS; i++) {
+        partial_block_t *pb = partial_blocks[i];
+        if (pb == NULL) continue;
+        if (pb->peer == peer) pb->peer = NULL;
+        if (pb->txns_peer == peer) pb->txns_peer = NULL;
+    }
     if (peer_get_port(peer) > 0) {
         // printf("[-] %s:%d\n", peer_get_addr(peer), peer_get_port(peer));
     }
@@ -202,7 +597,6 @@ void on_peers_request(peer_t *peer, tuple_t *msg) {
     }
     tuple_write_end(&buf);
     network_send(network, EVENT_PEERS_RESPONSE, (buffer_t*) &buf, peer);
-    dynamic_buffer_destroy(buf);
 }
 
 // msg: (('127.0.0.1', 1960), ('127.0.0.1', 1961), ('127.0.0.1', 1962))
@@ -227,19 +621,17 @@ void on_block(peer_t *peer, tuple_t *msg) {
     block_t *block = block_create_from_tuple(msg, lookup_block);
     /* If the message was not malformed and is not yet in the block database */ 
     if (block != NULL && blockchain_add_block(blockchain, block)) {
-       
+
+        /* relay new blocks from peers to the peers that do not have them */
+        if (peer != NULL) broadcast_block(block);
+
         /* 
          * Attempt to fork the blockchain. This will only succeed if priority
          * is lower than all other forks.
          */
         block_t *prev = block_get_prev(block);
         if (prev != NULL && block_get_child_with_public_key(prev, get_public_key()) == NULL) {
-            list_t *txns = list_create(1);
-            while (pool_size(pool) != 0) {
-                transaction_t *txn = pool_remove(pool, 0);
-                list_add(txns, txn);
-            }
-            block_t *next = block_create(get_public_key(), get_secret_key(), prev, txns); 
+            block_t *next = create_block(prev);
             if (next != NULL && blockchain_add_block(blockchain, next)) {
                 broadcast_block(next);
             }
@@ -249,74 +641,542 @@ void on_block(peer_t *peer, tuple_t *msg) {
 }
 
 /**
- * Event handler for network messages of 'blocks_response' type. When we recieve a
- * block from a peer, we should validate it and add it to our blockchain.
+ * Event handler for network messages of 'blocks_response' type. Blocks that
+ * are being downloaded go to the download scheduler, which delivers them in
+ * height order. Blocks that complete a partial block are added and relayed
+ * like compact blocks, and other blocks are added like downloaded blocks,
+ * which are not relayed to other peers. The response ends with the download
+ * window of the request it answers.
+ *
+ * msg: (block..., window: u64)
  */
 void on_blocks_response(peer_t *peer, tuple_t *msg) {
-
-    /* Iterate through all blocks from earliest to latest */
-    for (size_t i = tuple_size(msg); i > 0; i -= 1) {
-        
-        /* Attempt to parse the message into a block */
-        tuple_t *block_tuple = tuple_get_tuple(msg, i - 1);
-        block_t *block = block_create_from_tuple(block_tuple, lookup_block);
- 
-        /* If the message was not malformed and is not yet in the block database */ 
-        if (block != NULL && blockchain_add_block(blockchain, block)) {
-            
-            /* 
-            * Attempt to fork the blockchain. This will only succeed if priority
-            * is lower than all other forks.
-            */
-            block_t *prev = block_get_prev(block);
-            if (prev != NULL && block_get_child_with_public_key(prev, get_public_key()) == NULL) {
-                list_t *txns = list_create(1);
-                while (pool_size(pool) != 0) {
-                    transaction_t *txn = pool_remove(pool, 0);
-                    list_add(txns, txn);
-                }
-                block_t *next = block_create(get_public_key(), get_secret_key(), prev, txns); 
-                if (next != NULL && blockchain_add_block(blockchain, next)) {
-                    broadcast_block(next);
-                }
-            }
+    size_t i = 0;
+    for (; i < tuple_size(msg); i++) {
+        if (tuple_get_type(msg, i) != TUPLE_START) break;
+        tuple_t *block_tuple = tuple_get_tuple(msg, i);
+        if (tuple_size(block_tuple) == 0 || tuple_get_type(block_tuple, 0) != TUPLE_START) break;
+
+        tuple_t *header = tuple_get_tuple(block_tuple, 0);
+        uint8_t hash[crypto_generichash_BYTES];
+        crypto_generichash(hash, sizeof(hash), header->start, header->length, NULL, 0);
+        if (download_receive(download, hash, block_tuple->start, block_tuple->length)) continue;
+        size_t j = find_partial_block(hash);
+        if (j < MAX_PARTIAL_BLOCKS) {
+            remove_partial_block(j);
+            on_block(peer, block_tuple);
+        } else {
+            on_block(NULL, block_tuple);
         }
     }
+    if (i + 1 == tuple_size(msg) && tuple_get_type(msg, i) == TUPLE_U64) {
+        download_complete(download, peer, tuple_get_u64(msg, i));
+    }
+    download_schedule(download, uv_now(uv_default_loop()));
 }
 
 /**
- * Event handler for network messages of 'blocks_request' type. When we recieve a
- * block from a peer, we should validate it and add it to our blockchain.
+ * Add a downloaded block body to the blockchain. The download scheduler calls
+ * this in height order.
+ *
+ * @param body the tuple representation of the block
+ * @param length the length of the body
+ */
+void deliver_block(const uint8_t *body, size_t length) {
+    buffer_t buf = {length, (uint8_t *) body};
+    tuple_t *tuple = tuple_parse(&buf);
+    if (tuple == NULL) return;
+    on_block(NULL, tuple);
+    tuple_destroy(tuple);
+}
+
+void on_download_timer(uv_timer_t *handle) {
+    download_schedule(download, uv_now(uv_default_loop()));
+    expire_partial_blocks(uv_now(uv_default_loop()));
+}
+
+/**
+ * Synchronize pools with the next peer in turn. Transactions are dropped
+ * on the way to congested peers, so pools are synchronized again every
+ * POOL_SYNC_INTERVAL milliseconds rather than only after the handshake.
+ */
+void on_pool_sync_timer(uv_timer_t *handle) {
+    size_t n_peers = network_peer_count(network);
+    if (n_peers == 0) return;
+    next_pool_sync %= n_peers;
+    synchronize_pool(network_get_peer(network, next_pool_sync));
+    next_pool_sync += 1;
+}
+
+/**
+ * Event handler for network messages of 'blocks_request' type. We send the
+ * requested blocks that we know in the order they were requested, followed
+ * by the window of the request if it has one. A request names at most
+ * MAX_BLOCKS_PER_REQUEST blocks, so the cost of answering it is bounded.
+ *
+ * msg: (hashes: binary, window: u64)
  */
 void on_blocks_request(peer_t *peer, tuple_t *msg) {
-    buffer_t hash = tuple_get_binary(msg, 0);
-    block_t *block = lookup_block(hash);
-    block_t *iter = blockchain_get_principal(blockchain);
+    if (tuple_size(msg) < 1 || tuple_size(msg) > 2 || tuple_get_type(msg, 0) != TUPLE_BINARY) return;
+    if (tuple_size(msg) == 2 && tuple_get_type(msg, 1) != TUPLE_U64) return;
+    buffer_t hashes = tuple_get_binary(msg, 0);
+    if (hashes.length % crypto_generichash_BYTES != 0) return;
+    if (hashes.length > MAX_BLOCKS_PER_REQUEST * crypto_generichash_BYTES) return;
+
     dynamic_buffer_t buf = dynamic_buffer_create(64);
     tuple_write_start(&buf);
-    while (iter != block && iter != NULL) {
-        block_write(iter, &buf);
-        iter = block_get_prev(iter);
+    for (size_t i = 0; i < hashes.length; i += crypto_generichash_BYTES) {
+        block_t *block = lookup_block((buffer_t) {crypto_generichash_BYTES, hashes.data + i});
+        if (block == NULL) continue;
+
+        /*
+         * leave out the blocks that do not fit in a message the peer accepts
+         * together with the window and the end of the tuple
+         */
+        size_t length = buf.length;
+        block_write(block, &buf);
+        if (buf.length + 1 + sizeof(uint64_t) + 1 > peer_get_max_message_size(peer)) {
+            buf.length = length;
+            break;
+        }
     }
+    if (tuple_size(msg) == 2) tuple_write_u64(&buf, tuple_get_u64(msg, 1));
     tuple_write_end(&buf);
     network_send(network, EVENT_BLOCKS_RESPONSE, (buffer_t *) &buf, peer);
+}
+
+/**
+ * Event handler for network messages of 'headers_request' type. We send the
+ * headers of at most MAX_HEADERS_PER_PAGE blocks of our principal block
+ * chain, by increasing height, that follow the first block of the locator
+ * on our principal block chain. If there is no such block, the page starts
+ * at the first block.
+ *
+ * msg: (locator: binary)
+ */
+void on_headers_request(peer_t *peer, tuple_t *msg) {
+    if (tuple_size(msg) != 1 || tuple_get_type(msg, 0) != TUPLE_BINARY) return;
+    buffer_t locator = tuple_get_binary(msg, 0);
+    if (locator.length % crypto_generichash_BYTES != 0) return;
+    if (locator.length > MAX_LOCATOR_SIZE * crypto_generichash_BYTES) return;
+
+    block_t *block = NULL;
+    for (size_t i = 0; i < locator.length; i += crypto_generichash_BYTES) {
+        block_t *iter = lookup_block((buffer_t) {crypto_generichash_BYTES, locator.data + i});
+        if (iter != NULL && blockchain_get_principal_at(blockchain, block_get_height(iter)) == iter) {
+            block = iter;
+            break;
+        }
+    }
+
+    size_t start = block_get_height(block) + 1;
+    size_t end = start + MAX_HEADERS_PER_PAGE;
+    dynamic_buffer_t buf = dynamic_buffer_create(64);
+    tuple_write_start(&buf);
+    tuple_write_start(&buf);
+    for (size_t height = start; height < end; height++) {
+        block_t *iter = blockchain_get_principal_at(blockchain, height);
+        if (iter == NULL) break;
+        block_write_header(iter, &buf);
+    }
+    tuple_write_end(&buf);
+    tuple_write_end(&buf);
+    network_send(network, EVENT_HEADERS_RESPONSE, (buffer_t *) &buf, peer);
+}
+
+/**
+ * Event handler for network messages of 'headers_response' type. We check
+ * that the headers are well-formed and form a chain that starts at a block
+ * we know or are downloading, as the last block of the previous page is,
+ * then hand the blocks we lack to the download scheduler, which
+ * requests their bodies from all peers. If the page is full, the peer has
+ * more headers, so we request the next page.
+ *
+ * msg: ((header...))
+ */
+void on_headers_response(peer_t *peer, tuple_t *msg) {
+    if (tuple_size(msg) != 1 || tuple_get_type(msg, 0) != TUPLE_START) return;
+    tuple_t *headers = tuple_get_tuple(msg, 0);
+    if (tuple_size(headers) == 0 || tuple_size(headers) > MAX_HEADERS_PER_PAGE) return;
+
+    uint8_t hash[crypto_generichash_BYTES] = {0};
+    for (size_t i = 0; i < tuple_size(headers); i++) {
+        if (tuple_get_type(headers, i) != TUPLE_START) return;
+        tuple_t *header = tuple_get_tuple(headers, i);
+        if (!block_header_is_valid(header)) return;
+        buffer_t prev = tuple_get_binary(header, 1);
+        if (i == 0) {
+            bool is_first = memcmp(prev.data, hash, crypto_generichash_BYTES) == 0;
+            bool is_known = lookup_block(prev) != NULL || download_has(download, prev.data);
+            if (!is_first && !is_known) return;
+        } else if (memcmp(prev.data, hash, crypto_generichash_BYTES) != 0) {
+            return;
+        }
+        crypto_generichash(hash, sizeof(hash), header->start, header->length, NULL, 0);
+    }
+
+    for (size_t i = 0; i < tuple_size(headers); i++) {
+        tuple_t *header = tuple_get_tuple(headers, i);
+        crypto_generichash(hash, sizeof(hash), header->start, header->length, NULL, 0);
+        if (lookup_block((buffer_t) {sizeof(hash), hash}) != NULL) continue;
+        download_add(download, hash);
+    }
+    download_add_peer(download, peer);
+    download_schedule(download, uv_now(uv_default_loop()));
+
+    if (tuple_size(headers) == MAX_HEADERS_PER_PAGE) {
+        dynamic_buffer_t locator = dynamic_buffer_create(MAX_LOCATOR_SIZE * crypto_generichash_BYTES);
+        dynamic_buffer_write(hash, sizeof(hash), &locator);
+        write_locator(blockchain_get_principal(blockchain), &locator);
+        request_headers(peer, &locator);
+        dynamic_buffer_destroy(locator);
+    }
+}
+
+/**
+ * Ask the peer for the transactions of the partial block that are missing,
+ * and remember the peer so that only its response is accepted.
+ */
+void request_block_txns(peer_t *peer, partial_block_t *pb) {
+    dynamic_buffer_t buf = dynamic_buffer_create(64);
+    tuple_write_start(&buf);
+    tuple_write_binary(&buf, crypto_generichash_BYTES, pb->hash);
+    tuple_write_start(&buf);
+    for (size_t i = 0; i < pb->n_txns; i++) {
+        if (pb->txns[i] == NULL) tuple_write_u32(&buf, i);
+    }
+    tuple_write_end(&buf);
+    tuple_write_end(&buf);
+    network_send(network, EVENT_BLOCK_TXNS_REQUEST, (buffer_t *) &buf, peer);
+    pb->txns_peer = peer;
+}
+
+/**
+ * Assemble the block from a partial block whose transactions are all present
+ * and handle it like a block message. If the merkle root does not match, a
+ * short id collided with a different transaction in our pool, so we drop the
+ * transactions and request all of them from the peer once. Return true if
+ * the partial block is no longer needed.
+ */
+bool complete_partial_block(peer_t *peer, partial_block_t *pb) {
+    dynamic_buffer_t buf = dynamic_buffer_create(pb->prefix.length + 64);
+    tuple_write_start(&buf);
+    dynamic_buffer_write(pb->prefix.data, pb->prefix.length, &buf);
+    tuple_write_start(&buf);
+    for (size_t i = 0; i < pb->n_txns; i++) {
+        transaction_write(pb->txns[i], &buf);
+    }
+    tuple_write_end(&buf);
+    tuple_write_end(&buf);
+
+    bool done = true;
+    tuple_t *tuple = tuple_parse((buffer_t *) &buf);
+    if (tuple != NULL && block_is_valid(tuple)) {
+        on_block(peer, tuple);
+    } else if (tuple != NULL && !pb->requested_all) {
+        for (size_t i = 0; i < pb->n_txns; i++) {
+            transaction_destroy(pb->txns[i]);
+            pb->txns[i] = NULL;
+        }
+        pb->requested_all = true;
+        request_block_txns(peer, pb);
+        done = false;
+    }
+    if (tuple != NULL) tuple_destroy(tuple);
     dynamic_buffer_destroy(buf);
+    return done;
+}
+
+/**
+ * Event handler for network messages of 'compact_block' type. We rebuild
+ * the block from the transactions in our pool and only request the ones we
+ * lack from the peer. The short ids are keyed with the block hash, which we
+ * compute from the raw header.
+ *
+ * msg: (header: tuple, signature: binary, short ids: binary)
+ */
+void on_compact_block(peer_t *peer, tuple_t *msg) {
+    if (tuple_size(msg) != 3) return;
+    if (tuple_get_type(msg, 0) != TUPLE_START) return;
+    if (tuple_get_type(msg, 1) != TUPLE_BINARY) return;
+    if (tuple_get_type(msg, 2) != TUPLE_BINARY) return;
+    tuple_t *header = tuple_get_tuple(msg, 0);
+    buffer_t signature = tuple_get_binary(msg, 1);
+    buffer_t ids = tuple_get_binary(msg, 2);
+    if (tuple_size(header) != 7 || tuple_get_type(header, 6) != TUPLE_U32) return;
+    size_t n_txns = tuple_get_u32(header, 6);
+    if (ids.length != n_txns * SHORT_ID_SIZE) return;
+
+    uint8_t hash[crypto_generichash_BYTES];
+    crypto_generichash(hash, sizeof(hash), header->start, header->length, NULL, 0);
+    if (lookup_block((buffer_t) {sizeof(hash), hash}) != NULL) return;
+    if (find_partial_block(hash) < MAX_PARTIAL_BLOCKS) return;
+
+    partial_block_t *pb = calloc(1, sizeof(partial_block_t));
+    assert(pb != NULL);
+    memcpy(pb->hash, hash, sizeof(hash));
+    pb->prefix = dynamic_buffer_create(header->length + signature.length + 8);
+    dynamic_buffer_write(header->start, header->length, &pb->prefix);
+    tuple_write_binary(&pb->prefix, signature.length, signature.data);
+    pb->n_txns = n_txns;
+    pb->txns = calloc(n_txns + 1, sizeof(transaction_t *));
+    assert(pb->txns != NULL);
+    pb->peer = peer;
+    pb->deadline = uv_now(uv_default_loop()) + PARTIAL_BLOCK_TIMEOUT;
+
+    size_t n_pool_ids;
+    size_t n_missing = 0;
+    short_id_t *pool_ids = pool_short_ids(hash, &n_pool_ids);
+    for (size_t i = 0; i < n_txns; i++) {
+        uint64_t id = read_short_id(ids.data + i * SHORT_ID_SIZE);
+        transaction_t *txn = find_short_id(pool_ids, n_pool_ids, id);
+        if (txn != NULL) {
+            pb->txns[i] = transaction_copy(txn);
+        } else {
+            n_missing += 1;
+        }
+    }
+    free(pool_ids);
+
+    if (n_missing > 0) {
+        request_block_txns(peer, pb);
+    } else if (complete_partial_block(peer, pb)) {
+        partial_block_destroy(pb);
+        return;
+    }
+    add_partial_block(pb);
+}
+
+/**
+ * Event handler for network messages of 'block_txns_request' type. We send
+ * the requested transactions of the block in the order of their indexes.
+ *
+ * msg: (hash: binary, indexes: (u32...))
+ */
+void on_block_txns_request(peer_t *peer, tuple_t *msg) {
+    if (tuple_size(msg) != 2) return;
+    if (tuple_get_type(msg, 0) != TUPLE_BINARY) return;
+    if (tuple_get_type(msg, 1) != TUPLE_START) return;
+    block_t *block = lookup_block(tuple_get_binary(msg, 0));
+    if (block == NULL) return;
+
+    tuple_t *indexes = tuple_get_tuple(msg, 1);
+    dynamic_buffer_t buf = dynamic_buffer_create(64);
+    tuple_write_start(&buf);
+    tuple_write_binary(&buf, crypto_generichash_BYTES, block_get_hash(block));
+    tuple_write_start(&buf);
+    for (size_t i = 0; i < tuple_size(indexes); i++) {
+        if (tuple_get_type(indexes, i) != TUPLE_U32
+                || tuple_get_u32(indexes, i) >= block_get_transaction_count(block)) {
+            dynamic_buffer_destroy(buf);
+            return;
+        }
+        transaction_write(block_get_transaction(block, tuple_get_u32(indexes, i)), &buf);
+    }
+    tuple_write_end(&buf);
+    tuple_write_end(&buf);
+    network_send(network, EVENT_BLOCK_TXNS_RESPONSE, (buffer_t *) &buf, peer);
 }
 
 /**
- * Synchronize pool of pending transactions with peer by sending entire pool
- * to peer. 
+ * Event handler for network messages of 'block_txns_response' type. The
+ * transactions fill the missing slots of the partial block in order. Only
+ * the response to the outstanding request of the partial block is accepted.
+ *
+ * msg: (hash: binary, txns: (transaction...))
+ */
+void on_block_txns_response(peer_t *peer, tuple_t *msg) {
+    if (tuple_size(msg) != 2) return;
+    if (tuple_get_type(msg, 0) != TUPLE_BINARY) return;
+    if (tuple_get_type(msg, 1) != TUPLE_START) return;
+    buffer_t hash = tuple_get_binary(msg, 0);
+    if (hash.length != crypto_generichash_BYTES) return;
+    size_t index = find_partial_block(hash.data);
+    if (index == MAX_PARTIAL_BLOCKS) return;
+
+    partial_block_t *pb = partial_blocks[index];
+    if (pb->txns_peer != peer) return;
+    pb->txns_peer = NULL;
+    tuple_t *txns = tuple_get_tuple(msg, 1);
+    size_t k = 0;
+    for (size_t i = 0; i < pb->n_txns; i++) {
+        if (pb->txns[i] != NULL) continue;
+        if (k == tuple_size(txns) || tuple_get_type(txns, k) != TUPLE_START) break;
+        pb->txns[i] = transaction_create_from_tuple(tuple_get_tuple(txns, k++));
+        if (pb->txns[i] == NULL) break;
+    }
+    for (size_t i = 0; i < pb->n_txns; i++) {
+        if (pb->txns[i] == NULL) {
+            remove_partial_block(index);
+            return;
+        }
+    }
+    if (complete_partial_block(peer, pb)) {
+        remove_partial_block(index);
+    }
+}
+
+/*
+ * The reconciliation_t struct collects the result of decoding the difference
+ * between our pool sketch and a peer's pool sketch.
+ */
+typedef struct reconciliation {
+    short_id_t *ids;
+    size_t n_ids;
+    dynamic_buffer_t missing;
+    size_t n_missing;
+    dynamic_buffer_t wanted;
+} reconciliation_t;
+
+static void on_reconciled(void *ctx, uint64_t id, bool ours) {
+    reconciliation_t *r = ctx;
+    if (ours) {
+        transaction_t *txn = find_short_id(r->ids, r->n_ids, id);
+        if (txn == NULL) return;
+        transaction_write(txn, &r->missing);
+        r->n_missing += 1;
+    } else {
+        write_short_id(&r->wanted, id);
+    }
+}
+
+/**
+ * Synchronize pool of pending transactions with peer. Subtract the peer's
+ * sketch from a sketch of our own pool. If the difference decodes, send the
+ * peer the transactions it lacks and fetch the transactions we lack. Otherwise
+ * the pools differ too much, so send the peer all of our short ids instead.
+ *
+ * msg: (key: binary, sketch: binary)
  */
 void on_pool_request(peer_t *peer, tuple_t *msg) {
+    if (!is_pool_message_valid(msg)) return;
+    uint8_t *key = tuple_get_binary(msg, 0).data;
+    iblt_t *theirs = iblt_create_from_buffer(tuple_get_binary(msg, 1));
+    if (theirs == NULL) return;
+    if (iblt_size(theirs) > POOL_MAX_SKETCH_CELLS) {
+        iblt_destroy(theirs);
+        return;
+    }
+
+    reconciliation_t r;
+    r.ids = pool_short_ids(key, &r.n_ids);
+    iblt_t *ours = iblt_create(iblt_size(theirs));
+    for (size_t i = 0; i < r.n_ids; i++) {
+        iblt_insert(ours, r.ids[i].id);
+    }
+    iblt_subtract(ours, theirs);
+
+    r.missing = dynamic_buffer_create(64);
+    r.n_missing = 0;
+    r.wanted = dynamic_buffer_create(64);
+    tuple_write_start(&r.missing);
+    if (iblt_decode(ours, on_reconciled, &r)) {
+        tuple_write_end(&r.missing);
+        if (r.n_missing > 0) {
+            network_send(network, EVENT_POOL_RESPONSE, (buffer_t *) &r.missing, peer);
+        }
+        if (r.wanted.length > 0) {
+            send_pool_message(peer, EVENT_POOL_FETCH, key, &r.wanted);
+        }
+    } else {
+        dynamic_buffer_t inventory = dynamic_buffer_create(r.n_ids * SHORT_ID_SIZE + 1);
+        for (size_t i = 0; i < r.n_ids; i++) {
+            write_short_id(&inventory, r.ids[i].id);
+        }
+        send_pool_message(peer, EVENT_POOL_INVENTORY, key, &inventory);
+        dynamic_buffer_destroy(inventory);
+    }
+
+    dynamic_buffer_destroy(r.missing);
+    dynamic_buffer_destroy(r.wanted);
+    iblt_destroy(ours);
+    iblt_destroy(theirs);
+    free(r.ids);
+}
+
+/**
+ * Send the peer the pooled transactions with the requested short ids.
+ *
+ * msg: (key: binary, ids: binary)
+ */
+void on_pool_fetch(peer_t *peer, tuple_t *msg) {
+    if (!is_pool_message_valid(msg)) return;
+    uint8_t *key = tuple_get_binary(msg, 0).data;
+    buffer_t wanted = tuple_get_binary(msg, 1);
+
+    size_t n_ids;
+    short_id_t *ids = pool_short_ids(key, &n_ids);
     dynamic_buffer_t buf = dynamic_buffer_create(64);
     tuple_write_start(&buf);
-    for (size_t i = 0; i < pool_size(pool); i += 1) {
-        transaction_t *txn = pool_get(pool, i);
-        transaction_write(txn, &buf);
+    for (size_t i = 0; i + SHORT_ID_SIZE <= wanted.length; i += SHORT_ID_SIZE) {
+        transaction_t *txn = find_short_id(ids, n_ids, read_short_id(wanted.data + i));
+        if (txn != NULL) transaction_write(txn, &buf);
     }
     tuple_write_end(&buf);
     network_send(network, EVENT_POOL_RESPONSE, (buffer_t *) &buf, peer);
-    dynamic_buffer_destroy(buf);
+    free(ids);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Reconcile our pool with the complete list of short ids in the peer's pool.
+ * Send the peer the transactions it lacks and fetch the transactions we lack.
+ *
+ * msg: (key: binary, ids: binary)
+ */
+void on_pool_inventory(peer_t *peer, tuple_t *msg) {
+    if (!is_pool_message_valid(msg)) return;
+    uint8_t *key = tuple_get_binary(msg, 0).data;
+    buffer_t inventory = tuple_get_binary(msg, 1);
+
+    size_t n_theirs = inventory.length / SHORT_ID_SIZE;
+    uint64_t *theirs = malloc((n_theirs + 1) * sizeof(uint64_t));
+    assert(theirs != NULL);
+    for (size_t i = 0; i < n_theirs; i++) {
+        theirs[i] = read_short_id(inventory.data + i * SHORT_ID_SIZE);
+    }
+    qsort(theirs, n_theirs, sizeof(uint64_t), compare_u64);
+
+    size_t n_ours;
+    short_id_t *ours = pool_short_ids(key, &n_ours);
+
+    /* merge the sorted lists to find the ids only one of us has */
+    dynamic_buffer_t missing = dynamic_buffer_create(64);
+    dynamic_buffer_t wanted = dynamic_buffer_create(64);
+    size_t n_missing = 0;
+    size_t i = 0, j = 0;
+    tuple_write_start(&missing);
+    while (i < n_ours || j < n_theirs) {
+        if (j == n_theirs || (i < n_ours && ours[i].id < theirs[j])) {
+            transaction_write(ours[i].txn, &missing);
+            n_missing += 1;
+            i += 1;
+        } else if (i == n_ours || theirs[j] < ours[i].id) {
+            write_short_id(&wanted, theirs[j]);
+            j += 1;
+        } else {
+            i += 1;
+            j += 1;
+        }
+    }
+    tuple_write_end(&missing);
+
+    if (n_missing > 0) {
+        network_send(network, EVENT_POOL_RESPONSE, (buffer_t *) &missing, peer);
+    }
+    if (wanted.length > 0) {
+        send_pool_message(peer, EVENT_POOL_FETCH, key, &wanted);
+    }
+
+    dynamic_buffer_destroy(missing);
+    dynamic_buffer_destroy(wanted);
+    free(ours);
+    free(theirs);
 }
 
 /**
@@ -342,6 +1202,110 @@ void on_transaction(peer_t *peer, tuple_t *msg) {
     }
 }
 
+/*
+ * The pool_loader_t struct holds the parsed pool file while its transactions
+ * are verified on the libuv threadpool. Each pool_chunk_t verifies a range
+ * of the transactions in the file.
+ */
+typedef struct pool_loader {
+    buffer_t file;
+    tuple_t *txns;
+    size_t n_loaded;
+} pool_loader_t;
+
+typedef struct pool_chunk {
+    uv_work_t req;
+    pool_loader_t *loader;
+    size_t start;
+    size_t end;
+    transaction_t **txns;
+} pool_chunk_t;
+
+/**
+ * Parse and verify the signatures of a range of transactions from the pool
+ * file. This runs on a threadpool thread and only reads the shared tuple.
+ */
+void verify_pool_chunk(uv_work_t *req) {
+    pool_chunk_t *chunk = req->data;
+    tuple_t *txns = chunk->loader->txns;
+    for (size_t i = chunk->start; i < chunk->end; i++) {
+        if (tuple_get_type(txns, i) != TUPLE_START) continue;
+        chunk->txns[i - chunk->start] = transaction_create_from_tuple(tuple_get_tuple(txns, i));
+    }
+}
+
+/**
+ * Add the verified transactions of a chunk to the pool. Once every chunk is
+ * done, free the pool file.
+ */
+void on_pool_chunk_verified(uv_work_t *req, int status) {
+    pool_chunk_t *chunk = req->data;
+    pool_loader_t *loader = chunk->loader;
+    for (size_t i = 0; i < chunk->end - chunk->start; i++) {
+        if (chunk->txns[i] == NULL) continue;
+        pool_restore(pool, chunk->txns[i]);
+        loader->n_loaded += 1;
+    }
+    free(chunk->txns);
+    free(chunk);
+
+    pool_loads_pending -= 1;
+    if (pool_loads_pending == 0) {
+        printf("info: restored %zu transactions from %s\n", loader->n_loaded, pool_path);
+        tuple_destroy(loader->txns);
+        buffer_destroy(loader->file);
+        free(loader);
+    }
+}
+
+/**
+ * Restore the pool saved by a previous run of the node. Signature checks
+ * dominate the cost of loading a large pool, so the transactions are verified
+ * in chunks in parallel on the libuv threadpool and added to the pool as each
+ * chunk completes.
+ */
+void load_pool() {
+    FILE *file = fopen(pool_path, "rb");
+    if (file == NULL) return;
+    buffer_t contents = buffer_read(file);
+    fclose(file);
+    tuple_t *txns = tuple_parse(&contents);
+    if (txns == NULL) {
+        printf("error: unable to read pool from %s\n", pool_path);
+        buffer_destroy(contents);
+        return;
+    }
+
+    pool_loader_t *loader = calloc(1, sizeof(pool_loader_t));
+    assert(loader != NULL);
+    loader->file = contents;
+    loader->txns = txns;
+
+    size_t n = tuple_size(txns);
+    size_t chunk_size = (n + POOL_LOAD_CHUNKS - 1) / POOL_LOAD_CHUNKS;
+    pool_loads_pending = 1;
+    for (size_t start = 0; start < n; start += chunk_size) {
+        pool_chunk_t *chunk = calloc(1, sizeof(pool_chunk_t));
+        assert(chunk != NULL);
+        chunk->req.data = chunk;
+        chunk->loader = loader;
+        chunk->start = start;
+        chunk->end = start + chunk_size < n ? start + chunk_size : n;
+        chunk->txns = calloc(chunk->end - start, sizeof(transaction_t*));
+        assert(chunk->txns != NULL);
+        pool_loads_pending += 1;
+        uv_queue_work(uv_default_loop(), &chunk->req, verify_pool_chunk, on_pool_chunk_verified);
+    }
+
+    /* release the initial reference, which covers an empty pool file */
+    pool_loads_pending -= 1;
+    if (pool_loads_pending == 0) {
+        tuple_destroy(txns);
+        buffer_destroy(contents);
+        free(loader);
+    }
+}
+
 /**
  * Once per second, we attempt to append a new block onto the principal leaf node of
  * the blockchain. Before doings so, we should make sure that we have not already
@@ -350,12 +1314,7 @@ void on_transaction(peer_t *peer, tuple_t *msg) {
 void on_timer(uv_timer_t* handle) {
     block_t *block = blockchain_get_principal(blockchain); 
     if (block != NULL && block_get_child_with_public_key(block, get_public_key()) == NULL) {
-        list_t *txns = list_create(1);
-        while (pool_size(pool) != 0) {
-            transaction_t *txn = pool_remove(pool, 0);
-            list_add(txns, txn);
-        }
-        block_t *next = block_create(get_public_key(), get_secret_key(), block, txns); 
+        block_t *next = create_block(block);
         if (next != NULL) {
             blockchain_add_block(blockchain, next);
             broadcast_block(next);    
@@ -363,6 +1322,20 @@ void on_timer(uv_timer_t* handle) {
     }   
 }
 
+/**
+ * Re-check the pending transactions of every account whose balance is
+ * changed by the given block.
+ * @param block the block
+ */
+void update_pool_accounts(block_t *block) {
+    pool_update(pool, block_get_public_key(block));
+    for (size_t i = 0; i < block_get_transaction_count(block); i++) {
+        transaction_t *txn = block_get_transaction(block, i);
+        pool_update(pool, transaction_get_sender(txn));
+        pool_update(pool, transaction_get_recipient(txn));
+    }
+}
+
 /**
  * As soon as the blockchain is extended, we should start mining a new block
  * extending the new longest chain.
@@ -371,14 +1344,26 @@ void on_extended(block_t *prev, block_t *block) {
     
     // If prev is not an ancestor of block, then a fork has overtaken the
     // longest chain. This invalidates all transactions after the common
-    // ancestor of the fork. We should add all of these transactions back to
-    // the mempool so they can be confirmed again.
-    while (!block_has_ancestor(block, prev)) {
-        for (size_t i = 0; i < block_get_transaction_count(prev); i++) {
-            transaction_t *txn = block_get_transaction(prev, i);
-            pool_add(pool, txn);
+    // ancestor of the fork. We should add copies of all of these transactions
+    // back to the mempool so they can be confirmed again.
+    block_t *ancestor = prev;
+    while (!block_has_ancestor(block, ancestor)) {
+        for (size_t i = 0; i < block_get_transaction_count(ancestor); i++) {
+            transaction_t *txn = block_get_transaction(ancestor, i);
+            pool_add(pool, transaction_copy(txn));
         }
-        prev = block_get_prev(prev);
+        update_pool_accounts(ancestor);
+        ancestor = block_get_prev(ancestor);
+    }
+
+    // Every block between the common ancestor and the new leaf node confirms
+    // its transactions, so they should no longer be pending.
+    for (block_t *iter = block; iter != ancestor; iter = block_get_prev(iter)) {
+        for (size_t i = 0; i < block_get_transaction_count(iter); i++) {
+            transaction_t *txn = block_get_transaction(iter, i);
+            pool_evict(pool, transaction_get_hash(txn));
+        }
+        update_pool_accounts(iter);
     }
 
     uv_timer_stop(&timer_req);
@@ -497,7 +1482,10 @@ int handle_send_command(void *ctx, list_t *args) {
     uint8_t *recipient = hex_to_binary(list_get(args, 2), crypto_vrf_PUBLICKEYBYTES);
     if (recipient == NULL) return -1;
     transaction_t *txn = transaction_create(get_public_key(), get_secret_key(), recipient, value, 0);
-    if (txn != NULL) pool_add(pool, txn);
+    if (txn != NULL) {
+        broadcast_transaction(txn);
+        pool_add(pool, txn);
+    }
     free(recipient);
     if (txn == NULL) return -1;
     else return 0;
@@ -540,7 +1528,28 @@ int main(int argc, char **argv) {
     crypto_vrf_keypair(pk, sk);    
     blockchain = blockchain_create(on_extended);
     network = network_create();
-    pool = pool_create();
+    pool = pool_create(lookup_balance);
+    download = download_create(request_blocks, deliver_block);
+
+    /*
+     * Restore the transaction pool saved by the previous run of the node and
+     * periodically save it again.
+     */
+    if (settings.pool_file[0] != '\0') {
+        snprintf(pool_path, sizeof(pool_path), "%s", settings.pool_file);
+    } else {
+        snprintf(pool_path, sizeof(pool_path), "pool-%d.dat", settings.port);
+    }
+    load_pool();
+    if (settings.pool_save_interval > 0) {
+        uint64_t interval = 1000 * (uint64_t) settings.pool_save_interval;
+        uv_timer_init(uv_default_loop(), &pool_timer_req);
+        uv_timer_start(&pool_timer_req, on_pool_timer, interval, interval);
+    }
+    uv_timer_init(uv_default_loop(), &download_timer_req);
+    uv_timer_start(&download_timer_req, on_download_timer, DOWNLOAD_INTERVAL, DOWNLOAD_INTERVAL);
+    uv_timer_init(uv_default_loop(), &pool_sync_timer_req);
+    uv_timer_start(&pool_sync_timer_req, on_pool_sync_timer, POOL_SYNC_INTERVAL, POOL_SYNC_INTERVAL);
 
     network_register(network, EVENT_CONNECT, on_connect);
     network_register(network, EVENT_DISCONNECT, on_disconnect);
@@ -550,9 +1559,16 @@ int main(int argc, char **argv) {
     network_register(network, EVENT_BLOCK, on_block);
     network_register(network, EVENT_BLOCKS_REQUEST, on_blocks_request);
     network_register(network, EVENT_BLOCKS_RESPONSE, on_blocks_response);
+    network_register(network, EVENT_HEADERS_REQUEST, on_headers_request);
+    network_register(network, EVENT_HEADERS_RESPONSE, on_headers_response);
     network_register(network, EVENT_POOL_REQUEST, on_pool_request);
     network_register(network, EVENT_POOL_RESPONSE, on_pool_response);
+    network_register(network, EVENT_POOL_FETCH, on_pool_fetch);
+    network_register(network, EVENT_POOL_INVENTORY, on_pool_inventory);
     network_register(network, EVENT_TRANSACTION, on_transaction);
+    network_register(network, EVENT_COMPACT_BLOCK, on_compact_block);
+    network_register(network, EVENT_BLOCK_TXNS_REQUEST, on_block_txns_request);
+    network_register(network, EVENT_BLOCK_TXNS_RESPONSE, on_block_txns_response);
 
     /*
      * Attempt to establish a peer-to-peer connection for each of the
@@ -600,8 +1616,7 @@ int main(int argc, char **argv) {
     /*
      * Attempt to fork the blockchain.
      */
-    list_t *txns = list_create(1);
-    block_t *block = block_create(get_public_key(), get_secret_key(), NULL, txns);
+    block_t *block = create_block(NULL);
     if (block != NULL) {
         blockchain_add_block(blockchain, block);
         broadcast_block(block);
@@ -629,5 +1644,9 @@ int main(int argc, char **argv) {
     pool_destroy(pool);
     http_destroy(http);
     network_destroy(network);
+    download_destroy(download);
     cli_destroy(cli);
+    for (size_t i = 0; i < MAX_PARTIAL_BLOCKS; i++) {
+        remove_partial_block(i);
+    }
 }
\ No newline at end of file
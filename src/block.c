@@ -1,7 +1,7 @@
 #include "block.h"
 #include "transaction.h"
 
-#include "util/map.h"
+#include "util/typed_map.h"
 #include "util/json.h"
 
 #include <sodium.h>
@@ -23,6 +23,12 @@ typedef struct account {
     block_t *block;
 } account_t;
 
+static void account_destroy(account_t *account) {
+    free(account);
+}
+
+TYPED_MAP(account_map, digest_t, account_t*, digest_hash, digest_equal)
+
 struct block {
     
     /* header */
@@ -42,7 +48,7 @@ struct block {
     uint8_t sortition_priority[crypto_generichash_BYTES];
     list_t *children;
     uint32_t height;
-    map_t *accounts;
+    account_map_t *accounts;
 };
 
 static char* binary_to_hex(const uint8_t *data, size_t size) {
@@ -54,23 +60,6 @@ static char* binary_to_hex(const uint8_t *data, size_t size) {
 } 
 
 
-/*
- * The hash function for BLAKE2 hashes. Return the least significant bytes in
- * the hash. If we are doing proof of stake, the most significant bytes will
- * all be zero.
- */
-static size_t hash(uint8_t *hash) {
-    return *((size_t *)(hash + crypto_generichash_BYTES) - 1);
-}
-
-/*
- * The comparison function for sorting and equating BLAKE2b hashes. We can just
- * use the the builtin function memcmp for this functionality.
- */
-static int compare(void *h1, void *h2) {
-    return memcmp(h1, h2, crypto_generichash_BYTES);
-}
-
 static int compare_block(void *b1, void *b2) {
     return (uintptr_t) b1 - (uintptr_t)b2;
 }
@@ -81,7 +70,7 @@ static int compare_block(void *b1, void *b2) {
  */
 const account_t* block_get_account(const block_t *block, const uint8_t *public_key) {
     while (block != NULL) {
-        account_t *account = map_get(block->accounts, public_key);
+        account_t *account = account_map_get(block->accounts, DIGEST(public_key));
         if (account != NULL) {
             return account;
         }
@@ -173,7 +162,7 @@ static bool are_transactions_valid(block_t *block) {
     creator_account->value = prev_value + COINBASE_TRANSACTION;
     creator_account->prev = prev_creator_account;
     creator_account->block = block;
-    map_set(block->accounts, block->public_key, creator_account);
+    account_map_set(block->accounts, DIGEST(block->public_key), creator_account);
 
     for (size_t i = 0; i < list_size(block->transactions); i++) {
         transaction_t *txn = list_get(block->transactions, i);
@@ -183,34 +172,39 @@ static bool are_transactions_valid(block_t *block) {
 
         // TODO: check for double spending in current blockchain
 
-        account_t *sender_account = map_get(block->accounts, sender);
-        if (sender_account != NULL) {
-            sender_account->value -= value;
+        // account values are unsigned, so check for overdrafts before debiting
+        bool inserted;
+        account_t **sender_account = account_map_get_or_insert(block->accounts, DIGEST(sender), &inserted);
+        if (!inserted) {
+            if ((*sender_account)->value < value) return false;
+            (*sender_account)->value -= value;
         } else {
             account_t *prev_sender_account = block_get_account(block->prev_block, sender);
             uint64_t prev_value = prev_sender_account != NULL ? prev_sender_account->value: 0;
-            sender_account = malloc(sizeof(account_t));
-            assert(sender_account != NULL);
-            sender_account->value = prev_value - value;
-            sender_account->prev = prev_sender_account;
-            sender_account->block = block;
-            map_set(block->accounts, sender, sender_account);
+            if (prev_value < value) {
+                account_map_remove(block->accounts, DIGEST(sender));
+                return false;
+            }
+            account_t *account = malloc(sizeof(account_t));
+            assert(account != NULL);
+            account->value = prev_value - value;
+            account->prev = prev_sender_account;
+            account->block = block;
+            *sender_account = account;
         }
 
-        if (sender_account->value < 0) return false;
-
-        account_t *recipient_account = map_get(block->accounts, recipient);
-        if (recipient_account != NULL) {
-            recipient_account->value += value;
+        account_t **recipient_account = account_map_get_or_insert(block->accounts, DIGEST(recipient), &inserted);
+        if (!inserted) {
+            (*recipient_account)->value += value;
         } else {
             account_t *prev_recipient_account = block_get_account(block->prev_block, recipient);
             uint64_t prev_value = prev_recipient_account != NULL ? prev_recipient_account->value: 0;
-            recipient_account = malloc(sizeof(account_t));
-            assert(recipient_account != NULL);
-            recipient_account->value = prev_value + value;
-            recipient_account->prev = prev_recipient_account;
-            recipient_account->block = block;
-            map_set(block->accounts, recipient, recipient_account);
+            account_t *account = malloc(sizeof(account_t));
+            assert(account != NULL);
+            account->value = prev_value + value;
+            account->prev = prev_recipient_account;
+            account->block = block;
+            *recipient_account = account;
         }
     }
 
@@ -259,6 +253,10 @@ void compute_merkle_root(uint8_t (*hashes)[crypto_generichash_BYTES], size_t n)
  */
 static void merkle_root_from_tuple(tuple_t *txns, uint8_t *result) {
     const size_t n = tuple_size(txns);
+    if (n == 0) {
+        memset(result, 0, crypto_generichash_BYTES);
+        return;
+    }
     uint8_t hashes[n][crypto_generichash_BYTES];
     
     // compute hash of all transactions
@@ -270,8 +268,7 @@ static void merkle_root_from_tuple(tuple_t *txns, uint8_t *result) {
 
     // recursively hash together adjacent elements
     compute_merkle_root(hashes, n);    
-    if (n > 0) memcpy(result, hashes[0], crypto_generichash_BYTES);
-    else memset(result, 0, crypto_generichash_BYTES);
+    memcpy(result, hashes[0], crypto_generichash_BYTES);
 }
 
 /**
@@ -281,6 +278,10 @@ static void merkle_root_from_tuple(tuple_t *txns, uint8_t *result) {
  */
 void merkle_root_from_list(list_t *txns, uint8_t *result) {
     size_t n = list_size(txns);
+    if (n == 0) {
+        memset(result, 0, crypto_generichash_BYTES);
+        return;
+    }
     uint8_t hashes[n][crypto_generichash_BYTES];
 
     // compute hash of all transactions
@@ -293,17 +294,28 @@ void merkle_root_from_list(list_t *txns, uint8_t *result) {
     // recursively hash together adjacent elements
     compute_merkle_root(hashes, n);
 
-    if (n > 0) memcpy(result, hashes[0], crypto_generichash_BYTES);
-    else memset(result, 0, crypto_generichash_BYTES);
+    memcpy(result, hashes[0], crypto_generichash_BYTES);
 }
 
 uint8_t* block_get_seed(block_t *block) {
     return block->sortition_seed;
 }
 
-block_t* block_create(const uint8_t *public_key, const uint8_t *private_key, block_t *prev, list_t *txns) {
+/**
+ * Create a new block containing the given list of transactions with a
+ * precomputed merkle root. If the block cannot be created, destroy the
+ * transactions and return NULL.
+ */
+static block_t* block_create_with_merkle_root(
+    const uint8_t *public_key,
+    const uint8_t *private_key,
+    block_t *prev,
+    list_t *txns,
+    const uint8_t *merkle_root
+) {
 
     if (!is_staking_allowed(prev, public_key)) {
+        list_destroy(txns, (void (*)(void *)) transaction_destroy);
         return NULL;
     }
 
@@ -313,7 +325,7 @@ block_t* block_create(const uint8_t *public_key, const uint8_t *private_key, blo
     // header
     result->prev_block = prev;
     result->timestamp = time(NULL);
-    merkle_root_from_list(txns, result->merkle_root);
+    memcpy(result->merkle_root, merkle_root, crypto_generichash_BYTES);
     result->transactions = txns;
     memcpy(result->public_key, public_key, crypto_vrf_PUBLICKEYBYTES);
     block_compute_seed(result);
@@ -325,6 +337,7 @@ block_t* block_create(const uint8_t *public_key, const uint8_t *private_key, blo
     if (prev == NULL) n_delegates = 1;
     if (account != NULL) n_delegates = account_get_delegates(account);
     if (n_delegates == 0) {
+        list_destroy(txns, (void (*)(void *)) transaction_destroy);
         free(result);
         return NULL;
     }
@@ -351,7 +364,7 @@ block_t* block_create(const uint8_t *public_key, const uint8_t *private_key, blo
     crypto_sign_detached(result->signature, NULL, result->hash, crypto_generichash_BYTES, private_key);
 
     result->height = 1 + block_get_height(prev);
-    result->accounts = map_create(N_ACCOUNT_BUCKETS, hash, NULL, free, compare);
+    result->accounts = account_map_create(N_ACCOUNT_BUCKETS, account_destroy);
     result->children = list_create(1);
 
     if (!are_transactions_valid(result)) {
@@ -362,7 +375,162 @@ block_t* block_create(const uint8_t *public_key, const uint8_t *private_key, blo
     return result;
 }
 
-bool is_header_valid(tuple_t *tuple) {
+block_t* block_create(const uint8_t *public_key, const uint8_t *private_key, block_t *prev, list_t *txns) {
+    uint8_t merkle_root[crypto_generichash_BYTES];
+    merkle_root_from_list(txns, merkle_root);
+    return block_create_with_merkle_root(public_key, private_key, prev, txns, merkle_root);
+}
+
+/*
+ * The pending_account_t struct is the balance of an account in the pending
+ * ledger state of a block builder.
+ */
+typedef struct pending_account {
+    uint8_t public_key[crypto_vrf_PUBLICKEYBYTES];
+    uint64_t value;
+} pending_account_t;
+
+static void pending_account_destroy(pending_account_t *account) {
+    free(account);
+}
+
+TYPED_MAP(pending_account_map, digest_t, pending_account_t*, digest_hash, digest_equal)
+
+/*
+ * Since the merkle tree is built by hashing together adjacent pairs level by
+ * level, it can be decomposed into perfect subtrees whose sizes are the bits
+ * of the transaction count, largest first. The builder keeps the roots of
+ * these subtrees, so appending a transaction only hashes O(log n) nodes and
+ * the merkle root is obtained by hashing the subtree roots from right to left.
+ */
+#define MERKLE_MAX_PEAKS 64
+
+struct block_builder {
+    block_t *prev;
+    uint8_t public_key[crypto_vrf_PUBLICKEYBYTES];
+    size_t size;
+    size_t max_size;
+    list_t *transactions;
+    pending_account_map_t *accounts;
+    uint8_t peaks[MERKLE_MAX_PEAKS][crypto_generichash_BYTES];
+    size_t n_peaks;
+};
+
+/**
+ * Return the pending account of the given public key, creating it from the
+ * account state of the previous block if it does not exist yet.
+ */
+static pending_account_t* block_builder_get_account(block_builder_t *builder, const uint8_t *public_key) {
+    bool inserted;
+    pending_account_t **slot = pending_account_map_get_or_insert(builder->accounts, DIGEST(public_key), &inserted);
+    if (!inserted) return *slot;
+    const account_t *prev_account = block_get_account(builder->prev, public_key);
+    pending_account_t *account = malloc(sizeof(pending_account_t));
+    assert(account != NULL);
+    memcpy(account->public_key, public_key, crypto_vrf_PUBLICKEYBYTES);
+    account->value = prev_account != NULL ? prev_account->value : 0;
+    *slot = account;
+    return account;
+}
+
+/**
+ * Append a transaction hash as the next leaf of the merkle tree, merging
+ * subtrees of equal size. This must be called before the transaction is
+ * added to the transaction list.
+ */
+static void block_builder_append_leaf(block_builder_t *builder, const uint8_t *leaf) {
+    uint8_t node[2 * crypto_generichash_BYTES];
+    memcpy(builder->peaks[builder->n_peaks], leaf, crypto_generichash_BYTES);
+    builder->n_peaks += 1;
+    for (size_t n = list_size(builder->transactions); n & 1; n >>= 1) {
+        uint8_t *left = builder->peaks[builder->n_peaks - 2];
+        uint8_t *right = builder->peaks[builder->n_peaks - 1];
+        memcpy(node, left, crypto_generichash_BYTES);
+        memcpy(node + crypto_generichash_BYTES, right, crypto_generichash_BYTES);
+        crypto_generichash(left, crypto_generichash_BYTES, node, sizeof(node), NULL, 0);
+        builder->n_peaks -= 1;
+    }
+}
+
+block_builder_t* block_builder_create(block_t *prev, const uint8_t *public_key, size_t max_size) {
+    assert(public_key != NULL);
+    block_builder_t *builder = calloc(1, sizeof(block_builder_t));
+    assert(builder != NULL);
+    builder->prev = prev;
+    memcpy(builder->public_key, public_key, crypto_vrf_PUBLICKEYBYTES);
+    builder->max_size = max_size;
+    builder->transactions = list_create(64);
+    builder->accounts = pending_account_map_create(N_ACCOUNT_BUCKETS, pending_account_destroy);
+
+    /* credit the block creator with the coinbase transaction */
+    pending_account_t *creator = block_builder_get_account(builder, public_key);
+    creator->value += COINBASE_TRANSACTION;
+    return builder;
+}
+
+bool block_builder_add(block_builder_t *builder, transaction_t *txn) {
+    assert(builder != NULL);
+    assert(txn != NULL);
+    size_t size = transaction_get_size(txn);
+    if (builder->size + size > builder->max_size) return false;
+
+    uint64_t value = transaction_get_value(txn);
+    pending_account_t *sender = block_builder_get_account(builder, transaction_get_sender(txn));
+    if (sender->value < value) return false;
+    pending_account_t *recipient = block_builder_get_account(builder, transaction_get_recipient(txn));
+    sender->value -= value;
+    recipient->value += value;
+
+    block_builder_append_leaf(builder, transaction_get_hash(txn));
+    list_add(builder->transactions, txn);
+    builder->size += size;
+    return true;
+}
+
+size_t block_builder_get_transaction_count(block_builder_t *builder) {
+    assert(builder != NULL);
+    return list_size(builder->transactions);
+}
+
+void block_builder_get_merkle_root(block_builder_t *builder, uint8_t *result) {
+    assert(builder != NULL);
+    if (builder->n_peaks == 0) {
+        memset(result, 0, crypto_generichash_BYTES);
+        return;
+    }
+    uint8_t node[2 * crypto_generichash_BYTES];
+    memcpy(result, builder->peaks[builder->n_peaks - 1], crypto_generichash_BYTES);
+    for (size_t i = builder->n_peaks - 1; i > 0; i--) {
+        memcpy(node, builder->peaks[i - 1], crypto_generichash_BYTES);
+        memcpy(node + crypto_generichash_BYTES, result, crypto_generichash_BYTES);
+        crypto_generichash(result, crypto_generichash_BYTES, node, sizeof(node), NULL, 0);
+    }
+}
+
+block_t* block_builder_finish(block_builder_t *builder, const uint8_t *private_key) {
+    assert(builder != NULL);
+    uint8_t merkle_root[crypto_generichash_BYTES];
+    block_builder_get_merkle_root(builder, merkle_root);
+    block_t *block = block_create_with_merkle_root(
+        builder->public_key,
+        private_key,
+        builder->prev,
+        builder->transactions,
+        merkle_root
+    );
+    pending_account_map_destroy(builder->accounts);
+    free(builder);
+    return block;
+}
+
+void block_builder_destroy(block_builder_t *builder) {
+    if (builder == NULL) return;
+    list_destroy(builder->transactions, (void (*)(void *)) transaction_destroy);
+    pending_account_map_destroy(builder->accounts);
+    free(builder);
+}
+
+bool block_header_is_valid(tuple_t *tuple) {
 
     assert(tuple != NULL);
     if (tuple_size(tuple) != 7) return false;
@@ -389,7 +557,7 @@ bool block_is_valid(tuple_t *tuple) {
 
     tuple_t *header = tuple_get_tuple(tuple, 0);
     tuple_t *txns = tuple_get_tuple(tuple, 2);
-    if (!is_header_valid(header)) return false;
+    if (!block_header_is_valid(header)) return false;
     if (tuple_size(txns) != tuple_get_u32(header, 6)) return false;
     for (size_t i = 0; i < tuple_size(txns); i++) {
         if (tuple_get_type(txns, i) != TUPLE_START) return false;
@@ -468,7 +636,7 @@ block_t* block_create_from_tuple(tuple_t *tuple, block_t* (*find)(buffer_t)) {
     }
 
     result->height = 1 + block_get_height(result->prev_block);
-    result->accounts = map_create(N_ACCOUNT_BUCKETS, hash, NULL, free, compare);    
+    result->accounts = account_map_create(N_ACCOUNT_BUCKETS, account_destroy);
     result->children = list_create(1);
     result->transactions = list_create(tuple_size(txns));
     for (size_t i = 0; i < tuple_size(txns); i++) {
@@ -574,7 +742,8 @@ uint8_t* block_get_hash(block_t *block) {
 void block_destroy(block_t *block) {
     if (block == NULL) return;
     list_destroy(block->transactions, (void (*)(void *)) transaction_destroy);
-    map_destroy(block->accounts);
+    account_map_destroy(block->accounts);
+    list_destroy(block->children, NULL);
     free(block);
 }
 
@@ -614,6 +783,23 @@ void block_write(block_t *block, dynamic_buffer_t *buf) {
     tuple_write_end(buf);
 }
 
+void block_write_compact(block_t *block, dynamic_buffer_t *buf) {
+    const uint8_t *key = block->hash;
+    tuple_write_start(buf);
+    block_write_header(block, buf);
+    tuple_write_binary(buf, crypto_sign_BYTES, block->signature);
+    dynamic_buffer_t ids = dynamic_buffer_create(crypto_shorthash_BYTES * list_size(block->transactions) + 1);
+    for (size_t i = 0; i < list_size(block->transactions); i++) {
+        uint64_t id = transaction_get_short_id(list_get(block->transactions, i), key);
+        for (size_t j = crypto_shorthash_BYTES; j > 0; j--) {
+            dynamic_buffer_putc((uint8_t)(id >> (8 * (j - 1))), &ids);
+        }
+    }
+    tuple_write_binary(buf, ids.length, ids.data);
+    dynamic_buffer_destroy(ids);
+    tuple_write_end(buf);
+}
+
 void block_write_json_header(block_t *block, dynamic_buffer_t *buf) {
     char *prev_block = binary_to_hex(block_get_hash(block_get_prev(block)), crypto_generichash_BYTES);
     char *merkle_root = binary_to_hex(block->merkle_root, crypto_generichash_BYTES);
@@ -1,5 +1,5 @@
 #include "blockchain.h"
-#include "util/map.h"
+#include "util/typed_map.h"
 #include <assert.h>
 #include <sodium.h>
 #include <string.h>
@@ -8,66 +8,86 @@
 #define N_TXN_BUCKETS (1 << 12)
 #define PROOF_OF_STAKE 1
 
+TYPED_MAP(block_map, digest_t, block_t*, digest_hash, digest_equal)
+TYPED_MAP(txn_map, digest_t, transaction_t*, digest_hash, digest_equal)
+
 struct blockchain {
-    map_t *blocks;
-    map_t *txns;
+    block_map_t *blocks;
+    txn_map_t *txns;
     block_t *principal;
+    block_t **by_height;
+    size_t by_height_capacity;
     void (*on_extended)(block_t*, block_t*);
 };
 
-static size_t hash(void *h) {
+static size_t hash_priority(void *h) {
     return *(size_t*)((char *) h + crypto_generichash_BYTES - sizeof(size_t));
 }
 
-static int compare(void *h1, void *h2) {
+static int compare_priority(void *h1, void *h2) {
     return memcmp(h1, h2, crypto_generichash_BYTES);
 }
 
-static size_t hash_priority(void *h) {
-    return *(size_t*)((char *) h + crypto_generichash_BYTES - sizeof(size_t));
-}
+/*
+ * Make the block the leaf node of the principal block chain. The blocks of
+ * the principal block chain are indexed by height (block i has height i + 1),
+ * so only the entries above the fork point need to be replaced.
+ */
+static void set_principal(blockchain_t *bc, block_t *block) {
+    size_t height = block_get_height(block);
+    if (height > bc->by_height_capacity) {
+        while (bc->by_height_capacity < height) bc->by_height_capacity *= 2;
+        bc->by_height = realloc(bc->by_height, bc->by_height_capacity * sizeof(block_t*));
+        assert(bc->by_height != NULL);
+    }
+    for (block_t *iter = block; iter != NULL; iter = block_get_prev(iter)) {
+        size_t i = block_get_height(iter) - 1;
+        if (i < block_get_height(bc->principal) && bc->by_height[i] == iter) break;
+        bc->by_height[i] = iter;
+    }
 
-static int compare_priority(void *h1, void *h2) {
-    return memcmp(h1, h2, crypto_generichash_BYTES);
+    block_t *prev = bc->principal;
+    bc->principal = block;
+    bc->on_extended(prev, bc->principal);
 }
 
 blockchain_t *blockchain_create(void (*on_extended)(block_t*, block_t*)) {
     blockchain_t *bc = malloc(sizeof(blockchain_t));
     assert(bc != NULL);
-    bc->blocks = map_create(N_BLOCK_BUCKETS, hash, NULL, (destructor_t) block_destroy, compare);
-    bc->txns = map_create(N_TXN_BUCKETS, hash, NULL, NULL, compare);
+    bc->blocks = block_map_create(N_BLOCK_BUCKETS, block_destroy);
+    bc->txns = txn_map_create(N_TXN_BUCKETS, NULL);
     bc->principal = NULL;
+    bc->by_height_capacity = N_BLOCK_BUCKETS;
+    bc->by_height = malloc(bc->by_height_capacity * sizeof(block_t*));
+    assert(bc->by_height != NULL);
     bc->on_extended = on_extended;
     return bc;
 }
 
 bool blockchain_add_block(blockchain_t *bc, block_t *block) {
-    block_t *old = map_get(bc->blocks, block_get_hash(block));
-    if (old != NULL) {
+    bool inserted;
+    block_t **slot = block_map_get_or_insert(bc->blocks, DIGEST(block_get_hash(block)), &inserted);
+    if (!inserted) {
         block_destroy(block);
         return false;
     }
-    map_set(bc->blocks, block_get_hash(block), block);
+    *slot = block;
 
     block_t *prev = block_get_prev(block);
     if (prev != NULL) block_add_child(prev, block);
     for (size_t i = 0; i < block_get_transaction_count(block); i++) {
         transaction_t *txn = block_get_transaction(block, i);
-        map_set(bc->txns, transaction_get_hash(txn), txn);
+        txn_map_set(bc->txns, DIGEST(transaction_get_hash(txn)), txn);
     }
 
 #ifdef PROOF_OF_STAKE
     size_t principal_height = block_get_height(bc->principal);
     size_t block_height = block_get_height(block);
     if (block_get_prev(block) == bc->principal) {
-        block_t *prev = bc->principal;
-        bc->principal = block;
-        bc->on_extended(prev, bc->principal);
+        set_principal(bc, block);
     } else if (block_get_prev(block) == block_get_prev(bc->principal)) {
         if (memcmp(block_get_priority(block), block_get_priority(bc->principal), crypto_generichash_BYTES) < 0) {
-            block_t *prev = bc->principal;
-            bc->principal = block;
-            bc->on_extended(prev, bc->principal);
+            set_principal(bc, block);
         }
     } else {
         block_t *iter = bc->principal;
@@ -78,37 +98,41 @@ bool blockchain_add_block(blockchain_t *bc, block_t *block) {
         }
         if (block_get_prev(block) == iter) {
             if (memcmp(block_get_priority(block), block_get_priority(prev), crypto_generichash_BYTES) < 0) {
-                block_t *prev = bc->principal;
-                bc->principal = block;
-                bc->on_extended(prev, bc->principal);
+                set_principal(bc, block);
             }
         }
     }
 #elif
     if (bc->principal == NULL || block_get_height(block) > block_get_height(bc->principal)) {
-        block_t *prev = bc->principal;
-        bc->principal = block;
-        bc->on_extended(prev, bc->principal);
+        set_principal(bc, block);
     }
 #endif
     return true;
 }
 
 block_t *blockchain_get_block(blockchain_t *bc, buffer_t hash) {
-    return map_get(bc->blocks, hash.data);
+    if (hash.length != DIGEST_BYTES) return NULL;
+    return block_map_get(bc->blocks, DIGEST(hash.data));
 }
 
 transaction_t *blockchain_get_transaction(blockchain_t *bc, buffer_t hash) {
-    return map_get(bc->txns, hash.data);
+    if (hash.length != DIGEST_BYTES) return NULL;
+    return txn_map_get(bc->txns, DIGEST(hash.data));
 }
 
 block_t *blockchain_get_principal(blockchain_t *bc) {
     return bc->principal;
 }
 
+block_t *blockchain_get_principal_at(blockchain_t *bc, size_t height) {
+    if (height == 0 || height > block_get_height(bc->principal)) return NULL;
+    return bc->by_height[height - 1];
+}
+
 void blockchain_destroy(blockchain_t *bc) {
-    map_destroy(bc->blocks);
-    map_destroy(bc->txns);
+    block_map_destroy(bc->blocks);
+    txn_map_destroy(bc->txns);
+    free(bc->by_height);
     free(bc);
 }
 
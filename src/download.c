@@ -0,0 +1,303 @@
+#include <download.h>
+#include "util/list.h"
+#include "util/typed_map.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sodium.h>
+
+#define DOWNLOAD_WINDOW_SIZE 16
+#define DOWNLOAD_MAX_WINDOWS_PER_PEER 2
+#define DOWNLOAD_MAX_AHEAD 1024
+#define DOWNLOAD_TIMEOUT 10000
+#define DOWNLOAD_MAX_MISSES 8
+#define N_ENTRY_BUCKETS 1024
+
+/*
+ * The entry_t struct is a block that has not been delivered yet. The peer is
+ * the peer the block is requested from in the given window, or NULL if the
+ * block is not requested from any peer. The body is NULL until the block is
+ * received. A peer that answered a request without the block is remembered
+ * so that the block is requested from another peer next, unless no other
+ * peer can be asked, and the block is given up after DOWNLOAD_MAX_MISSES
+ * such answers.
+ */
+typedef struct entry {
+    uint8_t hash[crypto_generichash_BYTES];
+    peer_t *peer;
+    uint64_t window;
+    peer_t *missing_from;
+    size_t n_misses;
+    uint8_t *body;
+    size_t length;
+} entry_t;
+
+typedef struct window {
+    uint64_t id;
+    uint64_t deadline;
+} window_t;
+
+/*
+ * The peer_state_t struct holds the windows requested from a peer that have
+ * not been answered yet, oldest first. A response names the window it
+ * answers, so a response that arrives after its window was taken back is not
+ * mistaken for the answer to a later window. A peer that lets a window time
+ * out gets no new windows until its backoff has passed.
+ */
+typedef struct peer_state {
+    peer_t *peer;
+    window_t windows[DOWNLOAD_MAX_WINDOWS_PER_PEER];
+    size_t n_windows;
+    uint64_t backoff_until;
+} peer_state_t;
+
+TYPED_MAP(entry_map, digest_t, entry_t*, digest_hash, digest_equal)
+
+/*
+ * The entries between first and size are the blocks that have not been
+ * delivered, in the order they were added.
+ */
+struct download {
+    entry_t **entries;
+    size_t first;
+    size_t size;
+    size_t capacity;
+    entry_map_t *index;
+    list_t *peers;
+    size_t next_peer;
+    uint64_t next_window;
+    void (*request)(peer_t *peer, uint64_t window, const uint8_t *hashes, size_t n);
+    void (*deliver)(const uint8_t *body, size_t length);
+};
+
+static void entry_destroy(entry_t *entry) {
+    if (entry == NULL) return;
+    free(entry->body);
+    free(entry);
+}
+
+static peer_state_t* find_peer(download_t *self, peer_t *peer) {
+    for (size_t i = 0; i < list_size(self->peers); i++) {
+        peer_state_t *state = list_get(self->peers, i);
+        if (state->peer == peer) return state;
+    }
+    return NULL;
+}
+
+/*
+ * Remove the ith window of the peer and return the blocks of the window that
+ * have not arrived to the unrequested blocks. If missing is true, the peer
+ * answered without them.
+ */
+static void remove_window(download_t *self, peer_state_t *state, size_t i, bool missing) {
+    assert(i < state->n_windows);
+    uint64_t id = state->windows[i].id;
+    state->n_windows -= 1;
+    memmove(state->windows + i, state->windows + i + 1, (state->n_windows - i) * sizeof(window_t));
+    for (size_t i = self->first; i < self->size; i++) {
+        entry_t *entry = self->entries[i];
+        if (entry->peer != state->peer || entry->window != id) continue;
+        entry->peer = NULL;
+        if (missing) {
+            entry->missing_from = state->peer;
+            entry->n_misses += 1;
+        }
+    }
+}
+
+static bool is_done(const entry_t *entry) {
+    return entry->body != NULL || entry->n_misses >= DOWNLOAD_MAX_MISSES;
+}
+
+/*
+ * Deliver the bodies that are next in order and skip the blocks that have
+ * been given up.
+ */
+static void deliver_ready(download_t *self) {
+    while (self->first < self->size && is_done(self->entries[self->first])) {
+        entry_t *next = self->entries[self->first++];
+        entry_map_remove(self->index, DIGEST(next->hash));
+        if (next->body != NULL) self->deliver(next->body, next->length);
+        entry_destroy(next);
+    }
+    if (self->first == self->size) {
+        self->first = 0;
+        self->size = 0;
+    }
+}
+
+download_t* download_create(
+    void (*request)(peer_t *peer, uint64_t window, const uint8_t *hashes, size_t n),
+    void (*deliver)(const uint8_t *body, size_t length)
+) {
+    assert(request != NULL);
+    assert(deliver != NULL);
+    download_t *self = malloc(sizeof(download_t));
+    assert(self != NULL);
+    self->capacity = 64;
+    self->entries = malloc(self->capacity * sizeof(entry_t*));
+    assert(self->entries != NULL);
+    self->first = 0;
+    self->size = 0;
+    self->index = entry_map_create(N_ENTRY_BUCKETS, NULL);
+    self->peers = list_create(8);
+    self->next_peer = 0;
+    self->next_window = 1;
+    self->request = request;
+    self->deliver = deliver;
+    return self;
+}
+
+void download_destroy(download_t *self) {
+    if (self == NULL) return;
+    for (size_t i = self->first; i < self->size; i++) {
+        entry_destroy(self->entries[i]);
+    }
+    free(self->entries);
+    entry_map_destroy(self->index);
+    list_destroy(self->peers, free);
+    free(self);
+}
+
+bool download_add(download_t *self, const uint8_t *hash) {
+    assert(self != NULL);
+    bool inserted;
+    entry_t **slot = entry_map_get_or_insert(self->index, DIGEST(hash), &inserted);
+    if (!inserted) return false;
+
+    entry_t *entry = calloc(1, sizeof(entry_t));
+    assert(entry != NULL);
+    memcpy(entry->hash, hash, crypto_generichash_BYTES);
+    *slot = entry;
+
+    /* make room by moving delivered slots out of the way before growing */
+    if (self->size == self->capacity) {
+        if (self->first > self->capacity / 2) {
+            memmove(self->entries, self->entries + self->first, (self->size - self->first) * sizeof(entry_t*));
+            self->size -= self->first;
+            self->first = 0;
+        } else {
+            self->capacity *= 2;
+            self->entries = realloc(self->entries, self->capacity * sizeof(entry_t*));
+            assert(self->entries != NULL);
+        }
+    }
+    self->entries[self->size++] = entry;
+    return true;
+}
+
+void download_add_peer(download_t *self, peer_t *peer) {
+    assert(self != NULL);
+    if (find_peer(self, peer) != NULL) return;
+    peer_state_t *state = calloc(1, sizeof(peer_state_t));
+    assert(state != NULL);
+    state->peer = peer;
+    list_add(self->peers, state);
+}
+
+void download_remove_peer(download_t *self, peer_t *peer) {
+    assert(self != NULL);
+    for (size_t i = self->first; i < self->size; i++) {
+        entry_t *entry = self->entries[i];
+        if (entry->peer == peer) entry->peer = NULL;
+        if (entry->missing_from == peer) entry->missing_from = NULL;
+    }
+    for (size_t i = 0; i < list_size(self->peers); i++) {
+        peer_state_t *state = list_get(self->peers, i);
+        if (state->peer == peer) {
+            free(list_remove(self->peers, i));
+            return;
+        }
+    }
+}
+
+bool download_receive(download_t *self, const uint8_t *hash, const uint8_t *body, size_t length) {
+    assert(self != NULL);
+    entry_t *entry = entry_map_get(self->index, DIGEST(hash));
+    if (entry == NULL || entry->body != NULL) return false;
+    entry->peer = NULL;
+    entry->body = malloc(length + 1);
+    assert(entry->body != NULL);
+    memcpy(entry->body, body, length);
+    entry->length = length;
+    deliver_ready(self);
+    return true;
+}
+
+void download_complete(download_t *self, peer_t *peer, uint64_t window) {
+    assert(self != NULL);
+    peer_state_t *state = find_peer(self, peer);
+    if (state == NULL) return;
+    for (size_t i = 0; i < state->n_windows; i++) {
+        if (state->windows[i].id == window) {
+            remove_window(self, state, i, true);
+            deliver_ready(self);
+            return;
+        }
+    }
+}
+
+void download_schedule(download_t *self, uint64_t now) {
+    assert(self != NULL);
+    size_t n_peers = list_size(self->peers);
+
+    /* take back the windows of peers that have stalled */
+    for (size_t i = 0; i < n_peers; i++) {
+        peer_state_t *state = list_get(self->peers, i);
+        while (state->n_windows > 0 && state->windows[0].deadline <= now) {
+            state->backoff_until = now + DOWNLOAD_TIMEOUT;
+            remove_window(self, state, 0, false);
+        }
+    }
+
+    /*
+     * a block is only kept from the peer that answered without it while
+     * another peer can be asked, otherwise it is asked again
+     */
+    size_t n_ready = 0;
+    for (size_t i = 0; i < n_peers; i++) {
+        peer_state_t *state = list_get(self->peers, i);
+        if (state->backoff_until <= now) n_ready += 1;
+    }
+
+    /* hand out one window of unrequested blocks to each peer per round */
+    size_t end = self->size;
+    if (end - self->first > DOWNLOAD_MAX_AHEAD) end = self->first + DOWNLOAD_MAX_AHEAD;
+    uint8_t hashes[DOWNLOAD_WINDOW_SIZE * crypto_generichash_BYTES];
+    bool assigned = true;
+    while (assigned) {
+        assigned = false;
+        for (size_t i = 0; i < n_peers; i++) {
+            peer_state_t *state = list_get(self->peers, (self->next_peer + i) % n_peers);
+            if (state->backoff_until > now) continue;
+            if (state->n_windows == DOWNLOAD_MAX_WINDOWS_PER_PEER) continue;
+            size_t n = 0;
+            for (size_t j = self->first; j < end && n < DOWNLOAD_WINDOW_SIZE; j++) {
+                entry_t *entry = self->entries[j];
+                if (entry->peer != NULL || is_done(entry)) continue;
+                if (entry->missing_from == state->peer && n_ready > 1) continue;
+                entry->peer = state->peer;
+                entry->window = self->next_window;
+                memcpy(hashes + n * crypto_generichash_BYTES, entry->hash, crypto_generichash_BYTES);
+                n += 1;
+            }
+            if (n == 0) continue;
+            state->windows[state->n_windows].id = self->next_window++;
+            state->windows[state->n_windows].deadline = now + DOWNLOAD_TIMEOUT;
+            state->n_windows += 1;
+            self->request(state->peer, state->windows[state->n_windows - 1].id, hashes, n);
+            assigned = true;
+        }
+    }
+    if (n_peers > 0) self->next_peer = (self->next_peer + 1) % n_peers;
+}
+
+bool download_has(download_t *self, const uint8_t *hash) {
+    assert(self != NULL);
+    return entry_map_get(self->index, DIGEST(hash)) != NULL;
+}
+
+size_t download_size(download_t *self) {
+    assert(self != NULL);
+    return self->size - self->first;
+}
@@ -1,41 +1,78 @@
 #include <uv.h>
+#include <string.h>
+#include <sodium.h>
 
 #include <message.h>
 
+/*
+ * Messages are parsed in place at arbitrary offsets of the peer buffer, so
+ * header fields are accessed with memcpy rather than through aligned casts.
+ */
+static uint32_t read_u32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return ntohl(value);
+}
+
+static void write_u32(uint8_t *p, uint32_t value) {
+    value = htonl(value);
+    memcpy(p, &value, sizeof(value));
+}
+
 guid_t message_get_guid(uint8_t *message) {
     guid_t result;
     for (int j = 0; j < 4; j++) {
-        result.i[j] = ntohl(((uint32_t *) message)[2 + j]);
+        result.i[j] = read_u32(message + 4 * (2 + j));
     }
     return result;
 }
 
 void message_set_guid(uint8_t *message, guid_t guid) {
     for (int j = 0; j < 4; j++) {
-        ((uint32_t *) message)[2 + j] = htonl(guid.i[j]);
+        write_u32(message + 4 * (2 + j), guid.i[j]);
     }
 }
 
 uint32_t message_get_length(uint8_t *message) {
-    return ntohl(((uint32_t *) message)[1]);
+    return read_u32(message + 4);
 }
 
 void message_set_length(uint8_t *message, uint32_t length) {
-    ((uint32_t *) message)[1] = htonl(length);
+    write_u32(message + 4, length);
 }
 
 uint32_t message_get_magic(uint8_t *message) {
-    return ntohl(((uint32_t *) message)[0]);
+    return read_u32(message);
 }
 
 void message_set_magic(uint8_t *message, uint32_t magic) {
-    ((uint32_t *) message)[0] = htonl(magic);
+    write_u32(message, magic);
 }
 
 uint16_t message_get_type(uint8_t *message) {
-    return ntohs(*((uint16_t *)(message + 24)));
+    uint16_t type;
+    memcpy(&type, message + 24, sizeof(type));
+    return ntohs(type);
 }
 
 void message_set_type(uint8_t *message, uint16_t type) {
-    *((uint16_t *)(message + 24)) = htons(type);
+    type = htons(type);
+    memcpy(message + 24, &type, sizeof(type));
+}
+
+guid_t message_content_guid(uint16_t type, const uint8_t *payload, uint32_t length) {
+    uint8_t hash[sizeof(guid_t)];
+    uint16_t type_be = htons(type);
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, NULL, 0, sizeof(hash));
+    crypto_generichash_update(&state, (uint8_t *) &type_be, sizeof(type_be));
+    crypto_generichash_update(&state, payload, length);
+    crypto_generichash_final(&state, hash, sizeof(hash));
+
+    guid_t result;
+    for (int j = 0; j < 4; j++) {
+        result.i[j] = ntohl(((uint32_t *) hash)[j]);
+    }
+    if (guid_is_null(result)) result.i[3] = 1;
+    return result;
 }
@@ -1,6 +1,10 @@
 #include <uv.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include <network.h>
 #include <message.h>
@@ -8,93 +12,385 @@
 
 #include "util/buffer.h"
 #include "util/list.h"
+#include "util/bloom.h"
+#include "util/history.h"
+#include "util/mpsc_queue.h"
+#include "util/typed_map.h"
 
+/*
+ * Peers are spread round-robin over settings.network_threads I/O loops,
+ * each run by a thread of its own. A peer is only touched by the thread of
+ * its loop, which reads, frames, inflates, deduplicates and parses its
+ * messages and writes its send queues. Parsed messages are handed to the
+ * application thread, which runs the default loop and the event handlers,
+ * through a lock-free queue of events. The application thread and the I/O
+ * threads ask a loop to act on its peers through a lock-free queue of
+ * commands per loop. Each queue comes with a uv_async_t that wakes up its
+ * consumer. The state shared by all loops, the message history, the relay
+ * cache and the pending requests, is guarded by a single mutex.
+ */
+
+/*
+ * Each peer reads into a reference counted buffer. Complete messages are
+ * handled in place, and relayed messages are written to other peers straight
+ * out of the same buffer, each write holding a reference until it completes.
+ * Buffers of PEER_BUFFER_SIZE bytes are recycled through a free list per
+ * loop, which keeps at most BUFFER_POOL_SIZE idle buffers. A read always has
+ * at least READ_MIN_SPACE bytes of room at the end of the buffer.
+ */
+#define PEER_BUFFER_SIZE (1 << 16)
+#define READ_MIN_SPACE (1 << 12)
+#define BUFFER_POOL_SIZE 16
+
+/*
+ * Outbound messages wait in per-peer send queues, one for blocks and control
+ * messages and one for transaction traffic, and at most one vectored write of
+ * up to MAX_WRITE_FRAMES queued messages is in flight per peer. Blocks and
+ * control messages are always written first. Once more than
+ * SEND_QUEUE_HIGH_WATER bytes are queued for a peer, its transaction traffic
+ * is dropped until the queue drains below SEND_QUEUE_LOW_WATER; transactions
+ * are recovered later by the periodic pool synchronization of the
+ * application. A peer with more than
+ * SEND_QUEUE_MAX bytes queued is disconnected.
+ */
+#define SEND_QUEUE_HIGH_WATER (4 << 20)
+#define SEND_QUEUE_LOW_WATER (1 << 20)
+#define SEND_QUEUE_MAX (32 << 20)
+#define MAX_WRITE_FRAMES 64
+
+enum { PRIORITY_HIGH, PRIORITY_LOW, PRIORITY_COUNT };
+
+/*
+ * Broadcasts are relayed by announcement. A node that learns of a new
+ * message sends its guid in an EVENT_INV message to every peer that is not
+ * known to have it, and peers that have not seen it ask for it with
+ * EVENT_GETDATA. Each peer remembers the last PEER_KNOWN_INVENTORY guids it
+ * announced to us or that we announced or sent to it. Full messages are kept
+ * in a relay cache of at most RELAY_CACHE_SIZE messages and RELAY_CACHE_BYTES
+ * bytes to answer requests, and requested messages that are not in the cache
+ * anymore are listed in an EVENT_NOTFOUND reply. A message is requested from
+ * one announcer at a time. Each request remembers up to MAX_ANNOUNCERS
+ * announcers, and the next one is asked once the current one answers that it
+ * does not have the message, disconnects, or has not sent the message after
+ * GETDATA_TIMEOUT milliseconds. Every loop checks the requests for its peers
+ * every GETDATA_RETRY_INTERVAL milliseconds, and a request is dropped once
+ * all of its announcers have been asked. At most MAX_PENDING_REQUESTS
+ * messages are requested at a time.
+ */
+#define PEER_KNOWN_INVENTORY 2048
+#define RELAY_CACHE_SIZE 4096
+#define RELAY_CACHE_BYTES (64 << 20)
+#define GETDATA_TIMEOUT 5000
+#define GETDATA_RETRY_INTERVAL 1000
+#define MAX_ANNOUNCERS 8
+#define MAX_PENDING_REQUESTS 16384
+#define GUID_SIZE 16
+
+/*
+ * Payloads of at least COMPRESSION_THRESHOLD bytes are compressed for peers
+ * that support compression, if that makes them smaller. Each message is
+ * compressed on its own, so a relayed message is compressed once and the
+ * same compressed copy is sent to every peer. Compressed messages that
+ * inflate to more than the maximum message size are dropped.
+ */
+#define COMPRESSION_THRESHOLD 1024
+
+/*
+ * The shared_buffer_t struct is a reference counted buffer of capacity
+ * bytes, of which the first length bytes are filled. Buffers are shared
+ * between threads, so the reference count is atomic.
+ */
+struct shared_buffer_t {
+    uint8_t *base;
+    size_t length;
+    size_t capacity;
+    atomic_int ref_count;
+};
+
+/*
+ * The frame_t struct is a queued or cached message of the given type: an
+ * optional header followed by a range of a shared buffer, which the frame
+ * holds a reference to. The compressed frame holds the compressed message,
+ * once it has been compressed, unless compression does not make it smaller.
+ */
+typedef struct frame {
+    struct frame *next;
+    uint16_t type;
+    struct shared_buffer_t *buf;
+    size_t offset;
+    size_t length;
+    bool has_header;
+    uint8_t header[MESSAGE_HEADER_SIZE];
+    bool compress_tried;
+    struct frame *compressed;
+} frame_t;
+
+typedef struct frame_queue {
+    frame_t *head;
+    frame_t *tail;
+} frame_queue_t;
+
+/*
+ * The request_t struct is a requested message and the peers that announced
+ * it, in the order they are asked. If asked is true, the first announcer was
+ * asked for the message at the given time, in milliseconds of request_clock.
+ */
+typedef struct request {
+    uint64_t time;
+    bool asked;
+    struct peer *announcers[MAX_ANNOUNCERS];
+    size_t n_announcers;
+} request_t;
+
+TYPED_MAP(relay_cache, guid_t, frame_t*, guid_hash, guid_equal)
+TYPED_MAP(request_map, guid_t, request_t*, guid_hash, guid_equal)
+
+/*
+ * Peers are indexed by their IPv4 address and port packed into a single
+ * key. Fibonacci hashing in the typed map spreads the key by itself.
+ */
+static inline size_t peer_key_hash(const uint64_t *key) {
+    return (size_t) *key;
+}
+
+static inline bool peer_key_equal(const uint64_t *a, const uint64_t *b) {
+    return *a == *b;
+}
+
+static uint64_t peer_key(uint32_t ip, int port) {
+    return (uint64_t) ip << 32 | (uint32_t) port;
+}
+
+TYPED_MAP(peer_index, uint64_t, peer_t*, peer_key_hash, peer_key_equal)
+
+/*
+ * The io_loop_t struct is an event loop run by an I/O thread, with the
+ * peers of the loop and the idle buffers recycled by them.
+ */
+typedef struct io_loop {
+    struct network *network;
+    uv_loop_t loop;
+    uv_thread_t thread;
+    uv_async_t wakeup;
+    mpsc_queue_t *commands;
+    list_t *peers;
+    bool stopping;
+    struct shared_buffer_t *free_buffers[BUFFER_POOL_SIZE];
+    size_t n_free_buffers;
+} io_loop_t;
+
+/*
+ * The peers list, the peer index and the handlers belong to the application
+ * thread, and next_loop is only used by it. The peer index maps the address
+ * and port of each peer in the peers list to the peer. A peer whose address
+ * and port are already indexed for another peer, which only happens until
+ * the handshake of the duplicate is rejected, is not indexed. The fields
+ * from the message history on are guarded by the lock.
+ */
 typedef struct network {
     uv_tcp_t server;
     event_handler_t handlers[EVENT_COUNT];
     list_t *peers;
-    list_t *message_history
+    peer_index_t *peer_index;
+    io_loop_t *loops;
+    size_t n_loops;
+    size_t next_loop;
+    uv_async_t wakeup;
+    mpsc_queue_t *events;
+    uv_barrier_t stop_barrier;
+    uv_mutex_t lock;
+    bloom_t *message_history;
+    relay_cache_t *relay_cache;
+    guid_t relay_order[RELAY_CACHE_SIZE];
+    size_t relay_first;
+    size_t relay_count;
+    size_t relay_bytes;
+    request_map_t *requests;
 } network_t;
 
+/*
+ * The fields that the application thread sets after the handshake are
+ * atomic, since the I/O thread of the peer reads them to send messages.
+ * The peer knows its position in the peers list of the network and in the
+ * peers list of its loop, so that it is removed from either in constant
+ * time.
+ */
 typedef struct peer {
     network_t *server;
+    io_loop_t *loop;
     uv_tcp_t *socket;
     char addr[16];
-    int port;
-    dynamic_buffer_t buf;
+    uint32_t ip;
+    atomic_int port;
+    size_t index;
+    size_t loop_index;
+    struct shared_buffer_t *buf;
+    size_t head;
+    frame_queue_t queues[PRIORITY_COUNT];
+    size_t queued_bytes;
+    _Atomic uint32_t features;
+    _Atomic uint32_t max_message_size;
+    bool writing;
+    bool congested;
+    bool closing;
+    history_t *known;
     void *data;
     void (*free_data)();
 } peer_t;
 
+typedef struct connect_ctx {
+    void *data;
+    void (*free_data)(void*);
+    network_t *server;
+    struct sockaddr_in peer_addr;
+} connect_ctx_t;
 
-#define MESSAGE_HISTORY_SIZE 1024
+/*
+ * Commands ask an I/O loop to send a frame to one of its peers, to
+ * disconnect or free one of its peers, to connect to or accept a new peer,
+ * to announce a cached message to its peers, or to stop.
+ */
+enum {
+    COMMAND_SEND,
+    COMMAND_DISCONNECT,
+    COMMAND_RELEASE,
+    COMMAND_CONNECT,
+    COMMAND_ACCEPT,
+    COMMAND_ANNOUNCE,
+    COMMAND_STOP,
+};
 
-static int message_history_compare(guid_t *a, guid_t *b) {
-    return guid_compare(*a, *b);
-}
+typedef struct command {
+    int kind;
+    peer_t *peer;
+    frame_t *frame;
+    guid_t guid;
+    uv_os_sock_t socket;
+    connect_ctx_t *connect;
+} command_t;
 
-static void message_history_add(network_t *self, guid_t guid) {
-    guid_t *data = malloc(sizeof(guid_t));
-    memcpy(data, &guid, sizeof(guid_t));
-    if (list_size(self->message_history) >= MESSAGE_HISTORY_SIZE) {
-        guid_t *old = list_remove(self->message_history, 0);
-        free(old);
-    }
-    list_add(self->message_history, data);
+/*
+ * Events tell the application thread that a peer has connected, sent a
+ * message, or disconnected, or that a connection could not be established.
+ * A message event holds the parsed message and a reference to the buffer
+ * the message is parsed from.
+ */
+enum {
+    IO_CONNECTED,
+    IO_MESSAGE,
+    IO_DISCONNECTED,
+    IO_CONNECT_FAILED,
+};
+
+typedef struct io_event {
+    int kind;
+    peer_t *peer;
+    uint16_t type;
+    tuple_t *tuple;
+    struct shared_buffer_t *buf;
+    void *data;
+    void (*free_data)(void*);
+} io_event_t;
+
+static command_t* command_create(int kind) {
+    command_t *command = calloc(1, sizeof(command_t));
+    assert(command != NULL);
+    command->kind = kind;
+    return command;
 }
 
-static int message_history_has(network_t *self, guid_t guid) {
-    return list_find(self->message_history, &guid, message_history_compare) != list_size(self->message_history);
+static void post_command(io_loop_t *loop, command_t *command) {
+    mpsc_queue_push(loop->commands, command);
+    uv_async_send(&loop->wakeup);
 }
 
-network_t* network_create() {
-    network_t *res = calloc(1, sizeof(network_t));
-    assert (res != NULL);
-    res->peers = list_create(1);
-    uv_tcp_init(uv_default_loop(), &res->server);
-    res->server.data = res;
-    res->message_history = list_create(MESSAGE_HISTORY_SIZE);
-    return res;
+static io_event_t* io_event_create(int kind, peer_t *peer) {
+    io_event_t *event = calloc(1, sizeof(io_event_t));
+    assert(event != NULL);
+    event->kind = kind;
+    event->peer = peer;
+    return event;
 }
 
-void network_destroy(network_t *self) {
-    list_destroy(self->message_history, free);
-    free(self);
+static void post_event(network_t *self, io_event_t *event) {
+    mpsc_queue_push(self->events, event);
+    uv_async_send(&self->wakeup);
 }
 
+/*
+ * Return the loop of the next new peer.
+ */
+static io_loop_t* next_loop(network_t *self) {
+    io_loop_t *loop = &self->loops[self->next_loop];
+    self->next_loop = (self->next_loop + 1) % self->n_loops;
+    return loop;
+}
 
 /*
- * The shared_buffer_t struct is a reference
- * 
+ * The message history remembers the guids of recently seen broadcasts in a
+ * rotating Bloom filter, so that at least the last seen_filter_capacity
+ * messages are never handled or relayed twice. A false positive drops a new
+ * message at this node only; other peers still relay it. The caller holds
+ * the lock.
  */
-struct shared_buffer_t {
-    uv_buf_t data;
-    int ref_count;
-};
+static void message_history_add(network_t *self, guid_t guid) {
+    bloom_add(self->message_history, (uint8_t *) guid.i, sizeof(guid.i));
+}
+
+static int message_history_has(network_t *self, guid_t guid) {
+    return bloom_has(self->message_history, (uint8_t *) guid.i, sizeof(guid.i));
+}
 
-static struct shared_buffer_t* shared_buffer_create(uint8_t *data, int len) {
-    struct shared_buffer_t *buf = (struct shared_buffer_t*) calloc(1, sizeof(struct shared_buffer_t));
-    uint8_t *base = malloc(len);
-    memcpy(base, data, len);
-    buf->data = uv_buf_init((char *) base, len);
+/*
+ * Return an empty shared buffer with a reference count of one and at least
+ * the given capacity, reusing an idle buffer of the loop if possible. The
+ * application thread passes a NULL loop.
+ */
+static struct shared_buffer_t* shared_buffer_create(io_loop_t *loop, size_t capacity) {
+    struct shared_buffer_t *buf;
+    if (loop != NULL && capacity <= PEER_BUFFER_SIZE && loop->n_free_buffers > 0) {
+        loop->n_free_buffers -= 1;
+        buf = loop->free_buffers[loop->n_free_buffers];
+    } else {
+        buf = malloc(sizeof(struct shared_buffer_t));
+        assert(buf != NULL);
+        buf->capacity = capacity;
+        buf->base = malloc(capacity);
+        assert(buf->base != NULL);
+    }
+    buf->length = 0;
+    atomic_init(&buf->ref_count, 1);
     return buf;
 }
 
 static void shared_buffer_retain(struct shared_buffer_t *buf) {
-   buf->ref_count += 1;
+   atomic_fetch_add(&buf->ref_count, 1);
 }
 
-static void shared_buffer_release(struct shared_buffer_t *buf) {
-    buf->ref_count -= 1;
-    if (buf->ref_count == 0) {
-        free(buf->data.base);
+/*
+ * Drop a reference to the buffer, and recycle the buffer in the idle
+ * buffers of the loop, or free it, once it was the last one. The
+ * application thread passes a NULL loop.
+ */
+static void shared_buffer_release(io_loop_t *loop, struct shared_buffer_t *buf) {
+    if (atomic_fetch_sub(&buf->ref_count, 1) > 1) return;
+    if (loop != NULL && buf->capacity == PEER_BUFFER_SIZE && loop->n_free_buffers < BUFFER_POOL_SIZE) {
+        loop->free_buffers[loop->n_free_buffers] = buf;
+        loop->n_free_buffers += 1;
+    } else {
+        free(buf->base);
         free(buf);
     }
 }
 
+/*
+ * A write sends a chain of frames taken from the send queues of a peer.
+ */
 struct write_context_t {
   uv_write_t req;
-  struct shared_buffer_t *buf;
+  peer_t *peer;
+  frame_t *frames;
+  size_t length;
 };
 
 
@@ -106,8 +402,42 @@ int peer_get_port(peer_t *peer) {
     return peer->port;
 }
 
+/*
+ * Add the peer to the peer index under its current address and port,
+ * unless another peer is indexed under them.
+ */
+static void index_peer(network_t *self, peer_t *peer) {
+    uint64_t key = peer_key(peer->ip, peer->port);
+    bool inserted;
+    peer_t **slot = peer_index_get_or_insert(self->peer_index, &key, &inserted);
+    if (inserted) *slot = peer;
+}
+
+static void unindex_peer(network_t *self, peer_t *peer) {
+    uint64_t key = peer_key(peer->ip, peer->port);
+    if (peer_index_get(self->peer_index, &key) == peer) peer_index_remove(self->peer_index, &key);
+}
+
 void peer_set_port(peer_t *peer, int port) {
+    unindex_peer(peer->server, peer);
     peer->port = port;
+    index_peer(peer->server, peer);
+}
+
+uint32_t peer_get_features(peer_t *peer) {
+    return peer->features;
+}
+
+void peer_set_features(peer_t *peer, uint32_t features) {
+    peer->features = features;
+}
+
+uint32_t peer_get_max_message_size(peer_t *peer) {
+    return peer->max_message_size;
+}
+
+void peer_set_max_message_size(peer_t *peer, uint32_t size) {
+    peer->max_message_size = size;
 }
 
 size_t network_peer_count(network_t *self) {
@@ -119,225 +449,984 @@ peer_t *network_get_peer(network_t *self, size_t i) {
 }
 
 int network_has_peer(network_t *self, char *addr, int port) {
-    for (size_t i = 0; i < list_size(self->peers); i++) {
-        peer_t *peer = list_get(self->peers, i);
-        char *peer_addr = peer_get_addr(peer);
-        int peer_port = peer_get_port(peer);
-        if (strcmp(addr, peer_addr) == 0 && port == peer_port) return 1;
-    }
-    return 0;
+    struct in_addr ip;
+    if (uv_inet_pton(AF_INET, addr, &ip) != 0) return 0;
+    uint64_t key = peer_key(ip.s_addr, port);
+    return peer_index_get(self->peer_index, &key) != NULL;
+}
+
+static size_t frame_size(const frame_t *frame) {
+    return (frame->has_header ? MESSAGE_HEADER_SIZE : 0) + frame->length;
+}
+
+static void frame_destroy(io_loop_t *loop, frame_t *frame) {
+    if (frame->compressed != NULL) frame_destroy(loop, frame->compressed);
+    shared_buffer_release(loop, frame->buf);
+    free(frame);
+}
+
+/*
+ * Return the send queue of a message type. Transactions and their
+ * announcements can be dropped and recovered by the next periodic pool
+ * synchronization. Everything else cannot, including the pool
+ * synchronization messages themselves, since a dropped one ends the
+ * exchange.
+ */
+static int message_priority(uint16_t type) {
+    return type == EVENT_TRANSACTION ? PRIORITY_LOW : PRIORITY_HIGH;
 }
 
+static void flush_peer(peer_t *peer);
+static void close_peer(peer_t *peer);
+
 /*
- * Once write is complete, free all memory associated with the write context.
- * 
- * Since each write context contains both a uv_write_t struct and a reference
- * counted shared buffer, we should decrement the reference count of the
- * buffer and only free it if there is only one 
+ * Once write is complete, free all memory associated with the write context
+ * and start writing the next frames queued for the peer.
+ *
+ * Since each frame holds a reference to a shared buffer, we should decrement
+ * the reference count of the buffer, which frees or recycles it once no other
+ * write or peer uses it.
  */
+static void finish_write(struct write_context_t *req) {
+    peer_t *peer = req->peer;
+    while (req->frames != NULL) {
+        frame_t *next = req->frames->next;
+        frame_destroy(peer->loop, req->frames);
+        req->frames = next;
+    }
+    peer->queued_bytes -= req->length;
+    peer->writing = false;
+    if (peer->queued_bytes <= SEND_QUEUE_LOW_WATER) peer->congested = false;
+    free(req);
+}
+
 static void on_write(uv_write_t* wreq, int status) {
-    if (status) fprintf(stderr, "error: writing data: %s\n", uv_err_name(status));
+    if (status && status != UV_ECANCELED) fprintf(stderr, "error: writing data: %s\n", uv_err_name(status));
     struct write_context_t *req = (struct write_context_t *) wreq;
-    shared_buffer_release(req->buf);
-    free(req);
+    peer_t *peer = req->peer;
+    finish_write(req);
+    flush_peer(peer);
 }
 
-/**
- * Broadcast the provided message to all peers by writing it to each peer one
- * at a time.
- * 
- * For efficiency, we create a reference counted buffer containing the message
- * to share among all write requests. This allows us to keep just a single copy
- * of the message, rather than a different copy for each peer.
- * 
- * @param message the message to send
- * @param len the length of the message in bytes
- */
-static void broadcast_message(network_t *self, uint8_t *message, int len) {
-    struct shared_buffer_t *buf = shared_buffer_create(message, len);
-    shared_buffer_retain(buf);
-    for (size_t i = 0; i < list_size(self->peers); i++) {
-        peer_t *peer = list_get(self->peers, i);
-        struct write_context_t *req = (struct write_context_t*) malloc(sizeof(struct write_context_t));
-        req->buf = buf;
-        shared_buffer_retain(buf);
-        uv_write((uv_write_t*) req, (uv_stream_t*) peer->socket, &(req->buf->data), 1, on_write);
+/*
+ * Write up to MAX_WRITE_FRAMES queued frames to the peer in a single
+ * vectored write, taking high priority frames first, unless a write is
+ * already in flight.
+ */
+static void flush_peer(peer_t *peer) {
+    if (peer->writing || peer->closing) return;
+    uv_buf_t bufs[2 * MAX_WRITE_FRAMES];
+    size_t n_bufs = 0;
+    size_t n_frames = 0;
+    struct write_context_t *req = NULL;
+    frame_t **last = NULL;
+
+    for (int priority = 0; priority < PRIORITY_COUNT; priority++) {
+        frame_queue_t *queue = &peer->queues[priority];
+        while (queue->head != NULL && n_frames < MAX_WRITE_FRAMES) {
+            frame_t *frame = queue->head;
+            queue->head = frame->next;
+            if (queue->head == NULL) queue->tail = NULL;
+            frame->next = NULL;
+
+            if (req == NULL) {
+                req = malloc(sizeof(struct write_context_t));
+                assert(req != NULL);
+                req->peer = peer;
+                req->length = 0;
+                last = &req->frames;
+            }
+            *last = frame;
+            last = &frame->next;
+            req->length += frame_size(frame);
+            n_frames += 1;
+
+            if (frame->has_header) {
+                bufs[n_bufs++] = uv_buf_init((char *) frame->header, MESSAGE_HEADER_SIZE);
+            }
+            bufs[n_bufs++] = uv_buf_init((char *) frame->buf->base + frame->offset, frame->length);
+        }
+    }
+    if (req == NULL) return;
+
+    peer->writing = true;
+    int err = uv_write((uv_write_t*) req, (uv_stream_t*) peer->socket, bufs, n_bufs, on_write);
+    if (err != 0) {
+        finish_write(req);
+        close_peer(peer);
     }
-    shared_buffer_release(buf);
 }
 
-static void send_message(uint8_t *message, int len, peer_t *peer) {
-    struct shared_buffer_t *buf = shared_buffer_create(message, len);
+static frame_t* frame_create(uint16_t type, const uint8_t *header, struct shared_buffer_t *buf, size_t offset, size_t len) {
+    frame_t *frame = malloc(sizeof(frame_t));
+    assert(frame != NULL);
+    frame->next = NULL;
+    frame->type = type;
+    frame->buf = buf;
+    frame->offset = offset;
+    frame->length = len;
+    frame->has_header = header != NULL;
+    if (header != NULL) memcpy(frame->header, header, MESSAGE_HEADER_SIZE);
+    frame->compress_tried = false;
+    frame->compressed = NULL;
     shared_buffer_retain(buf);
-    struct write_context_t *req = (struct write_context_t*) malloc(sizeof(struct write_context_t));
-    req->buf = buf;
-    uv_write((uv_write_t*) req, (uv_stream_t*) peer->socket, &(req->buf->data), 1, on_write);
+    return frame;
+}
+
+/*
+ * Return a new frame of the same message as the frame, and of the same
+ * compressed message if there is one. Cached frames are copied before they
+ * are used outside of the lock, since another thread may evict them.
+ */
+static frame_t* frame_copy(const frame_t *frame) {
+    frame_t *copy = frame_create(frame->type, frame->has_header ? frame->header : NULL,
+        frame->buf, frame->offset, frame->length);
+    copy->compress_tried = frame->compress_tried;
+    if (frame->compressed != NULL) copy->compressed = frame_copy(frame->compressed);
+    return copy;
+}
+
+/*
+ * Queue the frame in the send queue of the given priority of the peer, and
+ * start writing if the peer is idle. Takes ownership of the frame, which
+ * holds a reference to its buffer until it is written. Transaction traffic
+ * is dropped while the peer is congested, and a peer that falls too far
+ * behind is disconnected.
+ */
+static void enqueue_frame(peer_t *peer, int priority, frame_t *frame) {
+    if (peer->queued_bytes >= SEND_QUEUE_HIGH_WATER) peer->congested = true;
+    if (peer->closing || (priority == PRIORITY_LOW && peer->congested)) {
+        frame_destroy(peer->loop, frame);
+        return;
+    }
+
+    frame_queue_t *queue = &peer->queues[priority];
+    if (queue->tail != NULL) queue->tail->next = frame;
+    else queue->head = frame;
+    queue->tail = frame;
+    peer->queued_bytes += frame_size(frame);
+
+    if (peer->queued_bytes > SEND_QUEUE_MAX) {
+        printf("error: disconnecting slow peer %s:%d\n", peer->addr, peer_get_port(peer));
+        close_peer(peer);
+        return;
+    }
+    flush_peer(peer);
+}
+
+/*
+ * Wrap the heap allocated payload of a message being sent in a shared buffer
+ * that frees it once all writes are done, and take it from the caller.
+ */
+static struct shared_buffer_t* shared_buffer_take(buffer_t *buffer) {
+    struct shared_buffer_t *buf = malloc(sizeof(struct shared_buffer_t));
+    assert(buf != NULL);
+    buf->base = buffer->data;
+    buf->length = buffer->length;
+    buf->capacity = buffer->length;
+    atomic_init(&buf->ref_count, 1);
+    buffer->data = NULL;
+    buffer->length = 0;
+    return buf;
+}
+
+/*
+ * Return an empty shared buffer of exactly the given capacity, which is
+ * never recycled through the free list.
+ */
+static struct shared_buffer_t* shared_buffer_alloc(size_t capacity) {
+    struct shared_buffer_t *buf = malloc(sizeof(struct shared_buffer_t));
+    assert(buf != NULL);
+    buf->base = malloc(capacity);
+    assert(buf->base != NULL);
+    buf->length = 0;
+    buf->capacity = capacity;
+    atomic_init(&buf->ref_count, 1);
+    return buf;
+}
+
+/*
+ * Copy len bytes into a new shared buffer of exactly that size.
+ */
+static struct shared_buffer_t* shared_buffer_copy(const uint8_t *data, size_t len) {
+    struct shared_buffer_t *buf = shared_buffer_alloc(len);
+    memcpy(buf->base, data, len);
+    buf->length = len;
+    return buf;
+}
+
+static void write_header(uint8_t *header, uint32_t type, guid_t guid, uint32_t length) {
+    message_set_magic(header, MESSAGE_MAGIC_NUMBER);
+    message_set_length(header, length);
+    message_set_guid(header, guid);
+    message_set_type(header, type);
+}
+
+/*
+ * Return a new frame holding the message of the frame with its payload
+ * compressed, or NULL if the payload is too small or does not shrink.
+ */
+static frame_t* frame_compress(const frame_t *frame) {
+    const uint8_t *message = frame->buf->base + frame->offset;
+    const uint8_t *header = frame->has_header ? frame->header : message;
+    const uint8_t *payload = frame->has_header ? message : message + MESSAGE_HEADER_SIZE;
+    size_t length = message_get_length((uint8_t *) header);
+    if (length < COMPRESSION_THRESHOLD) return NULL;
+
+    uLongf compressed_length = compressBound(length);
+    size_t capacity = MESSAGE_HEADER_SIZE + sizeof(uint32_t) + compressed_length;
+    struct shared_buffer_t *buf = shared_buffer_alloc(capacity);
+    uint8_t *data = buf->base + MESSAGE_HEADER_SIZE + sizeof(uint32_t);
+    if (compress2(data, &compressed_length, payload, length, Z_BEST_SPEED) != Z_OK
+            || sizeof(uint32_t) + compressed_length >= length) {
+        shared_buffer_release(NULL, buf);
+        return NULL;
+    }
+
+    uint32_t original_length = htonl(length);
+    memcpy(buf->base, header, MESSAGE_HEADER_SIZE);
+    memcpy(buf->base + MESSAGE_HEADER_SIZE, &original_length, sizeof(uint32_t));
+    message_set_type(buf->base, frame->type | MESSAGE_COMPRESSED);
+    message_set_length(buf->base, sizeof(uint32_t) + compressed_length);
+    buf->length = MESSAGE_HEADER_SIZE + sizeof(uint32_t) + compressed_length;
+    buf->capacity = buf->length;
+    buf->base = realloc(buf->base, buf->capacity);
+    assert(buf->base != NULL);
+    frame_t *res = frame_create(frame->type, NULL, buf, 0, buf->length);
+    shared_buffer_release(NULL, buf);
+    return res;
+}
+
+/*
+ * Compress the message of the frame unless that has been tried before.
+ */
+static void frame_compress_once(frame_t *frame) {
+    if (frame->compress_tried) return;
+    frame->compressed = frame_compress(frame);
+    frame->compress_tried = true;
+}
+
+/*
+ * Return a new shared buffer holding the original message of a compressed
+ * message of len bytes, or NULL if the message is malformed or too large.
+ */
+static struct shared_buffer_t* inflate_message(const uint8_t *message, size_t len) {
+    if (len < MESSAGE_HEADER_SIZE + sizeof(uint32_t)) return NULL;
+    uint32_t length;
+    memcpy(&length, message + MESSAGE_HEADER_SIZE, sizeof(uint32_t));
+    length = ntohl(length);
+    if (length > (uint32_t) settings.max_message_size) return NULL;
+
+    struct shared_buffer_t *buf = shared_buffer_alloc(MESSAGE_HEADER_SIZE + length);
+    uLongf inflated_length = length;
+    const uint8_t *data = message + MESSAGE_HEADER_SIZE + sizeof(uint32_t);
+    if (uncompress(buf->base + MESSAGE_HEADER_SIZE, &inflated_length, data, len - MESSAGE_HEADER_SIZE - sizeof(uint32_t)) != Z_OK
+            || inflated_length != length) {
+        shared_buffer_release(NULL, buf);
+        return NULL;
+    }
+
+    memcpy(buf->base, message, MESSAGE_HEADER_SIZE);
+    message_set_type(buf->base, message_get_type((uint8_t *) message) & ~MESSAGE_COMPRESSED);
+    message_set_length(buf->base, length);
+    buf->length = MESSAGE_HEADER_SIZE + length;
+    return buf;
+}
+
+/*
+ * Queue the message of the frame for the peer, compressed if the peer
+ * supports compression and compression makes it smaller. The compressed
+ * message is kept with the frame, so a cached message is only compressed
+ * once however many peers request it. Messages larger than the peer
+ * accepts are dropped.
+ */
+static void enqueue_message(peer_t *peer, frame_t *frame) {
+    size_t length = frame_size(frame) - MESSAGE_HEADER_SIZE;
+    if (length > peer->max_message_size) {
+        printf("error: message of %zu bytes too large for peer %s:%d\n", length, peer->addr, peer_get_port(peer));
+        return;
+    }
+    if (peer->features & NETWORK_FEATURE_COMPRESSION) {
+        frame_compress_once(frame);
+        if (frame->compressed != NULL) frame = frame->compressed;
+    }
+    enqueue_frame(peer, message_priority(frame->type), frame_copy(frame));
+}
+
+static void write_guid(dynamic_buffer_t *buf, guid_t guid) {
+    for (int j = 0; j < 4; j++) {
+        uint32_t word = htonl(guid.i[j]);
+        dynamic_buffer_write(&word, sizeof(word), buf);
+    }
+}
+
+static guid_t read_guid(const uint8_t *data) {
+    guid_t guid;
+    for (int j = 0; j < 4; j++) {
+        uint32_t word;
+        memcpy(&word, data + 4 * j, sizeof(word));
+        guid.i[j] = ntohl(word);
+    }
+    return guid;
+}
+
+/*
+ * Queue a message of the form (guids: binary) listing the guids for the
+ * peer in the send queue of the given priority.
+ */
+static void send_inventory(peer_t *peer, uint16_t type, int priority, dynamic_buffer_t *guids) {
+    dynamic_buffer_t payload = dynamic_buffer_create(guids->length + 16);
+    tuple_write_start(&payload);
+    tuple_write_binary(&payload, guids->length, guids->data);
+    tuple_write_end(&payload);
+
+    uint8_t header[MESSAGE_HEADER_SIZE];
+    write_header(header, type, guid_null(), payload.length);
+    struct shared_buffer_t *buf = shared_buffer_take((buffer_t *) &payload);
+    enqueue_frame(peer, priority, frame_create(type, header, buf, 0, buf->length));
+    shared_buffer_release(peer->loop, buf);
+}
+
+/*
+ * Return the guids of a valid EVENT_INV, EVENT_GETDATA or EVENT_NOTFOUND
+ * message, or a null buffer if the message is malformed.
+ */
+static buffer_t get_inventory(tuple_t *msg) {
+    buffer_t none = {0, NULL};
+    if (msg == NULL || tuple_size(msg) != 1 || tuple_get_type(msg, 0) != TUPLE_BINARY) return none;
+    buffer_t guids = tuple_get_binary(msg, 0);
+    if (guids.length == 0 || guids.length % GUID_SIZE != 0) return none;
+    return guids;
+}
+
+/*
+ * Keep the message in the relay cache, evicting the oldest messages while
+ * the cache is over its size limits. Takes ownership of the frame. The
+ * caller holds the lock, and passes its loop, or NULL on the application
+ * thread.
+ */
+static void cache_message(network_t *self, io_loop_t *loop, guid_t guid, frame_t *frame) {
+    if (relay_cache_get(self->relay_cache, &guid) != NULL) {
+        frame_destroy(loop, frame);
+        return;
+    }
+    while (self->relay_count == RELAY_CACHE_SIZE
+            || (self->relay_count > 0 && self->relay_bytes + frame_size(frame) > RELAY_CACHE_BYTES)) {
+        guid_t oldest = self->relay_order[self->relay_first];
+        self->relay_first = (self->relay_first + 1) % RELAY_CACHE_SIZE;
+        self->relay_count -= 1;
+        frame_t *evicted = relay_cache_remove(self->relay_cache, &oldest);
+        self->relay_bytes -= frame_size(evicted);
+        frame_destroy(loop, evicted);
+    }
+    relay_cache_set(self->relay_cache, &guid, frame);
+    self->relay_order[(self->relay_first + self->relay_count) % RELAY_CACHE_SIZE] = guid;
+    self->relay_count += 1;
+    self->relay_bytes += frame_size(frame);
+}
+
+/*
+ * Return a copy of the cached message with the guid, or NULL if it is not
+ * in the relay cache anymore.
+ */
+static frame_t* get_cached_message(network_t *self, guid_t guid) {
+    uv_mutex_lock(&self->lock);
+    frame_t *frame = relay_cache_get(self->relay_cache, &guid);
+    if (frame != NULL) frame = frame_copy(frame);
+    uv_mutex_unlock(&self->lock);
+    return frame;
+}
+
+/*
+ * Return true if broadcasts of the given type are relayed to the peer.
+ * Compact blocks are only relayed to peers that support them, and full
+ * blocks only to peers that do not, since the others get compact blocks.
+ */
+static bool peer_accepts(const peer_t *peer, uint16_t type) {
+    switch (type) {
+        case EVENT_COMPACT_BLOCK:
+            return (peer->features & NETWORK_FEATURE_COMPACT_BLOCKS) != 0;
+        case EVENT_BLOCK:
+            return (peer->features & NETWORK_FEATURE_COMPACT_BLOCKS) == 0;
+        default:
+            return true;
+    }
+}
+
+/*
+ * Announce the cached message to every peer of the loop that is not known
+ * to have it, or send the whole message to peers that do not support
+ * announcements.
+ */
+static void announce_message(io_loop_t *loop, guid_t guid) {
+    frame_t *frame = get_cached_message(loop->network, guid);
+    if (frame == NULL) return;
+    dynamic_buffer_t guids = dynamic_buffer_create(GUID_SIZE + 1);
+    write_guid(&guids, guid);
+    for (size_t i = 0; i < list_size(loop->peers); i++) {
+        peer_t *peer = list_get(loop->peers, i);
+        if (!peer_accepts(peer, frame->type)) continue;
+        if (!history_add(peer->known, guid)) continue;
+        if (peer->features & NETWORK_FEATURE_INV_RELAY) {
+            send_inventory(peer, EVENT_INV, message_priority(frame->type), &guids);
+        } else {
+            enqueue_message(peer, frame);
+        }
+    }
+    dynamic_buffer_destroy(guids);
+    frame_destroy(loop, frame);
+}
+
+/*
+ * Announce the cached message on every loop, right away on the loop of the
+ * calling I/O thread, if any, and through a command on the others.
+ */
+static void announce_everywhere(network_t *self, io_loop_t *current, guid_t guid) {
+    for (size_t i = 0; i < self->n_loops; i++) {
+        io_loop_t *loop = &self->loops[i];
+        if (loop == current) {
+            announce_message(loop, guid);
+        } else {
+            command_t *command = command_create(COMMAND_ANNOUNCE);
+            command->guid = guid;
+            post_command(loop, command);
+        }
+    }
+}
+
+/*
+ * Remove the ith announcer of the request. If it was the announcer being
+ * asked, the next announcer is asked at the next retry of its loop.
+ */
+static void remove_announcer(request_t *request, size_t i) {
+    if (i == 0) request->asked = false;
+    request->n_announcers -= 1;
+    memmove(request->announcers + i, request->announcers + i + 1,
+        (request->n_announcers - i) * sizeof(peer_t*));
+}
+
+/*
+ * Forget the peer as an announcer of every pending request, and drop the
+ * requests that no other peer announced. The caller holds the lock.
+ */
+static void forget_announcer(network_t *self, peer_t *peer) {
+    size_t n_dropped = 0;
+    guid_t *dropped = malloc((request_map_size(self->requests) + 1) * sizeof(guid_t));
+    assert(dropped != NULL);
+    size_t cursor = 0;
+    const guid_t *guid;
+    request_t *request;
+    while (request_map_next(self->requests, &cursor, &guid, &request)) {
+        for (size_t i = 0; i < request->n_announcers; i++) {
+            if (request->announcers[i] != peer) continue;
+            remove_announcer(request, i);
+            break;
+        }
+        if (request->n_announcers == 0) dropped[n_dropped++] = *guid;
+    }
+    for (size_t i = 0; i < n_dropped; i++) {
+        free(request_map_remove(self->requests, &dropped[i]));
+    }
+    free(dropped);
+}
+
+/*
+ * Return the time in milliseconds on the clock of the requests. Requests are
+ * stamped and checked by different loops, whose cached uv_now times differ,
+ * so they use the monotonic clock instead.
+ */
+static uint64_t request_clock(void) {
+    return uv_hrtime() / 1000000;
+}
+
+/*
+ * Ask the next announcer of each request whose current announcer has not
+ * sent the message in time, if that announcer is a peer of the loop, and
+ * drop the requests whose announcers have all been asked.
+ */
+static void retry_requests(uv_timer_t *timer) {
+    io_loop_t *loop = timer->data;
+    network_t *self = loop->network;
+    uint64_t now = request_clock();
+
+    uv_mutex_lock(&self->lock);
+    size_t n_requests = request_map_size(self->requests);
+    size_t n_dropped = 0;
+    size_t n_retried = 0;
+    guid_t *dropped = malloc((n_requests + 1) * sizeof(guid_t));
+    guid_t *retried = malloc((n_requests + 1) * sizeof(guid_t));
+    peer_t **peers = malloc((n_requests + 1) * sizeof(peer_t*));
+    assert(dropped != NULL && retried != NULL && peers != NULL);
+    size_t cursor = 0;
+    const guid_t *guid;
+    request_t *request;
+    while (request_map_next(self->requests, &cursor, &guid, &request)) {
+        if (request->asked && now - request->time < GETDATA_TIMEOUT) continue;
+        if (request->asked) remove_announcer(request, 0);
+        if (request->n_announcers == 0) {
+            dropped[n_dropped++] = *guid;
+        } else if (request->announcers[0]->loop == loop) {
+            request->asked = true;
+            request->time = now;
+            retried[n_retried] = *guid;
+            peers[n_retried++] = request->announcers[0];
+        }
+    }
+    for (size_t i = 0; i < n_dropped; i++) {
+        free(request_map_remove(self->requests, &dropped[i]));
+    }
+    uv_mutex_unlock(&self->lock);
+
+    for (size_t i = 0; i < n_retried; i++) {
+        dynamic_buffer_t wanted = dynamic_buffer_create(GUID_SIZE + 1);
+        write_guid(&wanted, retried[i]);
+        send_inventory(peers[i], EVENT_GETDATA, PRIORITY_HIGH, &wanted);
+        dynamic_buffer_destroy(wanted);
+    }
+    free(dropped);
+    free(retried);
+    free(peers);
+}
+
+/*
+ * Request the announced messages that we have neither seen nor requested
+ * yet, and remember the peer as another announcer of the messages that are
+ * already requested from another peer.
+ */
+static void on_inventory(peer_t *peer, tuple_t *msg) {
+    network_t *self = peer->server;
+    buffer_t guids = get_inventory(msg);
+    if (guids.data == NULL) return;
+
+    uint64_t now = request_clock();
+    dynamic_buffer_t wanted = dynamic_buffer_create(guids.length + 1);
+    uv_mutex_lock(&self->lock);
+    for (size_t i = 0; i < guids.length; i += GUID_SIZE) {
+        guid_t guid = read_guid(guids.data + i);
+        history_add(peer->known, guid);
+        if (message_history_has(self, guid)) continue;
+
+        request_t *request = request_map_get(self->requests, &guid);
+        if (request != NULL) {
+            bool known = false;
+            for (size_t j = 0; j < request->n_announcers; j++) {
+                if (request->announcers[j] == peer) known = true;
+            }
+            if (!known && request->n_announcers < MAX_ANNOUNCERS) {
+                request->announcers[request->n_announcers++] = peer;
+            }
+            continue;
+        }
+        if (request_map_size(self->requests) >= MAX_PENDING_REQUESTS) continue;
+
+        request = malloc(sizeof(request_t));
+        assert(request != NULL);
+        request->time = now;
+        request->asked = true;
+        request->announcers[0] = peer;
+        request->n_announcers = 1;
+        request_map_set(self->requests, &guid, request);
+        write_guid(&wanted, guid);
+    }
+    uv_mutex_unlock(&self->lock);
+    if (wanted.length > 0) send_inventory(peer, EVENT_GETDATA, PRIORITY_HIGH, &wanted);
+    dynamic_buffer_destroy(wanted);
+}
+
+/*
+ * Send the requested messages that are still in the relay cache, and list
+ * the others in an EVENT_NOTFOUND reply so that the peer asks another
+ * announcer right away.
+ */
+static void on_getdata(peer_t *peer, tuple_t *msg) {
+    buffer_t guids = get_inventory(msg);
+    if (guids.data == NULL) return;
+
+    dynamic_buffer_t missing = dynamic_buffer_create(GUID_SIZE + 1);
+    for (size_t i = 0; i < guids.length; i += GUID_SIZE) {
+        guid_t guid = read_guid(guids.data + i);
+        frame_t *frame = get_cached_message(peer->server, guid);
+        if (frame == NULL) {
+            write_guid(&missing, guid);
+            continue;
+        }
+        history_add(peer->known, guid);
+        enqueue_message(peer, frame);
+        frame_destroy(peer->loop, frame);
+    }
+    if (missing.length > 0) send_inventory(peer, EVENT_NOTFOUND, PRIORITY_HIGH, &missing);
+    dynamic_buffer_destroy(missing);
+}
+
+/*
+ * Stop waiting for the messages that the peer does not have, so that their
+ * next announcers are asked at the next retry.
+ */
+static void on_notfound(peer_t *peer, tuple_t *msg) {
+    network_t *self = peer->server;
+    buffer_t guids = get_inventory(msg);
+    if (guids.data == NULL) return;
+
+    uv_mutex_lock(&self->lock);
+    for (size_t i = 0; i < guids.length; i += GUID_SIZE) {
+        guid_t guid = read_guid(guids.data + i);
+        request_t *request = request_map_get(self->requests, &guid);
+        if (request == NULL || !request->asked || request->announcers[0] != peer) continue;
+        remove_announcer(request, 0);
+    }
+    uv_mutex_unlock(&self->lock);
 }
 
 void network_broadcast(network_t *self, uint32_t type, buffer_t *buffer) {
-    uint8_t message[MESSAGE_HEADER_SIZE + buffer->length];
-    guid_t guid = guid_new();
-    message_set_magic(message, MESSAGE_MAGIC_NUMBER);
-    message_set_length(message, buffer->length);
-    message_set_guid(message, guid);
-    message_set_type(message, type);
-    memcpy(message + MESSAGE_HEADER_SIZE, buffer->data, buffer->length);
+    uint8_t header[MESSAGE_HEADER_SIZE];
+    guid_t guid = message_content_guid(type, buffer->data, buffer->length);
+    write_header(header, type, guid, buffer->length);
 
+    struct shared_buffer_t *buf = shared_buffer_take(buffer);
+    frame_t *frame = frame_create(type, header, buf, 0, buf->length);
+    shared_buffer_release(NULL, buf);
+    frame_compress_once(frame);
+
+    uv_mutex_lock(&self->lock);
     message_history_add(self, guid);
-    broadcast_message(self, message, MESSAGE_HEADER_SIZE + buffer->length);
+    cache_message(self, NULL, guid, frame);
+    uv_mutex_unlock(&self->lock);
+    announce_everywhere(self, NULL, guid);
 }
 
 void network_send(network_t *self, uint32_t event, buffer_t *buffer, peer_t *peer) {
-    uint8_t message[MESSAGE_HEADER_SIZE + buffer->length];
-    guid_t guid = guid_null();
-    message_set_magic(message, MESSAGE_MAGIC_NUMBER);
-    message_set_length(message, buffer->length);
-    message_set_guid(message, guid);
-    message_set_type(message, event);
-    memcpy(message + MESSAGE_HEADER_SIZE, buffer->data, buffer->length);
+    uint8_t header[MESSAGE_HEADER_SIZE];
+    write_header(header, event, guid_null(), buffer->length);
 
-    message_history_add(self, guid);
-    send_message(message, MESSAGE_HEADER_SIZE + buffer->length, peer);
+    struct shared_buffer_t *buf = shared_buffer_take(buffer);
+    command_t *command = command_create(COMMAND_SEND);
+    command->peer = peer;
+    command->frame = frame_create(event, header, buf, 0, buf->length);
+    shared_buffer_release(NULL, buf);
+    post_command(peer->loop, command);
+}
+
+/*
+ * Return true if broadcasts of the given type are only relayed once the
+ * application has accepted them. Blocks are relayed by the application
+ * after they join the blockchain, so that a peer that asks for the
+ * transactions of a compact block always finds the block at the relaying
+ * node.
+ */
+static bool relayed_by_application(uint16_t type) {
+    return type == EVENT_BLOCK || type == EVENT_COMPACT_BLOCK;
+}
+
+/*
+ * Return a buffer holding the message of len bytes at the given offset of
+ * the buffer that stays valid while the peer buffer is reused, and point
+ * the offset at the message in it. Small messages are copied out of the
+ * buffer so that they do not pin whole read buffers.
+ */
+static struct shared_buffer_t* keep_message(struct shared_buffer_t *buf, size_t *offset, size_t len) {
+    if (2 * len < buf->capacity) {
+        struct shared_buffer_t *copy = shared_buffer_copy(buf->base + *offset, len);
+        *offset = 0;
+        return copy;
+    }
+    shared_buffer_retain(buf);
+    return buf;
 }
 
-static void handle_message(peer_t *peer, uint8_t *message, size_t len) {
+/*
+ * Handle the message of len bytes at the given offset of the buffer, which
+ * is the peer buffer or holds an inflated compressed message. Broadcasts we
+ * have seen before are dropped. Other messages are parsed and handed to the
+ * application thread, and malformed ones are dropped. If the message is a
+ * new broadcast, keep it in the relay cache and announce it to the peers
+ * that do not have it, unless the application relays it itself.
+ */
+static void handle_message(peer_t *peer, struct shared_buffer_t *buf, size_t offset, size_t len) {
     network_t *self = peer->server;
+    io_loop_t *loop = peer->loop;
+    uint8_t *message = buf->base + offset;
+    if (message_get_type(message) & MESSAGE_COMPRESSED) {
+        struct shared_buffer_t *inflated = inflate_message(message, len);
+        if (inflated == NULL) return;
+        handle_message(peer, inflated, 0, inflated->length);
+        shared_buffer_release(loop, inflated);
+        return;
+    }
     guid_t guid = message_get_guid(message);
     uint32_t length = message_get_length(message);
     uint16_t type = message_get_type(message);
     uint8_t *payload = message + MESSAGE_HEADER_SIZE;
     buffer_t buffer = {length, payload};
-    if (guid_is_null(guid)) {
-        if (type < EVENT_COUNT && self->handlers[type]) {
-            tuple_t *tuple = tuple_parse(&buffer);
-            self->handlers[type](peer, tuple);
-            tuple_destroy(tuple);
-        }
-    } else if (!message_history_has(self, guid)) {
-        if (type < EVENT_COUNT && self->handlers[type]) {
-            tuple_t *tuple = tuple_parse(&buffer);
-            self->handlers[type](peer, tuple);
-            tuple_destroy(tuple);
+
+    /* recompute the guid of broadcasts so that peers cannot mislabel them */
+    if (!guid_is_null(guid)) guid = message_content_guid(type, payload, length);
+    if (guid_is_null(guid) && (type == EVENT_INV || type == EVENT_GETDATA || type == EVENT_NOTFOUND)) {
+        tuple_t *tuple = tuple_parse(&buffer);
+        if (type == EVENT_INV) on_inventory(peer, tuple);
+        else if (type == EVENT_GETDATA) on_getdata(peer, tuple);
+        else on_notfound(peer, tuple);
+        if (tuple != NULL) tuple_destroy(tuple);
+        return;
+    }
+    if (!guid_is_null(guid)) {
+        history_add(peer->known, guid);
+        uv_mutex_lock(&self->lock);
+        bool seen = message_history_has(self, guid);
+        if (!seen) {
+            message_history_add(self, guid);
+            free(request_map_remove(self->requests, &guid));
         }
-        message_history_add(self, guid);
-        broadcast_message(self, message, len);
+        uv_mutex_unlock(&self->lock);
+        if (seen) return;
+    }
+
+    struct shared_buffer_t *kept = keep_message(buf, &offset, len);
+    message = kept->base + offset;
+    buffer.data = message + MESSAGE_HEADER_SIZE;
+    tuple_t *tuple = tuple_parse(&buffer);
+    if (tuple == NULL) {
+        shared_buffer_release(loop, kept);
+        return;
     }
+    if (!guid_is_null(guid)) message_set_guid(message, guid);
+    if (type < EVENT_COUNT) {
+        io_event_t *event = io_event_create(IO_MESSAGE, peer);
+        event->type = type;
+        event->tuple = tuple;
+        event->buf = kept;
+        shared_buffer_retain(kept);
+        post_event(self, event);
+    } else {
+        tuple_destroy(tuple);
+    }
+
+    if (!guid_is_null(guid) && !relayed_by_application(type)) {
+        frame_t *frame = frame_create(type, NULL, kept, offset, len);
+        frame_compress_once(frame);
+        uv_mutex_lock(&self->lock);
+        cache_message(self, loop, guid, frame);
+        uv_mutex_unlock(&self->lock);
+        announce_everywhere(self, loop, guid);
+    }
+    shared_buffer_release(loop, kept);
 }
 
-/* Allocate buffers as requested by UV */
-static void on_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
-    char *base = (char *) calloc(1, size);
-    if (!base) {
-        *buf = uv_buf_init(NULL, 0);
+/*
+ * Move the unconsumed bytes of the peer buffer into a new buffer with room
+ * for at least space more bytes. The old buffer stays alive for as long as
+ * writes of relayed messages still reference it.
+ */
+static void move_peer_buffer(peer_t *peer, size_t space) {
+    struct shared_buffer_t *old = peer->buf;
+    size_t pending = old->length - peer->head;
+    size_t capacity = PEER_BUFFER_SIZE;
+    while (capacity < pending + space) capacity *= 2;
+    peer->buf = shared_buffer_create(peer->loop, capacity);
+    memcpy(peer->buf->base, old->base + peer->head, pending);
+    peer->buf->length = pending;
+    peer->head = 0;
+    shared_buffer_release(peer->loop, old);
+}
+
+/*
+ * Make room for a read of at least READ_MIN_SPACE bytes at the end of the
+ * peer buffer. The unconsumed bytes are moved to the front in place if no
+ * write references the buffer, and to a new buffer otherwise.
+ */
+static void reserve_peer_buffer(peer_t *peer) {
+    struct shared_buffer_t *buf = peer->buf;
+    size_t pending = buf->length - peer->head;
+    if (buf->capacity - buf->length >= READ_MIN_SPACE) return;
+    if (buf->ref_count == 1 && pending + READ_MIN_SPACE <= buf->capacity) {
+        memmove(buf->base, buf->base + peer->head, pending);
+        buf->length = pending;
+        peer->head = 0;
     } else {
-        *buf = uv_buf_init(base, size);
+        move_peer_buffer(peer, pending + READ_MIN_SPACE > buf->capacity ? buf->capacity : READ_MIN_SPACE);
+    }
+}
+
+/*
+ * Reclaim the consumed bytes of the peer buffer once all of them have been
+ * consumed, and shrink the buffer back to PEER_BUFFER_SIZE once a large
+ * message has been consumed.
+ */
+static void compact_peer_buffer(peer_t *peer) {
+    struct shared_buffer_t *buf = peer->buf;
+    size_t pending = buf->length - peer->head;
+    if (pending == 0 && buf->ref_count == 1) {
+        buf->length = 0;
+        peer->head = 0;
     }
+    if (buf->capacity > PEER_BUFFER_SIZE && pending <= PEER_BUFFER_SIZE / 2) {
+        move_peer_buffer(peer, READ_MIN_SPACE);
+    }
+}
+
+/* Point UV at the free space at the end of the peer buffer */
+static void on_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+    peer_t *peer = handle->data;
+    reserve_peer_buffer(peer);
+    struct shared_buffer_t *shared = peer->buf;
+    *buf = uv_buf_init((char *) shared->base + shared->length, shared->capacity - shared->length);
 }
 
+/*
+ * Free everything the peer holds on its loop, and let the application
+ * thread know that the peer has disconnected. The peer itself is freed once
+ * the application thread is done with it, or right away if the loop is
+ * stopping.
+ */
 static void on_socket_closed(uv_handle_t *socket) {
     peer_t *peer = socket->data;
-    network_t *server = peer->server;
-    if (server->handlers[EVENT_DISCONNECT]) server->handlers[EVENT_DISCONNECT](peer, NULL);
-    size_t index = list_find(server->peers, socket->data, NULL);
-    if (index != list_size(server->peers)) list_remove(server->peers, index);
-    dynamic_buffer_destroy(peer->buf);
-    if (peer->free_data) peer->free_data(peer->data);
-    free(peer);
+    io_loop_t *loop = peer->loop;
+    list_swap_remove(loop->peers, peer->loop_index);
+    if (peer->loop_index < list_size(loop->peers)) {
+        peer_t *moved = list_get(loop->peers, peer->loop_index);
+        moved->loop_index = peer->loop_index;
+    }
+    uv_mutex_lock(&peer->server->lock);
+    forget_announcer(peer->server, peer);
+    uv_mutex_unlock(&peer->server->lock);
+    shared_buffer_release(loop, peer->buf);
+    history_destroy(peer->known);
+    for (int priority = 0; priority < PRIORITY_COUNT; priority++) {
+        while (peer->queues[priority].head != NULL) {
+            frame_t *next = peer->queues[priority].head->next;
+            frame_destroy(loop, peer->queues[priority].head);
+            peer->queues[priority].head = next;
+        }
+    }
+    peer->socket = NULL;
     free(socket);
+    if (loop->stopping) {
+        if (peer->free_data) peer->free_data(peer->data);
+        free(peer);
+    } else {
+        post_event(peer->server, io_event_create(IO_DISCONNECTED, peer));
+    }
+}
+
+static void close_peer(peer_t *peer) {
+    if (!peer || peer->closing) return;
+    peer->closing = true;
+    uv_close((uv_handle_t*) peer->socket, on_socket_closed);
 }
 
 void network_disconnect(network_t *self, peer_t *peer) {
     if (!peer) return;
-    uv_close((uv_handle_t*) peer->socket, on_socket_closed);
+    command_t *command = command_create(COMMAND_DISCONNECT);
+    command->peer = peer;
+    post_command(peer->loop, command);
 }
 
-uint8_t* find_message_start(dynamic_buffer_t *buf) {
-    for (size_t i = 0; i < buf->length - MESSAGE_HEADER_SIZE + 1; i++) {
-        if (message_get_magic(buf->data + i) == MESSAGE_MAGIC_NUMBER) return buf->data + i;
+/*
+ * Return the first occurrence of the magic number that leaves room for a
+ * header in the given bytes, or NULL if there is none. Candidates are found
+ * with memchr on the first byte of the big-endian magic number.
+ */
+static uint8_t* find_message_start(uint8_t *data, size_t length) {
+    uint8_t *end = data + length;
+    uint8_t *p = data;
+    while ((size_t) (end - p) >= MESSAGE_HEADER_SIZE) {
+        p = memchr(p, MESSAGE_MAGIC_NUMBER >> 24, end - p - MESSAGE_HEADER_SIZE + 1);
+        if (p == NULL) return NULL;
+        if (message_get_magic(p) == MESSAGE_MAGIC_NUMBER) return p;
+        p += 1;
     }
     return NULL;
 }
 
-/* 
+/*
  * Callback for read function. For large messages, the data may be split into
  * multiple calls to this function. Also, a single call to this function may
- * contain multiple messages. Thus, at every call to this function, we simply
- * concatenate newly read data to the end of a large string, then process this
- * string to parse out messages.
- * 
- * Note that this function owns the dynamically allocated buffer passed in as
- * as the "buf" argument and is responsible for freeing its memory under all
- * circumstances.
+ * contain multiple messages. Thus, data is always read into the free space at
+ * the end of the peer buffer, and at every call to this function we dispatch
+ * every complete message in place, starting from the head of the buffer.
+ * Consumed bytes are only reclaimed once per call by compact_peer_buffer.
  */
 static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
-    
+
     peer_t *peer = stream->data;
 
-    /*
-     * If an error occured while reading, we should cleanup any allocated
-     * memory and close the connection.
-     */
+    /* If an error occured while reading, we should close the connection. */
     if (nread < 0) {
-        free(buf->base);
-        network_disconnect(peer->server, peer);
+        close_peer(peer);
         return;
     }
+    peer->buf->length += nread;
 
-    /* concatenate data packet onto the peer read buffer */
-    dynamic_buffer_write(buf->base, buf->len, &peer->buf);
-    free(buf->base);
-
-    uint8_t *start = find_message_start(&peer->buf);
-    while (start != NULL) {
+    for (;;) {
+        uint8_t *data = peer->buf->base;
+        uint8_t *start = find_message_start(data + peer->head, peer->buf->length - peer->head);
 
-        // splice out any bytes that occur before the magic number
-        size_t padding = (size_t) start - (size_t) peer->buf.data;
-        memmove(peer->buf.data, start, peer->buf.length - padding);
-        peer->buf.length -= padding;
+        // skip bytes that cannot start a message, keeping a partial header
+        if (start == NULL) {
+            if (peer->buf->length - peer->head >= MESSAGE_HEADER_SIZE) {
+                peer->head = peer->buf->length - MESSAGE_HEADER_SIZE + 1;
+            }
+            break;
+        }
+        peer->head = start - data;
 
-        // parse message header fields
-        guid_t guid = message_get_guid(peer->buf.data);
-        uint32_t length = message_get_length(peer->buf.data);
-        uint16_t type = message_get_type(peer->buf.data);
+        // disconnect peers that send messages larger than we accept
+        if (message_get_length(start) > (uint32_t) settings.max_message_size) {
+            printf("error: disconnecting peer %s:%d sending oversized message\n", peer->addr, peer_get_port(peer));
+            close_peer(peer);
+            return;
+        }
 
         // wait for more data until we recieve the entire message body
-        size_t message_length = MESSAGE_HEADER_SIZE + length;
-        if (peer->buf.length < message_length) return;
-
-        // handle the message 
-        handle_message(peer, peer->buf.data, message_length);
+        size_t message_length = MESSAGE_HEADER_SIZE + (size_t) message_get_length(start);
+        if (peer->buf->length - peer->head < message_length) break;
 
-        // splice out the message from the peer buffer
-        memmove(peer->buf.data, peer->buf.data + message_length, peer->buf.length - message_length);
-        peer->buf.length -= message_length;
-
-        start = find_message_start(&peer->buf);
+        handle_message(peer, peer->buf, peer->head, message_length);
+        peer->head += message_length;
     }
 
+    compact_peer_buffer(peer);
 }
 
-void create_peer_from_tcp_socket(network_t *self, uv_tcp_t *socket, void *data, void (*free_data)(void*)) {
+/*
+ * Make a peer of a connected socket of the loop, start reading from it, and
+ * let the application thread know that the peer has connected.
+ */
+static void create_peer_from_tcp_socket(io_loop_t *loop, uv_tcp_t *socket, void *data, void (*free_data)(void*)) {
     struct sockaddr_in addr;
     uv_tcp_getpeername(socket, (struct sockaddr *) &addr, &(int){sizeof(addr)});
-    
+
     peer_t *peer = calloc(1, sizeof(peer_t));
-    peer->server = self;
+    assert(peer != NULL);
+    peer->server = loop->network;
+    peer->loop = loop;
     peer->socket = socket;
     strcpy(peer->addr, inet_ntoa(addr.sin_addr));
+    peer->ip = addr.sin_addr.s_addr;
     peer->port = addr.sin_port;
     peer->data = data;
     peer->free_data = free_data;
-    peer->buf = dynamic_buffer_create(32);
+    peer->max_message_size = settings.max_message_size;
+    peer->buf = shared_buffer_create(loop, PEER_BUFFER_SIZE);
+    peer->known = history_create(PEER_KNOWN_INVENTORY);
     socket->data = peer;
-    list_add(self->peers, peer);
+    peer->loop_index = list_size(loop->peers);
+    list_add(loop->peers, peer);
 
     uv_read_start((uv_stream_t *)socket, on_alloc, on_read);
+    post_event(loop->network, io_event_create(IO_CONNECTED, peer));
+}
 
+static void free_handle(uv_handle_t *handle) {
+    free(handle);
 }
 
-/* Callback for handling the new connection */
+/*
+ * Callback for handling the new connection. Connections are accepted on the
+ * default loop and handed over to the next I/O loop as a duplicate of the
+ * accepted socket.
+ */
 static void on_incoming_connection(uv_stream_t *server, int status) {
-    
+
     network_t *self = server->data;
 
     if (status != 0) {
@@ -347,13 +1436,29 @@ static void on_incoming_connection(uv_stream_t *server, int status) {
 
     uv_tcp_t *socket = (uv_tcp_t *) calloc(1, sizeof(uv_tcp_t));
     uv_tcp_init(uv_default_loop(), socket);
-    
-    if (uv_accept(server, (uv_stream_t *)socket) == 0) {
-        create_peer_from_tcp_socket(self, socket, NULL, NULL);
-        if (self->handlers[EVENT_CONNECT]) self->handlers[EVENT_CONNECT]((peer_t *) socket->data, NULL);
+
+    uv_os_fd_t fd;
+    if (uv_accept(server, (uv_stream_t *)socket) == 0 && uv_fileno((uv_handle_t *) socket, &fd) == 0) {
+        command_t *command = command_create(COMMAND_ACCEPT);
+        command->socket = dup(fd);
+        if (command->socket >= 0) post_command(next_loop(self), command);
+        else free(command);
     } else {
         printf("connection error\n");
-        free(socket);
+    }
+    uv_close((uv_handle_t *) socket, free_handle);
+}
+
+/* Make a peer of an accepted socket on the loop */
+static void accept_socket(io_loop_t *loop, uv_os_sock_t fd) {
+    uv_tcp_t *socket = (uv_tcp_t *) calloc(1, sizeof(uv_tcp_t));
+    assert(socket != NULL);
+    uv_tcp_init(&loop->loop, socket);
+    if (uv_tcp_open(socket, fd) == 0) {
+        create_peer_from_tcp_socket(loop, socket, NULL, NULL);
+    } else {
+        close(fd);
+        uv_close((uv_handle_t *) socket, free_handle);
     }
 }
 
@@ -361,26 +1466,22 @@ void network_register(network_t *self, uint32_t event, event_handler_t handler)
     self->handlers[event] = handler;
 }
 
-
-typedef struct connect_ctx {
-    void *data;
-    void (*free_data)(void*);
-    network_t *server;
-    struct sockaddr_in *peer_addr;
-} connect_ctx_t;
-
 void on_outgoing_connection(uv_connect_t* connection, int status) {
-    
+
     connect_ctx_t *ctx = connection->data;
+    uv_tcp_t* socket = (uv_tcp_t *) connection->handle;
+    io_loop_t *loop = socket->data;
 
     if (status != 0) {
-        struct sockaddr_in *addr = connection->data;
+        struct sockaddr_in *addr = &ctx->peer_addr;
         printf("error: unable to connect to %s:%d\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
-        if (ctx->free_data) ctx->free_data(ctx->data);
+        io_event_t *event = io_event_create(IO_CONNECT_FAILED, NULL);
+        event->data = ctx->data;
+        event->free_data = ctx->free_data;
+        post_event(ctx->server, event);
+        if (!uv_is_closing((uv_handle_t *) socket)) uv_close((uv_handle_t *) socket, free_handle);
     } else {
-        uv_tcp_t* socket = (uv_tcp_t *) connection->handle;
-        create_peer_from_tcp_socket(ctx->server, socket, ctx->data, ctx->free_data);
-        if (ctx->server->handlers[EVENT_CONNECT]) ctx->server->handlers[EVENT_CONNECT]((peer_t *) socket->data, NULL);
+        create_peer_from_tcp_socket(loop, socket, ctx->data, ctx->free_data);
     }
 
     free(connection->data);
@@ -388,46 +1489,277 @@ void on_outgoing_connection(uv_connect_t* connection, int status) {
 
 }
 
+/* Start connecting to the peer of the connect context on the loop */
+static void start_connect(io_loop_t *loop, connect_ctx_t *ctx) {
+    uv_tcp_t *socket = malloc(sizeof(uv_tcp_t));
+    assert(socket != NULL);
+    uv_tcp_init(&loop->loop, socket);
+    socket->data = loop;
+    uv_connect_t *connect = malloc(sizeof(uv_connect_t));
+    assert(connect != NULL);
+    connect->data = ctx;
+    int err = uv_tcp_connect(connect, socket, (struct sockaddr*) &ctx->peer_addr, on_outgoing_connection);
+    if (err != 0) {
+        connect->handle = (uv_stream_t *) socket;
+        on_outgoing_connection(connect, err);
+    }
+}
+
 /**
- * Connect asynchronously to the peer with the specified address and port.
- * Once a connection has been established, or failed to be established, the
- * on_outgoing_connect function will be called. 
- * 
+ * Connect asynchronously to the peer with the specified address and port on
+ * the next I/O loop. Once a connection has been established, or failed to
+ * be established, the on_outgoing_connect function will be called.
+ *
  * @param address the ipv4 address of the peer
  * @param port the port of the peer's server
  */
 int network_connect(network_t *self, char *address, int port, void *data, void (*free_data)(void*)) {
-    /* allocate socket for connecting to peer */
-    uv_tcp_t *socket = malloc(sizeof(uv_tcp_t));
-    uv_tcp_init(uv_default_loop(), socket);
-
-    /* connect asynchronously to node with specified address and port */
     connect_ctx_t *connect_ctx = calloc(1, sizeof(connect_ctx_t));
+    assert(connect_ctx != NULL);
     connect_ctx->server = self;
     connect_ctx->data = data;
     connect_ctx->free_data = free_data;
-    uv_ip4_addr(address, port, &connect_ctx->peer_addr);
-    uv_connect_t *connect = malloc(sizeof(uv_connect_t));
-    connect->data = connect_ctx;
-    int err = uv_tcp_connect(connect, socket, (struct sockaddr*) &connect_ctx->peer_addr, on_outgoing_connection);
+    int err = uv_ip4_addr(address, port, &connect_ctx->peer_addr);
     if (err != 0) {
         if (free_data) free_data(data);
         free(connect_ctx);
+        return err;
     }
-    return err;
+    command_t *command = command_create(COMMAND_CONNECT);
+    command->connect = connect_ctx;
+    post_command(next_loop(self), command);
+    return 0;
 }
 
 /**
  * Initialize socket to listen for incoming connections on the port
  * specified in the command line arguments. If no port is specified,
  * listen on the default port defined above.
- * 
+ *
  * @param port the port to listen on
  * @param backlog the size of the backlog queue for incoming connections
- */ 
+ */
 int network_listen(network_t *self, int port, int backlog) {
     struct sockaddr_in addr;
     uv_ip4_addr("0.0.0.0", settings.port, &addr);
-    uv_tcp_bind(self, (struct sockaddr *) &addr, 0);
+    uv_tcp_bind(&self->server, (struct sockaddr *) &addr, 0);
     return uv_listen((uv_stream_t*) &self->server, backlog, on_incoming_connection);
-}
\ No newline at end of file
+}
+
+static void close_handle(uv_handle_t *handle, void *arg) {
+    io_loop_t *loop = arg;
+    if (handle == (uv_handle_t *) &loop->wakeup || uv_is_closing(handle)) return;
+    uv_close(handle, free_handle);
+}
+
+/*
+ * Close all peers and connections of the loop, wait until every loop has
+ * done so, so that no loop posts commands to the others anymore, and let
+ * the loop run out.
+ */
+static void stop_loop(io_loop_t *loop) {
+    loop->stopping = true;
+    for (size_t i = 0; i < list_size(loop->peers); i++) {
+        close_peer(list_get(loop->peers, i));
+    }
+    uv_walk(&loop->loop, close_handle, loop);
+    uv_barrier_wait(&loop->network->stop_barrier);
+    uv_close((uv_handle_t *) &loop->wakeup, NULL);
+}
+
+static void run_command(io_loop_t *loop, command_t *command) {
+    switch (command->kind) {
+        case COMMAND_SEND:
+            enqueue_message(command->peer, command->frame);
+            frame_destroy(loop, command->frame);
+            break;
+        case COMMAND_DISCONNECT:
+            close_peer(command->peer);
+            break;
+        case COMMAND_RELEASE:
+            free(command->peer);
+            break;
+        case COMMAND_CONNECT:
+            start_connect(loop, command->connect);
+            break;
+        case COMMAND_ACCEPT:
+            accept_socket(loop, command->socket);
+            break;
+        case COMMAND_ANNOUNCE:
+            announce_message(loop, command->guid);
+            break;
+        case COMMAND_STOP:
+            stop_loop(loop);
+            break;
+    }
+    free(command);
+}
+
+/* Free a command that was never run, once the loops have stopped */
+static void command_destroy(void *item) {
+    command_t *command = item;
+    switch (command->kind) {
+        case COMMAND_SEND:
+            frame_destroy(NULL, command->frame);
+            break;
+        case COMMAND_RELEASE:
+            free(command->peer);
+            break;
+        case COMMAND_CONNECT:
+            if (command->connect->free_data) command->connect->free_data(command->connect->data);
+            free(command->connect);
+            break;
+        case COMMAND_ACCEPT:
+            close(command->socket);
+            break;
+    }
+    free(command);
+}
+
+static void on_commands(uv_async_t *handle) {
+    io_loop_t *loop = handle->data;
+    command_t *command;
+    while (!loop->stopping && (command = mpsc_queue_pop(loop->commands)) != NULL) {
+        run_command(loop, command);
+    }
+}
+
+static void run_loop(void *arg) {
+    io_loop_t *loop = arg;
+    uv_run(&loop->loop, UV_RUN_DEFAULT);
+}
+
+/*
+ * Run the handler of the event on the application thread. Once the handler
+ * of a disconnected peer has run, the loop of the peer frees it, after the
+ * commands for the peer that are still queued.
+ */
+static void run_event(network_t *self, io_event_t *event) {
+    peer_t *peer = event->peer;
+    switch (event->kind) {
+        case IO_CONNECTED:
+            peer->index = list_size(self->peers);
+            list_add(self->peers, peer);
+            index_peer(self, peer);
+            if (self->handlers[EVENT_CONNECT]) self->handlers[EVENT_CONNECT](peer, NULL);
+            break;
+        case IO_MESSAGE:
+            if (self->handlers[event->type]) self->handlers[event->type](peer, event->tuple);
+            tuple_destroy(event->tuple);
+            shared_buffer_release(NULL, event->buf);
+            break;
+        case IO_DISCONNECTED: {
+            if (self->handlers[EVENT_DISCONNECT]) self->handlers[EVENT_DISCONNECT](peer, NULL);
+            unindex_peer(self, peer);
+            list_swap_remove(self->peers, peer->index);
+            if (peer->index < list_size(self->peers)) {
+                peer_t *moved = list_get(self->peers, peer->index);
+                moved->index = peer->index;
+            }
+            if (peer->free_data) peer->free_data(peer->data);
+            command_t *command = command_create(COMMAND_RELEASE);
+            command->peer = peer;
+            post_command(peer->loop, command);
+            break;
+        }
+        case IO_CONNECT_FAILED:
+            if (event->free_data) event->free_data(event->data);
+            break;
+    }
+    free(event);
+}
+
+/* Free an event that was never handled, once the loops have stopped */
+static void io_event_destroy(void *item) {
+    io_event_t *event = item;
+    switch (event->kind) {
+        case IO_MESSAGE:
+            tuple_destroy(event->tuple);
+            shared_buffer_release(NULL, event->buf);
+            break;
+        case IO_DISCONNECTED:
+            if (event->peer->free_data) event->peer->free_data(event->peer->data);
+            free(event->peer);
+            break;
+        case IO_CONNECT_FAILED:
+            if (event->free_data) event->free_data(event->data);
+            break;
+    }
+    free(event);
+}
+
+static void on_events(uv_async_t *handle) {
+    network_t *self = handle->data;
+    io_event_t *event;
+    while ((event = mpsc_queue_pop(self->events)) != NULL) {
+        run_event(self, event);
+    }
+}
+
+network_t* network_create() {
+    network_t *res = calloc(1, sizeof(network_t));
+    assert (res != NULL);
+    res->peers = list_create(1);
+    uv_tcp_init(uv_default_loop(), &res->server);
+    res->server.data = res;
+    uv_mutex_init(&res->lock);
+    res->message_history = bloom_create(settings.seen_filter_capacity, settings.seen_filter_fp_rate);
+    res->relay_cache = relay_cache_create(RELAY_CACHE_SIZE, NULL);
+    res->requests = request_map_create(16, (void (*)(request_t*)) free);
+    res->peer_index = peer_index_create(16, NULL);
+    res->events = mpsc_queue_create();
+    uv_async_init(uv_default_loop(), &res->wakeup, on_events);
+    res->wakeup.data = res;
+
+    res->n_loops = settings.network_threads > 0 ? settings.network_threads : 1;
+    res->loops = calloc(res->n_loops, sizeof(io_loop_t));
+    assert(res->loops != NULL);
+    uv_barrier_init(&res->stop_barrier, res->n_loops);
+    for (size_t i = 0; i < res->n_loops; i++) {
+        io_loop_t *loop = &res->loops[i];
+        loop->network = res;
+        uv_loop_init(&loop->loop);
+        loop->commands = mpsc_queue_create();
+        loop->peers = list_create(1);
+        uv_async_init(&loop->loop, &loop->wakeup, on_commands);
+        loop->wakeup.data = loop;
+        uv_timer_t *retry_timer = malloc(sizeof(uv_timer_t));
+        assert(retry_timer != NULL);
+        uv_timer_init(&loop->loop, retry_timer);
+        retry_timer->data = loop;
+        uv_timer_start(retry_timer, retry_requests, GETDATA_RETRY_INTERVAL, GETDATA_RETRY_INTERVAL);
+        uv_thread_create(&loop->thread, run_loop, loop);
+    }
+    return res;
+}
+
+void network_destroy(network_t *self) {
+    for (size_t i = 0; i < self->n_loops; i++) {
+        post_command(&self->loops[i], command_create(COMMAND_STOP));
+    }
+    for (size_t i = 0; i < self->n_loops; i++) {
+        io_loop_t *loop = &self->loops[i];
+        uv_thread_join(&loop->thread);
+        mpsc_queue_destroy(loop->commands, command_destroy);
+        uv_loop_close(&loop->loop);
+        list_destroy(loop->peers, NULL);
+        for (size_t j = 0; j < loop->n_free_buffers; j++) {
+            free(loop->free_buffers[j]->base);
+            free(loop->free_buffers[j]);
+        }
+    }
+    mpsc_queue_destroy(self->events, io_event_destroy);
+    uv_barrier_destroy(&self->stop_barrier);
+    free(self->loops);
+
+    list_destroy(self->peers, NULL);
+    bloom_destroy(self->message_history);
+    size_t cursor = 0;
+    frame_t *frame;
+    while (relay_cache_next(self->relay_cache, &cursor, NULL, &frame)) frame_destroy(NULL, frame);
+    relay_cache_destroy(self->relay_cache);
+    request_map_destroy(self->requests);
+    peer_index_destroy(self->peer_index);
+    uv_mutex_destroy(&self->lock);
+    free(self);
+}
@@ -1,30 +1,175 @@
 #include <pool.h>
 #include "util/list.h"
+#include "util/typed_map.h"
 #include <transaction.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
 #include <sodium.h>
 
+#define N_TXN_BUCKETS (1 << 12)
+#define N_SENDER_BUCKETS (1 << 10)
+#define POOL_MAX_PARKED 16
+
+typedef struct sender sender_t;
+
+/*
+ * The entry_t struct stores a pooled transaction together with its position
+ * in the pool and sender lists, so that it can be removed in constant time.
+ * The index is the position in the admitted or parked list of the pool.
+ * The entry keeps its own copy of the transaction hash so that it can be
+ * removed from the transaction index after its transaction has been handed
+ * over to a block.
+ */
+typedef struct entry {
+    uint8_t hash[crypto_generichash_BYTES];
+    transaction_t *txn;
+    sender_t *sender;
+    size_t index;
+    size_t sender_index;
+    bool parked;
+} entry_t;
+
+/*
+ * The sender_t struct groups all pooled transactions sent by a single
+ * public key. The pending value is the sum of the values of all admitted
+ * transactions and never exceeds the sender's balance at admission time.
+ */
+struct sender {
+    uint8_t public_key[crypto_sign_PUBLICKEYBYTES];
+    uint64_t pending;
+    list_t *admitted;
+    list_t *parked;
+};
+
+TYPED_MAP(entry_map, digest_t, entry_t*, digest_hash, digest_equal)
+TYPED_MAP(sender_map, digest_t, sender_t*, digest_hash, digest_equal)
+
 struct pool {
     list_t *list;
+    list_t *parked;
+    entry_map_t *txns;
+    sender_map_t *senders;
+    uint64_t (*balance)(const uint8_t *public_key);
 };
 
-int transaction_compare(transaction_t *txn1, transaction_t *txn2) {
-    const uint8_t *b1 = transaction_get_hash(txn1);
-    const uint8_t *b2 = transaction_get_hash(txn2);
-    return memcmp(b1, b2, crypto_generichash_BYTES);
+static void entry_destroy(entry_t *entry) {
+    if (entry == NULL) return;
+    transaction_destroy(entry->txn);
+    free(entry);
+}
+
+static void sender_destroy(sender_t *sender) {
+    if (sender == NULL) return;
+    list_destroy(sender->admitted, NULL);
+    list_destroy(sender->parked, NULL);
+    free(sender);
 }
 
-pool_t* pool_create() {
+/**
+ * Return the sender with the given public key, creating an empty sender
+ * if the public key has no pooled transactions.
+ *
+ * @param pool the transaction pool.
+ * @param public_key the public key of the sender.
+ * @return the sender.
+ */
+static sender_t* pool_get_sender(pool_t *pool, const uint8_t *public_key) {
+    bool inserted;
+    sender_t **slot = sender_map_get_or_insert(pool->senders, DIGEST(public_key), &inserted);
+    if (!inserted) return *slot;
+    sender_t *sender = calloc(1, sizeof(sender_t));
+    assert(sender != NULL);
+    memcpy(sender->public_key, public_key, crypto_sign_PUBLICKEYBYTES);
+    sender->admitted = list_create(1);
+    sender->parked = list_create(1);
+    *slot = sender;
+    return sender;
+}
+
+/**
+ * Destroy the sender if it no longer has any pooled transactions.
+ */
+static void pool_release_sender(pool_t *pool, sender_t *sender) {
+    if (list_size(sender->admitted) == 0 && list_size(sender->parked) == 0) {
+        sender_map_remove(pool->senders, DIGEST(sender->public_key));
+        sender_destroy(sender);
+    }
+}
+
+/**
+ * Return true if the sender can afford a transaction with the given value
+ * in addition to all of their admitted transactions.
+ */
+static bool sender_can_afford(sender_t *sender, uint64_t balance, uint64_t value) {
+    return sender->pending <= balance && value <= balance - sender->pending;
+}
+
+/**
+ * Remove the ith entry of the list in constant time and update the index of
+ * the entry that takes its place.
+ */
+static void entry_list_remove(list_t *list, size_t i, bool sender_list) {
+    list_swap_remove(list, i);
+    if (i == list_size(list)) return;
+    entry_t *moved = list_get(list, i);
+    if (sender_list) moved->sender_index = i;
+    else moved->index = i;
+}
+
+static void pool_admit(pool_t *pool, entry_t *entry) {
+    sender_t *sender = entry->sender;
+    sender->pending += transaction_get_value(entry->txn);
+    entry->parked = false;
+    entry->index = list_size(pool->list);
+    entry->sender_index = list_size(sender->admitted);
+    list_add(pool->list, entry);
+    list_add(sender->admitted, entry);
+}
+
+static void pool_park(pool_t *pool, entry_t *entry) {
+    sender_t *sender = entry->sender;
+    entry->parked = true;
+    entry->index = list_size(pool->parked);
+    entry->sender_index = list_size(sender->parked);
+    list_add(pool->parked, entry);
+    list_add(sender->parked, entry);
+}
+
+/**
+ * Remove the entry from the pool and sender lists without destroying it.
+ * The entry remains in the transaction index.
+ */
+static void pool_unlink(pool_t *pool, entry_t *entry) {
+    sender_t *sender = entry->sender;
+    if (entry->parked) {
+        entry_list_remove(pool->parked, entry->index, false);
+        entry_list_remove(sender->parked, entry->sender_index, true);
+    } else {
+        entry_list_remove(pool->list, entry->index, false);
+        entry_list_remove(sender->admitted, entry->sender_index, true);
+        sender->pending -= transaction_get_value(entry->txn);
+    }
+}
+
+pool_t* pool_create(uint64_t (*balance)(const uint8_t *public_key)) {
+    assert(balance != NULL);
     pool_t *result = malloc(sizeof(pool_t));
     assert(result != NULL);
     result->list = list_create(64);
+    result->parked = list_create(16);
+    result->txns = entry_map_create(N_TXN_BUCKETS, entry_destroy);
+    result->senders = sender_map_create(N_SENDER_BUCKETS, sender_destroy);
+    result->balance = balance;
     return result;
 }
 
 void pool_destroy(pool_t *pool) {
     if (pool == NULL) return;
-    list_destroy(pool->list, (void (*)(void *)) transaction_destroy);
+    list_destroy(pool->list, NULL);
+    list_destroy(pool->parked, NULL);
+    entry_map_destroy(pool->txns);
+    sender_map_destroy(pool->senders);
     free(pool);
 }
 
@@ -33,22 +178,145 @@ size_t pool_size(pool_t *pool) {
     return list_size(pool->list);
 }
 
+bool pool_has(pool_t *pool, const uint8_t *hash) {
+    assert(pool != NULL);
+    return entry_map_get(pool->txns, DIGEST(hash)) != NULL;
+}
+
+/**
+ * Add a transaction to the pool, parking it if the sender cannot afford it.
+ * If the sender already has max_parked parked transactions, destroy it.
+ */
+static void pool_insert(pool_t *pool, transaction_t *txn, size_t max_parked) {
+    if (entry_map_get(pool->txns, DIGEST(transaction_get_hash(txn))) != NULL) {
+        transaction_destroy(txn);
+        return;
+    }
+
+    sender_t *sender = pool_get_sender(pool, transaction_get_sender(txn));
+    uint64_t balance = pool->balance(sender->public_key);
+    bool affordable = sender_can_afford(sender, balance, transaction_get_value(txn));
+    if (!affordable && list_size(sender->parked) >= max_parked) {
+        transaction_destroy(txn);
+        return;
+    }
+
+    entry_t *entry = calloc(1, sizeof(entry_t));
+    assert(entry != NULL);
+    memcpy(entry->hash, transaction_get_hash(txn), crypto_generichash_BYTES);
+    entry->txn = txn;
+    entry->sender = sender;
+    if (affordable) pool_admit(pool, entry);
+    else pool_park(pool, entry);
+    entry_map_set(pool->txns, DIGEST(entry->hash), entry);
+}
+
 void pool_add(pool_t *pool, transaction_t *txn) {
     assert(pool != NULL);
     assert(txn != NULL);
-    size_t i = list_find(pool->list, txn, (compare_t) transaction_compare);
-    if (i != list_size(pool->list)) {
-        transaction_destroy(txn);
-    } else {
-        list_add(pool->list, txn);
+    pool_insert(pool, txn, POOL_MAX_PARKED);
+}
+
+void pool_restore(pool_t *pool, transaction_t *txn) {
+    assert(pool != NULL);
+    assert(txn != NULL);
+    pool_insert(pool, txn, SIZE_MAX);
+}
+
+void pool_write(pool_t *pool, dynamic_buffer_t *buf) {
+    assert(pool != NULL);
+    tuple_write_start(buf);
+    for (size_t i = 0; i < list_size(pool->list); i++) {
+        entry_t *entry = list_get(pool->list, i);
+        transaction_write(entry->txn, buf);
     }
+    for (size_t i = 0; i < list_size(pool->parked); i++) {
+        entry_t *entry = list_get(pool->parked, i);
+        transaction_write(entry->txn, buf);
+    }
+    tuple_write_end(buf);
+}
+
+void pool_evict(pool_t *pool, const uint8_t *hash) {
+    assert(pool != NULL);
+    entry_t *entry = entry_map_remove(pool->txns, DIGEST(hash));
+    if (entry == NULL) return;
+    sender_t *sender = entry->sender;
+    pool_unlink(pool, entry);
+    entry_destroy(entry);
+    pool_release_sender(pool, sender);
+}
+
+void pool_update(pool_t *pool, const uint8_t *public_key) {
+    assert(pool != NULL);
+    sender_t *sender = sender_map_get(pool->senders, DIGEST(public_key));
+    if (sender == NULL) return;
+    uint64_t balance = pool->balance(sender->public_key);
+
+    /* park admitted transactions until the rest are affordable */
+    while (sender->pending > balance) {
+        entry_t *entry = list_get(sender->admitted, list_size(sender->admitted) - 1);
+        pool_unlink(pool, entry);
+        if (list_size(sender->parked) < POOL_MAX_PARKED) {
+            pool_park(pool, entry);
+        } else {
+            entry_map_remove(pool->txns, DIGEST(entry->hash));
+            entry_destroy(entry);
+        }
+    }
+
+    /* admit parked transactions while affordable */
+    size_t i = 0;
+    while (i < list_size(sender->parked)) {
+        entry_t *entry = list_get(sender->parked, i);
+        if (sender_can_afford(sender, balance, transaction_get_value(entry->txn))) {
+            pool_unlink(pool, entry);
+            pool_admit(pool, entry);
+        } else {
+            i += 1;
+        }
+    }
+
+    pool_release_sender(pool, sender);
+}
+
+void pool_take(pool_t *pool, bool (*accept)(void *ctx, transaction_t *txn), void *ctx) {
+    assert(pool != NULL);
+    assert(accept != NULL);
+    list_t *list = list_create(list_size(pool->list));
+    for (size_t i = 0; i < list_size(pool->list); i++) {
+        entry_t *entry = list_get(pool->list, i);
+        sender_t *sender = entry->sender;
+        uint64_t value = transaction_get_value(entry->txn);
+        if (accept(ctx, entry->txn)) {
+            entry_list_remove(sender->admitted, entry->sender_index, true);
+            sender->pending -= value;
+            entry_map_remove(pool->txns, DIGEST(entry->hash));
+            free(entry);
+            pool_release_sender(pool, sender);
+        } else {
+            entry->index = list_size(list);
+            list_add(list, entry);
+        }
+    }
+    list_destroy(pool->list, NULL);
+    pool->list = list;
 }
 
 transaction_t* pool_get(pool_t *pool, size_t index) {
     assert(pool != NULL);
-    return list_get(pool->list, index);
+    entry_t *entry = list_get(pool->list, index);
+    return entry->txn;
 }
 
 transaction_t* pool_remove(pool_t *pool, size_t index) {
-    return list_remove(pool->list, index);
+    assert(pool != NULL);
+    entry_t *entry = list_get(pool->list, index);
+    transaction_t *txn = entry->txn;
+    sender_t *sender = entry->sender;
+    entry_map_remove(pool->txns, DIGEST(entry->hash));
+    pool_unlink(pool, entry);
+    free(entry);
+    pool_release_sender(pool, sender);
+    return txn;
 }
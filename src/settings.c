@@ -12,12 +12,28 @@ struct settings_t settings;
  * --port=<value>               Set listening port
  * --connect=<address>:<port>   Add address:port to initial connection list
  * --backlog=<value>            Set server backlog size
+ * --max-block-size=<bytes>     Set maximum size of transactions in a block
+ * --pool-file=<path>           Set file to persist the transaction pool in
+ * --pool-save-interval=<secs>  Set interval between pool saves (0 disables)
+ * --seen-filter-capacity=<n>   Set number of recent messages remembered for dedup
+ * --seen-filter-fp-rate=<rate> Set false positive rate of the dedup filter
+ * --features=<bits>            Set protocol features offered to peers
+ * --max-message-size=<bytes>   Set maximum size of messages accepted from peers
+ * --network-threads=<n>        Set number of threads doing network I/O
  */
 void parse_arguments(int argc, char **argv) {
     
     settings.port = DEFAULT_PORT;
     settings.backlog = DEFAULT_BACKLOG;
     settings.should_listen = DEFAULT_SHOULD_LISTEN;
+    settings.max_block_size = DEFAULT_MAX_BLOCK_SIZE;
+    settings.pool_file[0] = '\0';
+    settings.pool_save_interval = DEFAULT_POOL_SAVE_INTERVAL;
+    settings.seen_filter_capacity = DEFAULT_SEEN_FILTER_CAPACITY;
+    settings.seen_filter_fp_rate = DEFAULT_SEEN_FILTER_FP_RATE;
+    settings.features = DEFAULT_FEATURES;
+    settings.max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
+    settings.network_threads = DEFAULT_NETWORK_THREADS;
     
     /*
      * Runtime settings determined from a combination of defaults and command
@@ -32,12 +48,28 @@ void parse_arguments(int argc, char **argv) {
             int *port = &settings.port;
             int *backlog = &settings.backlog;
             int *should_listen = &settings.should_listen;
+            int *max_block_size = &settings.max_block_size;
+            char *pool_file = settings.pool_file;
+            int *pool_save_interval = &settings.pool_save_interval;
+            int *seen_filter_capacity = &settings.seen_filter_capacity;
+            double *seen_filter_fp_rate = &settings.seen_filter_fp_rate;
+            unsigned int *features = &settings.features;
+            int *max_message_size = &settings.max_message_size;
+            int *network_threads = &settings.network_threads;
             char *peer_address = (char *) &settings.peer_addresses[settings.n_peer_connections];
             int *peer_port = (int *) &settings.peer_ports[settings.n_peer_connections];
 
             if (sscanf(argv[i], "-port=%d", port) == 1) continue;
             if (sscanf(argv[i], "-backlog=%d", backlog) == 1) continue;
             if (sscanf(argv[i], "-should-listen=%d", should_listen) == 1) continue;
+            if (sscanf(argv[i], "-max-block-size=%d", max_block_size) == 1) continue;
+            if (sscanf(argv[i], "-pool-file=%255s", pool_file) == 1) continue;
+            if (sscanf(argv[i], "-pool-save-interval=%d", pool_save_interval) == 1) continue;
+            if (sscanf(argv[i], "-seen-filter-capacity=%d", seen_filter_capacity) == 1) continue;
+            if (sscanf(argv[i], "-seen-filter-fp-rate=%lf", seen_filter_fp_rate) == 1) continue;
+            if (sscanf(argv[i], "-features=%u", features) == 1) continue;
+            if (sscanf(argv[i], "-max-message-size=%d", max_message_size) == 1) continue;
+            if (sscanf(argv[i], "-network-threads=%d", network_threads) == 1) continue;
             
             /* allow up to MAX_INITIAL_CONNECTIONS --connect arguments */
             if (settings.n_peer_connections < MAX_INITIAL_CONNECTIONS) {
@@ -6,6 +6,16 @@
 
 static const uint8_t NULL_ACCOUNT[crypto_sign_PUBLICKEYBYTES] = {0};
 
+/* the size of a tuple binary element containing n bytes of data */
+#define BINARY_SIZE(n) (1 + sizeof(uint32_t) + (n))
+
+/* the size of the tuple representation written by transaction_write */
+#define TRANSACTION_SIZE (4 \
+    + 2 * BINARY_SIZE(crypto_sign_PUBLICKEYBYTES) \
+    + 1 + sizeof(uint64_t) \
+    + 1 + sizeof(uint32_t) \
+    + BINARY_SIZE(crypto_sign_BYTES))
+
 struct transaction {
 
     uint8_t sender[crypto_sign_PUBLICKEYBYTES]; 
@@ -91,6 +101,14 @@ transaction_t* transaction_create(const uint8_t *public_key, const uint8_t *priv
     return result;
 }
 
+transaction_t* transaction_copy(const transaction_t *txn) {
+    assert(txn != NULL);
+    transaction_t *result = malloc(sizeof(transaction_t));
+    assert(result != NULL);
+    memcpy(result, txn, sizeof(transaction_t));
+    return result;
+}
+
 transaction_t* transaction_create_from_tuple(const tuple_t *tuple) {
     assert(tuple != NULL);
     if (!transaction_is_valid(tuple)) return NULL;
@@ -152,6 +170,23 @@ const uint8_t* transaction_get_hash(const transaction_t *txn) {
    return txn->hash;
 }
 
+size_t transaction_get_size(const transaction_t *txn) {
+    assert(txn != NULL);
+    return TRANSACTION_SIZE;
+}
+
+uint64_t transaction_get_short_id(const transaction_t *txn, const uint8_t *key) {
+    assert(txn != NULL);
+    assert(TRANSACTION_SHORT_ID_KEY_BYTES == crypto_shorthash_KEYBYTES);
+    uint8_t out[crypto_shorthash_BYTES];
+    crypto_shorthash(out, txn->hash, crypto_generichash_BYTES, key);
+    uint64_t result = 0;
+    for (size_t i = 0; i < crypto_shorthash_BYTES; i++) {
+        result = (result << 8) | out[i];
+    }
+    return result;
+}
+
 void transaction_destroy(transaction_t *txn) {
     free(txn);
 }
@@ -0,0 +1,115 @@
+#include "util/bloom.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sodium.h>
+
+#define BLOOM_MAX_HASHES 32
+
+struct bloom {
+    uint64_t *current;
+    uint64_t *previous;
+    size_t n_words;
+    size_t n_bits;
+    size_t n_hashes;
+    size_t capacity;
+    size_t count;
+    uint8_t key[crypto_shorthash_KEYBYTES];
+};
+
+/*
+ * The bit positions of a key are h1 + i * h2 for i < n_hashes (double
+ * hashing), where h1 and h2 are derived from a single keyed SipHash of the key.
+ */
+typedef struct bloom_hash {
+    uint64_t h1;
+    uint64_t h2;
+} bloom_hash_t;
+
+static bloom_hash_t bloom_hash(const bloom_t *self, const uint8_t *key, size_t length) {
+    uint8_t out[crypto_shorthash_BYTES];
+    crypto_shorthash(out, key, length, self->key);
+    uint64_t h;
+    memcpy(&h, out, sizeof(h));
+    bloom_hash_t result;
+    result.h1 = h;
+    result.h2 = ((h >> 32) | (h << 32)) * 0x9e3779b97f4a7c15ULL | 1;
+    return result;
+}
+
+static bool generation_has(const bloom_t *self, const uint64_t *bits, bloom_hash_t hash) {
+    for (size_t i = 0; i < self->n_hashes; i++) {
+        size_t bit = (hash.h1 + i * hash.h2) % self->n_bits;
+        if ((bits[bit / 64] & ((uint64_t) 1 << (bit % 64))) == 0) return false;
+    }
+    return true;
+}
+
+bloom_t* bloom_create(size_t capacity, double fp_rate) {
+    assert(capacity > 0);
+    assert(fp_rate > 0 && fp_rate < 1);
+    bloom_t *result = calloc(1, sizeof(bloom_t));
+    assert(result != NULL);
+
+    /*
+     * A lookup checks both generations, so each generation gets half of the
+     * false positive rate. The optimal filter for n keys and rate p has
+     * -n ln(p) / ln(2)^2 bits and uses ln(2) bits / n hash functions.
+     */
+    double p = fp_rate / 2;
+    double n_bits = ceil(-(double) capacity * log(p) / (M_LN2 * M_LN2));
+    size_t n_hashes = (size_t) round(n_bits / capacity * M_LN2);
+    if (n_hashes < 1) n_hashes = 1;
+    if (n_hashes > BLOOM_MAX_HASHES) n_hashes = BLOOM_MAX_HASHES;
+
+    result->n_words = ((size_t) n_bits + 63) / 64;
+    result->n_bits = result->n_words * 64;
+    result->n_hashes = n_hashes;
+    result->capacity = capacity;
+    result->count = 0;
+    result->current = calloc(result->n_words, sizeof(uint64_t));
+    result->previous = calloc(result->n_words, sizeof(uint64_t));
+    assert(result->current != NULL && result->previous != NULL);
+    randombytes_buf(result->key, sizeof(result->key));
+    return result;
+}
+
+void bloom_destroy(bloom_t *self) {
+    if (self == NULL) return;
+    free(self->current);
+    free(self->previous);
+    free(self);
+}
+
+size_t bloom_get_size(const bloom_t *self) {
+    assert(self != NULL);
+    return 2 * self->n_words * sizeof(uint64_t);
+}
+
+bool bloom_has(const bloom_t *self, const uint8_t *key, size_t length) {
+    assert(self != NULL);
+    bloom_hash_t hash = bloom_hash(self, key, length);
+    return generation_has(self, self->current, hash) || generation_has(self, self->previous, hash);
+}
+
+void bloom_add(bloom_t *self, const uint8_t *key, size_t length) {
+    assert(self != NULL);
+
+    /* retire the previous generation and start a new one */
+    if (self->count == self->capacity) {
+        uint64_t *tmp = self->previous;
+        self->previous = self->current;
+        self->current = tmp;
+        memset(self->current, 0, self->n_words * sizeof(uint64_t));
+        self->count = 0;
+    }
+
+    bloom_hash_t hash = bloom_hash(self, key, length);
+    for (size_t i = 0; i < self->n_hashes; i++) {
+        size_t bit = (hash.h1 + i * hash.h2) % self->n_bits;
+        self->current[bit / 64] |= (uint64_t) 1 << (bit % 64);
+    }
+    self->count += 1;
+}
@@ -0,0 +1,63 @@
+#include "util/history.h"
+#include "util/typed_map.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+TYPED_SET(guid_set, guid_t, guid_hash, guid_equal)
+
+struct history {
+    guid_t *ring;
+    size_t capacity;
+    size_t head;
+    size_t size;
+    guid_set_t *seen;
+};
+
+history_t* history_create(size_t capacity) {
+    assert(capacity > 0);
+    history_t *result = malloc(sizeof(history_t));
+    assert(result != NULL);
+    result->ring = malloc(capacity * sizeof(guid_t));
+    assert(result->ring != NULL);
+    result->capacity = capacity;
+    result->head = 0;
+    result->size = 0;
+
+    /* the set stays below its maximum load factor, so it never resizes */
+    result->seen = guid_set_create(2 * capacity);
+    return result;
+}
+
+void history_destroy(history_t *self) {
+    if (self == NULL) return;
+    guid_set_destroy(self->seen);
+    free(self->ring);
+    free(self);
+}
+
+size_t history_size(const history_t *self) {
+    assert(self != NULL);
+    return self->size;
+}
+
+bool history_has(const history_t *self, guid_t guid) {
+    assert(self != NULL);
+    return guid_set_has(self->seen, &guid);
+}
+
+bool history_add(history_t *self, guid_t guid) {
+    assert(self != NULL);
+    if (guid_set_has(self->seen, &guid)) return false;
+
+    /* overwrite the oldest guid, which sits at the head once the ring is full */
+    if (self->size == self->capacity) {
+        guid_set_remove(self->seen, &self->ring[self->head]);
+        self->size -= 1;
+    }
+    self->ring[self->head] = guid;
+    self->head = (self->head + 1) % self->capacity;
+    self->size += 1;
+    guid_set_add(self->seen, &guid);
+    return true;
+}
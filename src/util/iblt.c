@@ -0,0 +1,197 @@
+#include <util/iblt.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IBLT_HASH_COUNT 3
+#define IBLT_CHECK_SEED 0x5bd1e9955bd1e995ULL
+
+/*
+ * Each cell stores the number of keys mapped to it, the xor of the keys and
+ * the xor of a checksum of the keys. A cell is pure when it holds exactly one
+ * inserted or removed key, which is the case when its count is 1 or -1 and
+ * its checksum matches the checksum of its key.
+ */
+typedef struct cell {
+    int32_t count;
+    uint64_t key_sum;
+    uint32_t check_sum;
+} cell_t;
+
+struct iblt {
+    cell_t *cells;
+    size_t n_cells;
+};
+
+/**
+ * Mix the bits of a 64-bit value (the splitmix64 finalizer).
+ * @param x the value
+ * @return the mixed value
+ */
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint32_t checksum(uint64_t key) {
+    return (uint32_t) mix(key ^ IBLT_CHECK_SEED);
+}
+
+/**
+ * Return the index of the cell that the ith hash function maps the key to.
+ * The table is split into one region per hash function so that a key always
+ * maps to distinct cells.
+ *
+ * @param self the table
+ * @param key the key
+ * @param i the hash function index
+ * @return the cell index
+ */
+static size_t cell_index(const iblt_t *self, uint64_t key, size_t i) {
+    size_t region = self->n_cells / IBLT_HASH_COUNT;
+    return i * region + mix(key + i) % region;
+}
+
+static void update(iblt_t *self, uint64_t key, int32_t count) {
+    uint32_t check = checksum(key);
+    for (size_t i = 0; i < IBLT_HASH_COUNT; i++) {
+        cell_t *cell = &self->cells[cell_index(self, key, i)];
+        cell->count += count;
+        cell->key_sum ^= key;
+        cell->check_sum ^= check;
+    }
+}
+
+static bool is_pure(const cell_t *cell) {
+    return (cell->count == 1 || cell->count == -1) && cell->check_sum == checksum(cell->key_sum);
+}
+
+static bool is_empty(const cell_t *cell) {
+    return cell->count == 0 && cell->key_sum == 0 && cell->check_sum == 0;
+}
+
+static void write_u64(dynamic_buffer_t *buffer, uint64_t value, size_t n) {
+    for (size_t i = n; i > 0; i--) {
+        dynamic_buffer_putc((uint8_t)(value >> (8 * (i - 1))), buffer);
+    }
+}
+
+static uint64_t read_u64(const uint8_t *data, size_t n) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < n; i++) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+iblt_t* iblt_create(size_t n_cells) {
+    if (n_cells < IBLT_HASH_COUNT) n_cells = IBLT_HASH_COUNT;
+    n_cells += (IBLT_HASH_COUNT - n_cells % IBLT_HASH_COUNT) % IBLT_HASH_COUNT;
+    iblt_t *result = malloc(sizeof(iblt_t));
+    assert(result != NULL);
+    result->cells = calloc(n_cells, sizeof(cell_t));
+    assert(result->cells != NULL);
+    result->n_cells = n_cells;
+    return result;
+}
+
+iblt_t* iblt_create_from_buffer(buffer_t buffer) {
+    if (buffer.length == 0 || buffer.length % IBLT_CELL_SIZE != 0) return NULL;
+    size_t n_cells = buffer.length / IBLT_CELL_SIZE;
+    if (n_cells % IBLT_HASH_COUNT != 0) return NULL;
+    iblt_t *result = iblt_create(n_cells);
+    for (size_t i = 0; i < n_cells; i++) {
+        const uint8_t *data = buffer.data + i * IBLT_CELL_SIZE;
+        result->cells[i].count = (int32_t)(uint32_t) read_u64(data, 4);
+        result->cells[i].key_sum = read_u64(data + 4, 8);
+        result->cells[i].check_sum = (uint32_t) read_u64(data + 12, 4);
+    }
+    return result;
+}
+
+void iblt_destroy(iblt_t *self) {
+    if (self == NULL) return;
+    free(self->cells);
+    free(self);
+}
+
+size_t iblt_size(const iblt_t *self) {
+    assert(self != NULL);
+    return self->n_cells;
+}
+
+void iblt_insert(iblt_t *self, uint64_t key) {
+    assert(self != NULL);
+    update(self, key, 1);
+}
+
+void iblt_remove(iblt_t *self, uint64_t key) {
+    assert(self != NULL);
+    update(self, key, -1);
+}
+
+bool iblt_subtract(iblt_t *self, const iblt_t *other) {
+    assert(self != NULL);
+    assert(other != NULL);
+    if (self->n_cells != other->n_cells) return false;
+    for (size_t i = 0; i < self->n_cells; i++) {
+        self->cells[i].count -= other->cells[i].count;
+        self->cells[i].key_sum ^= other->cells[i].key_sum;
+        self->cells[i].check_sum ^= other->cells[i].check_sum;
+    }
+    return true;
+}
+
+bool iblt_decode(iblt_t *self, void (*found)(void *ctx, uint64_t key, bool inserted), void *ctx) {
+    assert(self != NULL);
+    assert(found != NULL);
+
+    /* every peeled key can make at most IBLT_HASH_COUNT new cells pure */
+    size_t capacity = self->n_cells;
+    size_t size = 0;
+    size_t *stack = malloc(capacity * sizeof(size_t));
+    assert(stack != NULL);
+    for (size_t i = 0; i < self->n_cells; i++) {
+        if (is_pure(&self->cells[i])) stack[size++] = i;
+    }
+
+    /* repeatedly peel a key off a pure cell and remove it from the table */
+    while (size > 0) {
+        cell_t *cell = &self->cells[stack[--size]];
+        if (!is_pure(cell)) continue;
+        uint64_t key = cell->key_sum;
+        int32_t count = cell->count;
+        found(ctx, key, count > 0);
+        update(self, key, -count);
+        if (size + IBLT_HASH_COUNT > capacity) {
+            capacity *= 2;
+            stack = realloc(stack, capacity * sizeof(size_t));
+            assert(stack != NULL);
+        }
+        for (size_t i = 0; i < IBLT_HASH_COUNT; i++) {
+            size_t j = cell_index(self, key, i);
+            if (is_pure(&self->cells[j])) stack[size++] = j;
+        }
+    }
+    free(stack);
+
+    /* the table is fully decoded only if every cell is empty */
+    for (size_t i = 0; i < self->n_cells; i++) {
+        if (!is_empty(&self->cells[i])) return false;
+    }
+    return true;
+}
+
+void iblt_write(const iblt_t *self, dynamic_buffer_t *buffer) {
+    assert(self != NULL);
+    for (size_t i = 0; i < self->n_cells; i++) {
+        write_u64(buffer, (uint32_t) self->cells[i].count, 4);
+        write_u64(buffer, self->cells[i].key_sum, 8);
+        write_u64(buffer, self->cells[i].check_sum, 4);
+    }
+}
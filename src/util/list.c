@@ -15,10 +15,10 @@ list_t* list_create(size_t initial_capacity) {
     assert(initial_capacity >= 0);
     list_t *res = malloc(sizeof(list_t));
     assert(res != NULL);
-    res->data = malloc(initial_capacity * sizeof(void*));
-    assert(res != NULL);
     res->size = 0;
     res->capacity = initial_capacity < 1 ? 1: initial_capacity;
+    res->data = malloc(res->capacity * sizeof(void*));
+    assert(res->data != NULL);
     return res;
 }
 
@@ -67,6 +67,15 @@ void* list_remove(list_t *list, size_t i) {
     return result;
 }
 
+void* list_swap_remove(list_t *list, size_t i) {
+    assert(list != NULL);
+    assert(0 <= i && i < list->size);
+    void *result = list->data[i];
+    list->size -= 1;
+    list->data[i] = list->data[list->size];
+    return result;
+}
+
 size_t list_find(list_t *list, void *e, int (*cmp)(void*, void*)) {
     assert(list != NULL);
     if (cmp == NULL) {
@@ -1,14 +1,34 @@
 #include "util/map.h"
-#include "util/list.h"
 
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sodium.h>
+#include <stdint.h>
+
+#define MAP_MIN_CAPACITY 8
+#define MAP_MAX_LOAD_NUMERATOR 7
+#define MAP_MAX_LOAD_DENOMINATOR 8
+
+/*
+ * The map is an open-addressing hash table with Robin Hood probing. Each
+ * slot stores its key, value, and the mixed hash of its key, so that probing
+ * only calls the comparator on a full hash match. The dist field is one more
+ * than the distance of the slot from the home slot of its key, or zero if the
+ * slot is empty. Insertion moves richer entries (those closer to home) out of
+ * the way of poorer ones, which keeps probe sequences short and lets a lookup
+ * stop as soon as it reaches an entry closer to home than the key would be.
+ */
+typedef struct slot {
+    void *key;
+    void *val;
+    size_t hash;
+    size_t dist;
+} slot_t;
 
 struct map {
-    size_t n_buckets;
-    list_t **buckets;
+    slot_t *slots;
+    size_t capacity;
+    size_t shift;
     size_t size;
     destructor_t destroy_key;
     destructor_t destroy_val;
@@ -16,31 +36,84 @@ struct map {
     hash_t hash;
 };
 
-typedef struct entry {
-    void *key;
-    void *val;
-    map_t *map;
-} entry_t;
-
-static void entry_destroy(entry_t *e) {
-    assert(e != NULL);
-    assert(e->map != NULL);
-    if (e->map->destroy_key) e->map->destroy_key(e->key);
-    if (e->map->destroy_val) e->map->destroy_val(e->val);
-    free(e);
+/**
+ * Mix the user supplied hash so that weak hash functions still spread keys
+ * over the whole table (Fibonacci hashing).
+ */
+static size_t mix(size_t hash) {
+    return (size_t)((uint64_t) hash * 0x9e3779b97f4a7c15ULL);
 }
 
-static int entry_compare(entry_t *e1, entry_t *e2) {
-    assert(e1 != NULL);
-    assert(e2 != NULL);
-    assert(e1->map != NULL);
-    assert(e1->map->compare_key != NULL);
-    return e1->map->compare_key(e1->key, e2->key);
+static size_t map_home(const map_t *map, size_t hash) {
+    return (size_t)((uint64_t) hash >> map->shift);
 }
 
-static size_t map_get_bucket(map_t *map, void *key) {
-    size_t hash = map->hash(key);
-    return hash % map->n_buckets;
+static size_t map_probe_next(const map_t *map, size_t i) {
+    return (i + 1) & (map->capacity - 1);
+}
+
+static void map_alloc(map_t *map, size_t capacity) {
+    size_t log2 = 0;
+    while (((size_t) 1 << log2) < capacity) log2 += 1;
+    map->capacity = (size_t) 1 << log2;
+    map->shift = 64 - log2;
+    map->slots = calloc(map->capacity, sizeof(slot_t));
+    assert(map->slots != NULL);
+}
+
+/**
+ * Insert an entry whose key is known to be absent, displacing richer entries
+ * along the probe sequence. Return the index of the slot of the new entry.
+ */
+static size_t map_insert(map_t *map, slot_t entry) {
+    size_t i = map_home(map, entry.hash);
+    size_t result = map->capacity;
+    entry.dist = 1;
+    while (map->slots[i].dist != 0) {
+        if (map->slots[i].dist < entry.dist) {
+            slot_t tmp = map->slots[i];
+            map->slots[i] = entry;
+            entry = tmp;
+            if (result == map->capacity) result = i;
+        }
+        i = map_probe_next(map, i);
+        entry.dist += 1;
+    }
+    map->slots[i] = entry;
+    map->size += 1;
+    return result == map->capacity ? i : result;
+}
+
+/**
+ * Double the capacity of the map if inserting another entry would exceed
+ * the maximum load factor.
+ */
+static void map_reserve(map_t *map) {
+    if ((map->size + 1) * MAP_MAX_LOAD_DENOMINATOR <= map->capacity * MAP_MAX_LOAD_NUMERATOR) return;
+    slot_t *old_slots = map->slots;
+    size_t old_capacity = map->capacity;
+    map_alloc(map, old_capacity * 2);
+    map->size = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i].dist != 0) map_insert(map, old_slots[i]);
+    }
+    free(old_slots);
+}
+
+/**
+ * Return the index of the slot holding the key, or capacity if the key is
+ * not in the map.
+ */
+static size_t map_find(const map_t *map, const void *key, size_t hash) {
+    size_t i = map_home(map, hash);
+    for (size_t dist = 1; dist <= map->slots[i].dist; dist++) {
+        const slot_t *slot = &map->slots[i];
+        if (slot->hash == hash && map->compare_key(slot->key, (void *) key) == 0) {
+            return i;
+        }
+        i = map_probe_next(map, i);
+    }
+    return map->capacity;
 }
 
 size_t map_size(const map_t *map) {
@@ -49,9 +122,8 @@ size_t map_size(const map_t *map) {
 
 map_t* map_create(size_t n_buckets, hash_t hash, destructor_t destroy_key, destructor_t destroy_val, comparator_t compare) {
     map_t *res = malloc(sizeof(map_t));
-    res->buckets = calloc(n_buckets, sizeof(list_t*));
-    assert(res->buckets != NULL);
-    res->n_buckets = n_buckets;
+    assert(res != NULL);
+    map_alloc(res, n_buckets > MAP_MIN_CAPACITY ? n_buckets : MAP_MIN_CAPACITY);
     res->size = 0;
     res->destroy_key = destroy_key;
     res->destroy_val = destroy_val;
@@ -60,83 +132,84 @@ map_t* map_create(size_t n_buckets, hash_t hash, destructor_t destroy_key, destr
     return res;
 }
 
-
-static entry_t* map_get_entry(const map_t *map, const void *key) {
-    size_t bi = map_get_bucket(map, key);
-    list_t *bucket = map->buckets[bi];
-    if (bucket == NULL) return NULL;
-    entry_t e = {key, NULL, map};
-    size_t ei = list_find(bucket, &e, (comparator_t) entry_compare);
-    if (ei == list_size(bucket)) return NULL;
-    return list_get(bucket, ei);
-}
-
 void* map_get(const map_t *map, const void *key) {
-    entry_t *e = map_get_entry(map, key);
-    if (e == NULL) return NULL;
-    return e->val;
+    size_t i = map_find(map, key, mix(map->hash((void *) key)));
+    if (i == map->capacity) return NULL;
+    return map->slots[i].val;
 }
 
 void* map_set(map_t *map, void *key, void *val) {
-
-    entry_t *old_entry = map_get_entry(map, key);
-    if (old_entry != NULL) {
-        void *old_key = old_entry->key;
-        void *old_val = old_entry->val;
-        old_entry->key = key;
-        old_entry->val = val;
+    size_t hash = mix(map->hash(key));
+    size_t i = map_find(map, key, hash);
+    if (i != map->capacity) {
+        void *old_key = map->slots[i].key;
+        void *old_val = map->slots[i].val;
+        map->slots[i].key = key;
+        map->slots[i].val = val;
         if (map->destroy_key) map->destroy_key(old_key);
         return old_val;
     }
 
-    size_t i = map_get_bucket(map, key);
-    list_t *bucket = map->buckets[i];
-    entry_t *entry = malloc(sizeof(entry_t));
-    assert(entry != NULL);
-    entry->key = key;
-    entry->val = val;
-    entry->map = map;
-
-    if (bucket == NULL) {
-        list_t *list = list_create(1);
-        list_add(list, entry);
-        map->buckets[i] = list;
-        map->size += 1;
-    } else {
-        list_add(bucket, entry);
-        map->size += 1;
-    }
-
+    map_reserve(map);
+    map_insert(map, (slot_t) {key, val, hash, 0});
     return NULL;
 }
 
+void** map_get_or_insert(map_t *map, void *key, bool *inserted) {
+    assert(map != NULL);
+    size_t hash = mix(map->hash(key));
+    size_t i = map_find(map, key, hash);
+    if (inserted != NULL) *inserted = i == map->capacity;
+    if (i == map->capacity) {
+        map_reserve(map);
+        i = map_insert(map, (slot_t) {key, NULL, hash, 0});
+    }
+    return &map->slots[i].val;
+}
+
+bool map_next(const map_t *map, size_t *cursor, void **key, void **val) {
+    assert(map != NULL);
+    assert(cursor != NULL);
+    while (*cursor < map->capacity) {
+        const slot_t *slot = &map->slots[*cursor];
+        *cursor += 1;
+        if (slot->dist == 0) continue;
+        if (key != NULL) *key = slot->key;
+        if (val != NULL) *val = slot->val;
+        return true;
+    }
+    return false;
+}
 
 void* map_remove(map_t *map, const void *key) {
     assert(map != NULL);
-    size_t bi = map_get_bucket(map, key);
-    list_t *bucket = map->buckets[bi];
-    if (bucket == NULL) return NULL;
-    entry_t e = {key, NULL, map};
-    size_t ei = list_find(bucket, &e, (comparator_t) entry_compare);
-    if (ei == list_size(bucket)) return NULL;   
-    entry_t *entry = list_remove(bucket, ei);
-    void *old_key = entry->key;
-    void *val = entry->val;
+    size_t i = map_find(map, key, mix(map->hash((void *) key)));
+    if (i == map->capacity) return NULL;
+    void *old_key = map->slots[i].key;
+    void *val = map->slots[i].val;
+
+    /* shift the following entries of the probe sequence back by one slot */
+    size_t next = map_probe_next(map, i);
+    while (map->slots[next].dist > 1) {
+        map->slots[i] = map->slots[next];
+        map->slots[i].dist -= 1;
+        i = next;
+        next = map_probe_next(map, next);
+    }
+    map->slots[i].dist = 0;
+    map->size -= 1;
+
     if (map->destroy_key) map->destroy_key(old_key);
-    free(entry);
     return val;
 }
 
 void map_destroy(map_t *map) {
-    for (size_t i = 0; i < map->n_buckets; i++) {
-        list_t *bucket = map->buckets[i];
-        if (bucket == NULL) continue;
-        for (size_t j = 0; j < list_size(bucket); j++) {
-            entry_t *e = list_get(bucket, j);
-            entry_destroy(e);
-        }
-        list_destroy(bucket, NULL);
+    if (map == NULL) return;
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (map->slots[i].dist == 0) continue;
+        if (map->destroy_key) map->destroy_key(map->slots[i].key);
+        if (map->destroy_val) map->destroy_val(map->slots[i].val);
     }
-    free(map->buckets);
+    free(map->slots);
     free(map);
 }
@@ -0,0 +1,72 @@
+#include "util/mpsc_queue.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/*
+ * The queue is Vyukov's MPSC queue over heap allocated nodes. The nodes form
+ * a singly linked list from the tail, where the consumer pops, to the head,
+ * where producers push. The tail node is a stub whose item has already been
+ * popped. A producer swaps its node in as the head and only then links the
+ * previous head to it, so for a moment the list is cut, and the consumer
+ * sees the queue as empty up to the cut.
+ */
+typedef struct node {
+    _Atomic(struct node*) next;
+    void *item;
+} node_t;
+
+struct mpsc_queue {
+    _Atomic(node_t*) head;
+    node_t *tail;
+};
+
+static node_t* node_create(void *item) {
+    node_t *node = malloc(sizeof(node_t));
+    assert(node != NULL);
+    atomic_init(&node->next, NULL);
+    node->item = item;
+    return node;
+}
+
+mpsc_queue_t* mpsc_queue_create() {
+    mpsc_queue_t *result = malloc(sizeof(mpsc_queue_t));
+    assert(result != NULL);
+    node_t *stub = node_create(NULL);
+    atomic_init(&result->head, stub);
+    result->tail = stub;
+    return result;
+}
+
+void mpsc_queue_destroy(mpsc_queue_t *self, void (*destroy)(void*)) {
+    if (self == NULL) return;
+    void *item;
+    while ((item = mpsc_queue_pop(self)) != NULL) {
+        if (destroy != NULL) destroy(item);
+    }
+    free(self->tail);
+    free(self);
+}
+
+void mpsc_queue_push(mpsc_queue_t *self, void *item) {
+    assert(self != NULL);
+    assert(item != NULL);
+    node_t *node = node_create(item);
+    node_t *prev = atomic_exchange_explicit(&self->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+void* mpsc_queue_pop(mpsc_queue_t *self) {
+    assert(self != NULL);
+    node_t *tail = self->tail;
+    node_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next == NULL) return NULL;
+
+    /* the popped node becomes the new stub */
+    self->tail = next;
+    void *item = next->item;
+    next->item = NULL;
+    free(tail);
+    return item;
+}
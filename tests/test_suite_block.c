@@ -0,0 +1,176 @@
+#include "test_util.h"
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <sodium.h>
+#include <block.h>
+#include <transaction.h>
+#include <tuple.h>
+#include <util/list.h>
+
+#define N_TXNS 3
+
+static uint8_t pk[crypto_vrf_PUBLICKEYBYTES];
+static uint8_t sk[crypto_vrf_SECRETKEYBYTES];
+
+/*
+ * Create a block with N_TXNS transactions on top of the given block.
+ */
+static block_t* create_block(block_t *prev) {
+    uint8_t recipient[crypto_vrf_PUBLICKEYBYTES] = {1};
+    block_builder_t *builder = block_builder_create(prev, pk, 1 << 20);
+    for (uint32_t i = 0; i < N_TXNS; i++) {
+        transaction_t *txn = transaction_create(pk, sk, recipient, 1, i);
+        assert(block_builder_add(builder, txn));
+    }
+    block_t *block = block_builder_finish(builder, sk);
+    assert(block != NULL);
+    assert(block_get_transaction_count(block) == N_TXNS);
+    return block;
+}
+
+/*
+ * Rebuild the full block tuple from the header and signature of a compact
+ * block and the given transactions, the way a receiving node does.
+ */
+static tuple_t* rebuild(tuple_t *compact, transaction_t **txns, dynamic_buffer_t *buf) {
+    tuple_t *header = tuple_get_tuple(compact, 0);
+    buffer_t signature = tuple_get_binary(compact, 1);
+    buf->length = 0;
+    tuple_write_start(buf);
+    dynamic_buffer_write(header->start, header->length, buf);
+    tuple_write_binary(buf, signature.length, signature.data);
+    tuple_write_start(buf);
+    for (size_t i = 0; i < N_TXNS; i++) {
+        transaction_write(txns[i], buf);
+    }
+    tuple_write_end(buf);
+    tuple_write_end(buf);
+    return tuple_parse((buffer_t *) buf);
+}
+
+static uint64_t read_short_id(const uint8_t *data) {
+    uint64_t id = 0;
+    for (size_t i = 0; i < crypto_shorthash_BYTES; i++) {
+        id = (id << 8) | data[i];
+    }
+    return id;
+}
+
+void test_is_valid() {
+    block_t *genesis = block_create(pk, sk, NULL, list_create(1));
+    block_t *block = create_block(genesis);
+
+    dynamic_buffer_t buf = dynamic_buffer_create(64);
+    block_write(block, &buf);
+    tuple_t *tuple = tuple_parse((buffer_t *) &buf);
+    assert(tuple != NULL);
+    assert(block_is_valid(tuple));
+    tuple_destroy(tuple);
+
+    /* transactions in another order no longer match the merkle root */
+    buf.length = 0;
+    block_write_compact(block, &buf);
+    tuple_t *compact = tuple_parse((buffer_t *) &buf);
+    transaction_t *txns[N_TXNS];
+    for (size_t i = 0; i < N_TXNS; i++) {
+        txns[i] = block_get_transaction(block, N_TXNS - 1 - i);
+    }
+    dynamic_buffer_t rebuilt = dynamic_buffer_create(64);
+    tuple = rebuild(compact, txns, &rebuilt);
+    assert(tuple != NULL);
+    assert(!block_is_valid(tuple));
+
+    tuple_destroy(tuple);
+    dynamic_buffer_destroy(rebuilt);
+    tuple_destroy(compact);
+    dynamic_buffer_destroy(buf);
+    block_destroy(block);
+    block_destroy(genesis);
+}
+
+void test_write_compact() {
+    block_t *genesis = block_create(pk, sk, NULL, list_create(1));
+    block_t *block = create_block(genesis);
+
+    dynamic_buffer_t buf = dynamic_buffer_create(64);
+    block_write_compact(block, &buf);
+    tuple_t *compact = tuple_parse((buffer_t *) &buf);
+    assert(compact != NULL);
+    assert(tuple_size(compact) == 3);
+
+    /* the header hashes to the block hash, which keys the short ids */
+    tuple_t *header = tuple_get_tuple(compact, 0);
+    uint8_t hash[crypto_generichash_BYTES];
+    crypto_generichash(hash, sizeof(hash), header->start, header->length, NULL, 0);
+    assert(memcmp(hash, block_get_hash(block), sizeof(hash)) == 0);
+    assert(tuple_get_u32(header, 6) == N_TXNS);
+
+    buffer_t ids = tuple_get_binary(compact, 2);
+    assert(ids.length == N_TXNS * crypto_shorthash_BYTES);
+    for (size_t i = 0; i < N_TXNS; i++) {
+        uint64_t id = read_short_id(ids.data + i * crypto_shorthash_BYTES);
+        assert(id == transaction_get_short_id(block_get_transaction(block, i), hash));
+    }
+
+    tuple_destroy(compact);
+    dynamic_buffer_destroy(buf);
+    block_destroy(block);
+    block_destroy(genesis);
+}
+
+void test_compact_collision() {
+    block_t *genesis = block_create(pk, sk, NULL, list_create(1));
+    block_t *block = create_block(genesis);
+
+    dynamic_buffer_t buf = dynamic_buffer_create(64);
+    block_write_compact(block, &buf);
+    tuple_t *compact = tuple_parse((buffer_t *) &buf);
+    assert(compact != NULL);
+
+    transaction_t *txns[N_TXNS];
+    for (size_t i = 0; i < N_TXNS; i++) {
+        txns[i] = block_get_transaction(block, i);
+    }
+
+    /* the block rebuilt from the right transactions is valid */
+    dynamic_buffer_t rebuilt = dynamic_buffer_create(64);
+    tuple_t *tuple = rebuild(compact, txns, &rebuilt);
+    assert(tuple != NULL);
+    assert(block_is_valid(tuple));
+    tuple_destroy(tuple);
+
+    /*
+     * a pool transaction whose short id collides with one of the block is
+     * picked instead, which the merkle root reveals
+     */
+    uint8_t recipient[crypto_vrf_PUBLICKEYBYTES] = {2};
+    transaction_t *colliding = transaction_create(pk, sk, recipient, 1, 1);
+    txns[1] = colliding;
+    tuple = rebuild(compact, txns, &rebuilt);
+    assert(tuple != NULL);
+    assert(!block_is_valid(tuple));
+    tuple_destroy(tuple);
+
+    /* retrying with all transactions of the block from the sender succeeds */
+    txns[1] = block_get_transaction(block, 1);
+    tuple = rebuild(compact, txns, &rebuilt);
+    assert(tuple != NULL);
+    assert(block_is_valid(tuple));
+    tuple_destroy(tuple);
+
+    transaction_destroy(colliding);
+    dynamic_buffer_destroy(rebuilt);
+    tuple_destroy(compact);
+    dynamic_buffer_destroy(buf);
+    block_destroy(block);
+    block_destroy(genesis);
+}
+
+int main(int argc, char *argv[]) {
+    assert(sodium_init() >= 0);
+    crypto_vrf_keypair(pk, sk);
+    DO_TEST(test_is_valid)
+    DO_TEST(test_write_compact)
+    DO_TEST(test_compact_collision)
+}
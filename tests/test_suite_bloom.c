@@ -0,0 +1,61 @@
+#include "test_util.h"
+#include <assert.h>
+#include <sodium.h>
+#include <util/bloom.h>
+
+static bool has(bloom_t *bloom, uint64_t i) {
+    return bloom_has(bloom, (uint8_t *) &i, sizeof(i));
+}
+
+static void add(bloom_t *bloom, uint64_t i) {
+    bloom_add(bloom, (uint8_t *) &i, sizeof(i));
+}
+
+void test_create() {
+    bloom_t *bloom = bloom_create(1000, 0.01);
+    assert(bloom_get_size(bloom) > 0);
+    assert(!has(bloom, 1));
+    bloom_destroy(bloom);
+}
+
+void test_add() {
+    bloom_t *bloom = bloom_create(1000, 0.01);
+    for (uint64_t i = 0; i < 1000; i++) add(bloom, i);
+    for (uint64_t i = 0; i < 1000; i++) assert(has(bloom, i));
+    bloom_destroy(bloom);
+}
+
+void test_false_positive_rate() {
+    bloom_t *bloom = bloom_create(10000, 0.01);
+    for (uint64_t i = 0; i < 20000; i++) add(bloom, i);
+    size_t false_positives = 0;
+    for (uint64_t i = 20000; i < 120000; i++) {
+        if (has(bloom, i)) false_positives += 1;
+    }
+    assert(false_positives < 2000);
+    bloom_destroy(bloom);
+}
+
+void test_rotate() {
+    bloom_t *bloom = bloom_create(100, 0.0001);
+    for (uint64_t i = 0; i < 1000; i++) {
+        add(bloom, i);
+
+        /* at least the last capacity keys are always remembered */
+        for (uint64_t j = i >= 99 ? i - 99 : 0; j <= i; j++) assert(has(bloom, j));
+    }
+    size_t remembered = 0;
+    for (uint64_t i = 0; i < 800; i++) {
+        if (has(bloom, i)) remembered += 1;
+    }
+    assert(remembered < 10);
+    bloom_destroy(bloom);
+}
+
+int main(int argc, char *argv[]) {
+    assert(sodium_init() >= 0);
+    DO_TEST(test_create)
+    DO_TEST(test_add)
+    DO_TEST(test_false_positive_rate)
+    DO_TEST(test_rotate)
+}
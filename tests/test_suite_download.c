@@ -0,0 +1,215 @@
+#include "test_util.h"
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <sodium.h>
+#include <download.h>
+
+/* the timeout of a window in download.c */
+#define TIMEOUT 10000
+#define MAX_REQUESTS 64
+#define MAX_BLOCKS 256
+
+/*
+ * The scheduler never dereferences peers, so any distinct addresses will do.
+ */
+static int peer_a, peer_b;
+#define A ((peer_t *) &peer_a)
+#define B ((peer_t *) &peer_b)
+
+typedef struct request {
+    peer_t *peer;
+    uint64_t window;
+    uint8_t hashes[16 * crypto_generichash_BYTES];
+    size_t n;
+} request_t;
+
+static request_t requests[MAX_REQUESTS];
+static size_t n_requests;
+static uint8_t delivered[MAX_BLOCKS];
+static size_t n_delivered;
+
+static void on_request(peer_t *peer, uint64_t window, const uint8_t *hashes, size_t n) {
+    assert(n_requests < MAX_REQUESTS);
+    assert(n <= 16);
+    requests[n_requests].peer = peer;
+    requests[n_requests].window = window;
+    memcpy(requests[n_requests].hashes, hashes, n * crypto_generichash_BYTES);
+    requests[n_requests].n = n;
+    n_requests += 1;
+}
+
+static void on_deliver(const uint8_t *body, size_t length) {
+    assert(length == 1);
+    assert(n_delivered < MAX_BLOCKS);
+    delivered[n_delivered++] = body[0];
+}
+
+/*
+ * Block i has a hash and a one byte body that are both i.
+ */
+static const uint8_t* block_hash(uint8_t i) {
+    static uint8_t hash[crypto_generichash_BYTES];
+    memset(hash, 0, sizeof(hash));
+    hash[0] = i;
+    return hash;
+}
+
+static download_t* create(size_t n_blocks) {
+    n_requests = 0;
+    n_delivered = 0;
+    download_t *download = download_create(on_request, on_deliver);
+    for (size_t i = 0; i < n_blocks; i++) {
+        assert(download_add(download, block_hash(i)));
+    }
+    return download;
+}
+
+static void receive(download_t *download, uint8_t i) {
+    download_receive(download, block_hash(i), &i, 1);
+}
+
+/*
+ * Answer the request with the first n of its blocks.
+ */
+static void answer(download_t *download, const request_t *request, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint8_t block = request->hashes[i * crypto_generichash_BYTES];
+        download_receive(download, block_hash(block), &block, 1);
+    }
+    download_complete(download, request->peer, request->window);
+}
+
+static void assert_delivered_in_order(size_t n) {
+    assert(n_delivered == n);
+    for (size_t i = 0; i < n; i++) {
+        assert(delivered[i] == i);
+    }
+}
+
+void test_in_order() {
+    download_t *download = create(40);
+    assert(!download_add(download, block_hash(0)));
+    assert(download_has(download, block_hash(39)));
+    download_add_peer(download, A);
+    download_add_peer(download, B);
+    download_schedule(download, 0);
+    assert(n_requests == 3);
+    assert(requests[0].n + requests[1].n + requests[2].n == 40);
+    for (size_t i = 0; i < n_requests; i++) {
+        assert(requests[i].window != 0);
+    }
+
+    /* bodies arriving out of order wait for the blocks before them */
+    for (int i = 39; i > 0; i--) {
+        receive(download, i);
+    }
+    assert(n_delivered == 0);
+    receive(download, 0);
+    assert_delivered_in_order(40);
+    assert(download_size(download) == 0);
+    assert(!download_has(download, block_hash(39)));
+    download_destroy(download);
+}
+
+void test_timeout() {
+    download_t *download = create(16);
+    download_add_peer(download, A);
+    download_add_peer(download, B);
+    download_schedule(download, 0);
+    assert(n_requests == 1);
+    peer_t *stalled = requests[0].peer;
+
+    /* the window of the stalled peer goes to the other peer */
+    download_schedule(download, TIMEOUT - 1);
+    assert(n_requests == 1);
+    download_schedule(download, TIMEOUT);
+    assert(n_requests == 2);
+    assert(requests[1].peer != stalled);
+    assert(requests[1].window != requests[0].window);
+    assert(requests[1].n == 16);
+    assert(memcmp(requests[1].hashes, requests[0].hashes, sizeof(requests[0].hashes)) == 0);
+
+    answer(download, &requests[1], 16);
+    assert_delivered_in_order(16);
+    download_destroy(download);
+}
+
+void test_late_response() {
+    download_t *download = create(16);
+    download_add_peer(download, A);
+    download_schedule(download, 0);
+    for (int i = 16; i < 32; i++) {
+        download_add(download, block_hash(i));
+    }
+    download_schedule(download, TIMEOUT / 2);
+    assert(n_requests == 2);
+    request_t first = requests[0];
+    request_t second = requests[1];
+
+    /* the first window times out and goes to another peer */
+    download_schedule(download, TIMEOUT);
+    download_add_peer(download, B);
+    download_schedule(download, TIMEOUT);
+    assert(n_requests == 3);
+    assert(requests[2].peer == B);
+
+    /* the late answer to the first window does not count for the second */
+    answer(download, &first, 16);
+    assert_delivered_in_order(16);
+    download_schedule(download, TIMEOUT + 1);
+    assert(n_requests == 3);
+
+    answer(download, &second, 16);
+    assert_delivered_in_order(32);
+    answer(download, &requests[2], 0);
+    assert(download_size(download) == 0);
+    download_destroy(download);
+}
+
+void test_single_peer() {
+    download_t *download = create(16);
+    download_add_peer(download, A);
+    download_schedule(download, 0);
+    assert(n_requests == 1);
+
+    /* the blocks left out of a partial answer are asked again */
+    answer(download, &requests[0], 8);
+    assert_delivered_in_order(8);
+    download_schedule(download, 1);
+    assert(n_requests == 2);
+    assert(requests[1].peer == A);
+    assert(requests[1].n == 8);
+    assert(requests[1].hashes[0] == 8);
+
+    answer(download, &requests[1], 8);
+    assert_delivered_in_order(16);
+    download_destroy(download);
+}
+
+void test_missing_other_peer() {
+    download_t *download = create(16);
+    download_add_peer(download, A);
+    download_add_peer(download, B);
+    download_schedule(download, 0);
+    assert(n_requests == 1);
+    peer_t *first = requests[0].peer;
+
+    /* with another peer around, blocks are not asked again from the first */
+    answer(download, &requests[0], 0);
+    download_schedule(download, 1);
+    assert(n_requests == 2);
+    assert(requests[1].peer != first);
+
+    answer(download, &requests[1], 16);
+    assert_delivered_in_order(16);
+    download_destroy(download);
+}
+
+int main(int argc, char *argv[]) {
+    DO_TEST(test_in_order)
+    DO_TEST(test_timeout)
+    DO_TEST(test_late_response)
+    DO_TEST(test_single_peer)
+    DO_TEST(test_missing_other_peer)
+}
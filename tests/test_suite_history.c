@@ -0,0 +1,47 @@
+#include "test_util.h"
+#include <assert.h>
+#include <util/history.h>
+
+static guid_t make_guid(uint32_t i) {
+    return (guid_t) {{i, i + 1, i + 2, i + 3}};
+}
+
+void test_create() {
+    history_t *history = history_create(4);
+    assert(history_size(history) == 0);
+    assert(!history_has(history, make_guid(1)));
+    history_destroy(history);
+}
+
+void test_add() {
+    history_t *history = history_create(4);
+    assert(history_add(history, make_guid(1)));
+    assert(!history_add(history, make_guid(1)));
+    assert(history_add(history, make_guid(2)));
+    assert(history_size(history) == 2);
+    assert(history_has(history, make_guid(1)));
+    assert(history_has(history, make_guid(2)));
+    assert(!history_has(history, make_guid(3)));
+    history_destroy(history);
+}
+
+void test_evict() {
+    history_t *history = history_create(100);
+    for (uint32_t i = 0; i < 1000; i++) {
+        assert(history_add(history, make_guid(i)));
+        assert(history_size(history) == (i < 100 ? i + 1 : 100));
+    }
+    for (uint32_t i = 0; i < 900; i++) {
+        assert(!history_has(history, make_guid(i)));
+    }
+    for (uint32_t i = 900; i < 1000; i++) {
+        assert(history_has(history, make_guid(i)));
+    }
+    history_destroy(history);
+}
+
+int main(int argc, char *argv[]) {
+    DO_TEST(test_create)
+    DO_TEST(test_add)
+    DO_TEST(test_evict)
+}
@@ -0,0 +1,112 @@
+#include "test_util.h"
+#include <assert.h>
+#include <string.h>
+#include <util/iblt.h>
+
+typedef struct decoded {
+    size_t inserted;
+    size_t removed;
+    uint64_t sum;
+} decoded_t;
+
+static void on_found(void *ctx, uint64_t key, bool inserted) {
+    decoded_t *decoded = ctx;
+    if (inserted) decoded->inserted += 1;
+    else decoded->removed += 1;
+    decoded->sum += key;
+}
+
+void test_create() {
+    iblt_t *iblt = iblt_create(10);
+    assert(iblt_size(iblt) == 12);
+    iblt_destroy(iblt);
+}
+
+void test_empty() {
+    iblt_t *iblt = iblt_create(30);
+    decoded_t decoded = {0};
+    assert(iblt_decode(iblt, on_found, &decoded));
+    assert(decoded.inserted == 0 && decoded.removed == 0);
+    iblt_destroy(iblt);
+}
+
+void test_insert_remove() {
+    iblt_t *iblt = iblt_create(30);
+    for (uint64_t i = 1; i <= 10; i++) iblt_insert(iblt, i * 7919);
+    for (uint64_t i = 1; i <= 5; i++) iblt_remove(iblt, i * 7919);
+    iblt_remove(iblt, 42);
+
+    decoded_t decoded = {0};
+    assert(iblt_decode(iblt, on_found, &decoded));
+    assert(decoded.inserted == 5);
+    assert(decoded.removed == 1);
+    assert(decoded.sum == (6 + 7 + 8 + 9 + 10) * 7919 + 42);
+    iblt_destroy(iblt);
+}
+
+void test_subtract() {
+    iblt_t *a = iblt_create(90);
+    iblt_t *b = iblt_create(90);
+
+    /* a large common set with a small symmetric difference */
+    for (uint64_t i = 0; i < 10000; i++) {
+        iblt_insert(a, i);
+        iblt_insert(b, i);
+    }
+    for (uint64_t i = 0; i < 20; i++) iblt_insert(a, 100000 + i);
+    for (uint64_t i = 0; i < 30; i++) iblt_insert(b, 200000 + i);
+
+    assert(iblt_subtract(a, b));
+    decoded_t decoded = {0};
+    assert(iblt_decode(a, on_found, &decoded));
+    assert(decoded.inserted == 20);
+    assert(decoded.removed == 30);
+
+    iblt_t *c = iblt_create(3);
+    assert(!iblt_subtract(b, c));
+
+    iblt_destroy(a);
+    iblt_destroy(b);
+    iblt_destroy(c);
+}
+
+void test_overflow() {
+    iblt_t *iblt = iblt_create(30);
+    for (uint64_t i = 0; i < 1000; i++) iblt_insert(iblt, i);
+    decoded_t decoded = {0};
+    assert(!iblt_decode(iblt, on_found, &decoded));
+    iblt_destroy(iblt);
+}
+
+void test_serialize() {
+    iblt_t *iblt = iblt_create(30);
+    iblt_insert(iblt, UINT64_MAX);
+    iblt_remove(iblt, 1);
+
+    dynamic_buffer_t buf = dynamic_buffer_create(64);
+    iblt_write(iblt, &buf);
+    assert(buf.length == iblt_size(iblt) * IBLT_CELL_SIZE);
+
+    iblt_t *copy = iblt_create_from_buffer((buffer_t) {buf.length, buf.data});
+    assert(copy != NULL);
+    assert(iblt_subtract(copy, iblt));
+    decoded_t decoded = {0};
+    assert(iblt_decode(copy, on_found, &decoded));
+    assert(decoded.inserted == 0 && decoded.removed == 0);
+
+    assert(iblt_create_from_buffer((buffer_t) {buf.length - 1, buf.data}) == NULL);
+    assert(iblt_create_from_buffer((buffer_t) {IBLT_CELL_SIZE, buf.data}) == NULL);
+
+    dynamic_buffer_destroy(buf);
+    iblt_destroy(iblt);
+    iblt_destroy(copy);
+}
+
+int main(int argc, char *argv[]) {
+    DO_TEST(test_create)
+    DO_TEST(test_empty)
+    DO_TEST(test_insert_remove)
+    DO_TEST(test_subtract)
+    DO_TEST(test_overflow)
+    DO_TEST(test_serialize)
+}
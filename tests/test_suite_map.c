@@ -0,0 +1,161 @@
+#include "test_util.h"
+#include <assert.h>
+#include <stdint.h>
+#include <util/map.h>
+
+static size_t n_destroyed = 0;
+
+static size_t long_hash(void *key) {
+    return (size_t) key;
+}
+
+static size_t bad_hash(void *key) {
+    return 1;
+}
+
+static int long_cmp(void *a, void *b) {
+    return (long) a - (long) b;
+}
+
+static void count_destroy(void *val) {
+    n_destroyed += 1;
+}
+
+void test_create() {
+    map_t *map = map_create(16, long_hash, NULL, NULL, long_cmp);
+    assert(map_size(map) == 0);
+    assert(map_get(map, (void *) 1) == NULL);
+    map_destroy(map);
+}
+
+void test_set() {
+    map_t *map = map_create(16, long_hash, NULL, NULL, long_cmp);
+    assert(map_set(map, (void *) 1, (void *) 10) == NULL);
+    assert(map_set(map, (void *) 2, (void *) 20) == NULL);
+    assert(map_size(map) == 2);
+    assert(map_get(map, (void *) 1) == (void *) 10);
+    assert(map_get(map, (void *) 2) == (void *) 20);
+
+    /* replacing a value returns the old value */
+    assert(map_set(map, (void *) 1, (void *) 11) == (void *) 10);
+    assert(map_get(map, (void *) 1) == (void *) 11);
+    assert(map_size(map) == 2);
+    map_destroy(map);
+}
+
+void test_remove() {
+    map_t *map = map_create(16, long_hash, NULL, NULL, long_cmp);
+    map_set(map, (void *) 1, (void *) 10);
+    map_set(map, (void *) 2, (void *) 20);
+    assert(map_remove(map, (void *) 1) == (void *) 10);
+    assert(map_remove(map, (void *) 1) == NULL);
+    assert(map_get(map, (void *) 1) == NULL);
+    assert(map_get(map, (void *) 2) == (void *) 20);
+    assert(map_size(map) == 1);
+    map_destroy(map);
+}
+
+void test_resize() {
+    map_t *map = map_create(1, long_hash, NULL, NULL, long_cmp);
+    for (long i = 1; i <= 100000; i++) {
+        map_set(map, (void *) i, (void *) (i * 2));
+    }
+    assert(map_size(map) == 100000);
+    for (long i = 1; i <= 100000; i++) {
+        assert(map_get(map, (void *) i) == (void *) (i * 2));
+    }
+    for (long i = 1; i <= 100000; i += 2) {
+        assert(map_remove(map, (void *) i) == (void *) (i * 2));
+    }
+    assert(map_size(map) == 50000);
+    for (long i = 1; i <= 100000; i++) {
+        void *expected = i % 2 == 0 ? (void *) (i * 2) : NULL;
+        assert(map_get(map, (void *) i) == expected);
+    }
+    map_destroy(map);
+}
+
+void test_collisions() {
+    map_t *map = map_create(16, bad_hash, NULL, NULL, long_cmp);
+    for (long i = 1; i <= 100; i++) {
+        map_set(map, (void *) i, (void *) i);
+    }
+    for (long i = 1; i <= 100; i += 3) {
+        assert(map_remove(map, (void *) i) == (void *) i);
+    }
+    for (long i = 1; i <= 100; i++) {
+        void *expected = i % 3 == 1 ? NULL : (void *) i;
+        assert(map_get(map, (void *) i) == expected);
+    }
+    map_destroy(map);
+}
+
+void test_destroy() {
+    n_destroyed = 0;
+    map_t *map = map_create(16, long_hash, count_destroy, count_destroy, long_cmp);
+    map_set(map, (void *) 1, (void *) 10);
+    map_set(map, (void *) 2, (void *) 20);
+
+    /* replacing a key destroys the old key but not the old value */
+    map_set(map, (void *) 1, (void *) 11);
+    assert(n_destroyed == 1);
+
+    /* removing a key destroys the key but not the value */
+    map_remove(map, (void *) 2);
+    assert(n_destroyed == 2);
+
+    map_destroy(map);
+    assert(n_destroyed == 4);
+}
+
+void test_get_or_insert() {
+    map_t *map = map_create(1, long_hash, NULL, NULL, long_cmp);
+    bool inserted;
+    for (long i = 1; i <= 1000; i++) {
+        void **slot = map_get_or_insert(map, (void *) i, &inserted);
+        assert(inserted);
+        assert(*slot == NULL);
+        *slot = (void *) (i * 2);
+    }
+    for (long i = 1; i <= 1000; i++) {
+        void **slot = map_get_or_insert(map, (void *) i, &inserted);
+        assert(!inserted);
+        assert(*slot == (void *) (i * 2));
+    }
+    assert(map_size(map) == 1000);
+    map_destroy(map);
+}
+
+void test_iterate() {
+    map_t *map = map_create(16, long_hash, NULL, NULL, long_cmp);
+    size_t cursor = 0;
+    assert(!map_next(map, &cursor, NULL, NULL));
+
+    long sum = 0;
+    for (long i = 1; i <= 100; i++) {
+        map_set(map, (void *) i, (void *) (i * 2));
+        sum += i;
+    }
+    size_t count = 0;
+    void *key, *val;
+    cursor = 0;
+    while (map_next(map, &cursor, &key, &val)) {
+        assert(val == (void *) ((long) key * 2));
+        sum -= (long) key;
+        count += 1;
+    }
+    assert(count == 100);
+    assert(sum == 0);
+    map_destroy(map);
+}
+
+int main(int argc, char *argv[]) {
+    DO_TEST(test_create)
+    DO_TEST(test_set)
+    DO_TEST(test_remove)
+    DO_TEST(test_resize)
+    DO_TEST(test_collisions)
+    DO_TEST(test_destroy)
+    DO_TEST(test_get_or_insert)
+    DO_TEST(test_iterate)
+}
@@ -0,0 +1,102 @@
+#include "test_util.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <util/mpsc_queue.h>
+
+#define N_PRODUCERS 4
+#define N_ITEMS 100000
+
+static size_t n_destroyed = 0;
+
+static void count_destroy(void *item) {
+    n_destroyed += 1;
+}
+
+/*
+ * Items are (producer, sequence number) pairs packed into a pointer, offset
+ * by one so that they are never NULL.
+ */
+static void* make_item(uintptr_t producer, uintptr_t i) {
+    return (void *) (producer * N_ITEMS + i + 1);
+}
+
+static void* produce(void *arg) {
+    mpsc_queue_t *queue = ((void **) arg)[0];
+    uintptr_t producer = (uintptr_t) ((void **) arg)[1];
+    for (uintptr_t i = 0; i < N_ITEMS; i++) {
+        mpsc_queue_push(queue, make_item(producer, i));
+    }
+    return NULL;
+}
+
+void test_create() {
+    mpsc_queue_t *queue = mpsc_queue_create();
+    assert(mpsc_queue_pop(queue) == NULL);
+    mpsc_queue_destroy(queue, NULL);
+}
+
+void test_order() {
+    mpsc_queue_t *queue = mpsc_queue_create();
+    for (uintptr_t i = 0; i < 1000; i++) {
+        mpsc_queue_push(queue, make_item(0, i));
+    }
+    for (uintptr_t i = 0; i < 1000; i++) {
+        assert(mpsc_queue_pop(queue) == make_item(0, i));
+    }
+    assert(mpsc_queue_pop(queue) == NULL);
+
+    /* the queue keeps working after it has been emptied */
+    mpsc_queue_push(queue, make_item(0, 7));
+    assert(mpsc_queue_pop(queue) == make_item(0, 7));
+    assert(mpsc_queue_pop(queue) == NULL);
+    mpsc_queue_destroy(queue, NULL);
+}
+
+void test_destroy() {
+    n_destroyed = 0;
+    mpsc_queue_t *queue = mpsc_queue_create();
+    for (uintptr_t i = 0; i < 10; i++) {
+        mpsc_queue_push(queue, make_item(0, i));
+    }
+    mpsc_queue_pop(queue);
+    mpsc_queue_destroy(queue, count_destroy);
+    assert(n_destroyed == 9);
+}
+
+void test_producers() {
+    mpsc_queue_t *queue = mpsc_queue_create();
+    pthread_t threads[N_PRODUCERS];
+    void *args[N_PRODUCERS][2];
+    for (uintptr_t p = 0; p < N_PRODUCERS; p++) {
+        args[p][0] = queue;
+        args[p][1] = (void *) p;
+        assert(pthread_create(&threads[p], NULL, produce, args[p]) == 0);
+    }
+
+    /* every item arrives once, and the items of a producer arrive in order */
+    uintptr_t next[N_PRODUCERS] = {0};
+    size_t n_popped = 0;
+    while (n_popped < N_PRODUCERS * N_ITEMS) {
+        uintptr_t item = (uintptr_t) mpsc_queue_pop(queue);
+        if (item == 0) continue;
+        uintptr_t producer = (item - 1) / N_ITEMS;
+        uintptr_t i = (item - 1) % N_ITEMS;
+        assert(producer < N_PRODUCERS);
+        assert(i == next[producer]);
+        next[producer] += 1;
+        n_popped += 1;
+    }
+    for (uintptr_t p = 0; p < N_PRODUCERS; p++) {
+        pthread_join(threads[p], NULL);
+    }
+    assert(mpsc_queue_pop(queue) == NULL);
+    mpsc_queue_destroy(queue, NULL);
+}
+
+int main(int argc, char *argv[]) {
+    DO_TEST(test_create)
+    DO_TEST(test_order)
+    DO_TEST(test_destroy)
+    DO_TEST(test_producers)
+}
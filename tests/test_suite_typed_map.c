@@ -0,0 +1,142 @@
+#include "test_util.h"
+#include <assert.h>
+#include <util/typed_map.h>
+#include <util/typed_heap.h>
+
+static size_t n_destroyed = 0;
+
+static void count_destroy(long *val) {
+    n_destroyed += 1;
+}
+
+static bool long_less(const long *a, const long *b) {
+    return *a < *b;
+}
+
+TYPED_MAP(long_map, digest_t, long*, digest_hash, digest_equal)
+TYPED_SET(guid_set, guid_t, guid_hash, guid_equal)
+TYPED_HEAP(long_heap, long, long_less)
+
+static digest_t make_digest(long i) {
+    digest_t digest = {{0}};
+    memcpy(digest.bytes, &i, sizeof(long));
+    memcpy(digest.bytes + DIGEST_BYTES - sizeof(long), &i, sizeof(long));
+    return digest;
+}
+
+void test_map() {
+    static long values[1000];
+    long_map_t *map = long_map_create(1, NULL);
+    for (long i = 0; i < 1000; i++) {
+        digest_t key = make_digest(i);
+        values[i] = i;
+        assert(long_map_set(map, &key, &values[i]) == NULL);
+    }
+    assert(long_map_size(map) == 1000);
+    for (long i = 0; i < 1000; i += 2) {
+        digest_t key = make_digest(i);
+        assert(long_map_remove(map, &key) == &values[i]);
+    }
+    assert(long_map_size(map) == 500);
+    for (long i = 0; i < 1000; i++) {
+        digest_t key = make_digest(i);
+        long *expected = i % 2 == 0 ? NULL : &values[i];
+        assert(long_map_get(map, &key) == expected);
+    }
+
+    /* replacing a value returns the old value */
+    digest_t key = make_digest(1);
+    assert(long_map_set(map, &key, &values[0]) == &values[1]);
+    assert(long_map_get(map, &key) == &values[0]);
+    long_map_destroy(map);
+}
+
+void test_map_destroy() {
+    static long values[10];
+    n_destroyed = 0;
+    long_map_t *map = long_map_create(16, count_destroy);
+    for (long i = 0; i < 10; i++) {
+        digest_t key = make_digest(i);
+        long_map_set(map, &key, &values[i]);
+    }
+    digest_t key = make_digest(0);
+    long_map_remove(map, &key);
+    assert(n_destroyed == 0);
+    long_map_destroy(map);
+    assert(n_destroyed == 9);
+}
+
+void test_map_get_or_insert() {
+    static long values[1000];
+    long_map_t *map = long_map_create(1, NULL);
+    bool inserted;
+    for (long i = 0; i < 1000; i++) {
+        digest_t key = make_digest(i);
+        long **slot = long_map_get_or_insert(map, &key, &inserted);
+        assert(inserted && *slot == NULL);
+        *slot = &values[i];
+    }
+    for (long i = 0; i < 1000; i++) {
+        digest_t key = make_digest(i);
+        long **slot = long_map_get_or_insert(map, &key, &inserted);
+        assert(!inserted && *slot == &values[i]);
+    }
+
+    size_t count = 0;
+    size_t cursor = 0;
+    const digest_t *key;
+    long *val;
+    while (long_map_next(map, &cursor, &key, &val)) {
+        digest_t expected = make_digest(val - values);
+        assert(digest_equal(key, &expected));
+        count += 1;
+    }
+    assert(count == 1000);
+    long_map_destroy(map);
+}
+
+void test_set() {
+    guid_set_t *set = guid_set_create(4);
+    guid_t a = guid_new();
+    guid_t b = guid_new();
+    assert(!guid_set_has(set, &a));
+    assert(guid_set_add(set, &a));
+    assert(!guid_set_add(set, &a));
+    assert(guid_set_add(set, &b));
+    assert(guid_set_size(set) == 2);
+    assert(guid_set_remove(set, &a));
+    assert(!guid_set_remove(set, &a));
+    assert(!guid_set_has(set, &a));
+    assert(guid_set_has(set, &b));
+
+    size_t cursor = 0;
+    const guid_t *key;
+    assert(guid_set_next(set, &cursor, &key));
+    assert(guid_equal(key, &b));
+    assert(!guid_set_next(set, &cursor, &key));
+    guid_set_destroy(set);
+}
+
+void test_heap() {
+    long_heap_t *heap = long_heap_create(0);
+    long values[] = {5, 3, 9, 1, 7, 3, 8, 2};
+    for (size_t i = 0; i < 8; i++) long_heap_add(heap, values[i]);
+    assert(long_heap_size(heap) == 8);
+    assert(long_heap_top(heap) == 1);
+    long prev = long_heap_pop(heap);
+    while (long_heap_size(heap) > 0) {
+        long next = long_heap_pop(heap);
+        assert(prev <= next);
+        prev = next;
+    }
+    assert(prev == 9);
+    long_heap_destroy(heap);
+}
+
+int main(int argc, char *argv[]) {
+    DO_TEST(test_map)
+    DO_TEST(test_map_destroy)
+    DO_TEST(test_map_get_or_insert)
+    DO_TEST(test_set)
+    DO_TEST(test_heap)
+}